@@ -0,0 +1,200 @@
+/*
+ * Aging and fragmentation benchmark
+ *
+ * agebench.c
+ *
+ * Ages a volume with create/append/delete churn through the fs_* API
+ * (as logs and spool files do: files grow by small appends interleaved
+ * with the others and get removed at random) and, after each epoch of
+ * churn, measures:
+ *   - the sequential read throughput over all the live files;
+ *   - the latency of the appends of the epoch (which allocate blocks);
+ *   - the fragmentation: extents per file and histogram of the free runs.
+ * The churn comes from a fixed seed, so allocator changes can be compared
+ * on the same aged volume. Each epoch prints one JSON line.
+ *
+ * Usage: agebench [-b blocks] [-e epochs] [-o ops] [-s seed] [-l label]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define MAX_FILES 56          // live files (the volume has 64 inodes)
+#define FILE_MAX (10*512)     // largest file
+#define APPEND_MAX 1024       // largest append
+#define READ_PASSES 20        // reads of all the files per measure
+#define RUN_BUCKETS 10        // free runs of 1 to 512+ blocks
+
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+/*
+ * The live files
+ */
+
+typedef struct {
+  inodeid_t id;
+  char name[FS_MAX_FNAME_SZ];
+  unsigned size;
+} age_file_t;
+
+static age_file_t files[MAX_FILES];
+static int live;
+static unsigned created;
+
+static int age_create(fs_t* fs)
+{
+  age_file_t* f = &files[live];
+  snprintf(f->name, sizeof(f->name), "a%u", created++);
+  if (fs_create(fs, 1, f->name, &f->id) != 0) {
+    return -1;
+  }
+  f->size = 0;
+  live++;
+  return 0;
+}
+
+static void age_remove(fs_t* fs, int i)
+{
+  inodeid_t id;
+  fs_remove(fs, 1, files[i].name, &id);
+  files[i] = files[--live];
+}
+
+
+int main(int argc, char* argv[])
+{
+  unsigned blocks = 1024, seed = 1;
+  long epochs = 20, ops = 2000;
+  const char* label = "";
+  static char buf[FILE_MAX];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:e:o:s:l:")) != -1) {
+    switch (opt) {
+    case 'b':
+      blocks = atoi(optarg);
+      break;
+    case 'e':
+      epochs = atol(optarg);
+      break;
+    case 'o':
+      ops = atol(optarg);
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: agebench [-b blocks] [-e epochs] [-o ops] [-s seed] [-l label]\n");
+      return 2;
+    }
+  }
+  if (blocks < 64 || blocks > 4096 || epochs < 1 || ops < 1) {
+    fprintf(stderr, "agebench: blocks must be 64-4096, epochs and ops positive\n");
+    return 2;
+  }
+
+  FILE* out = stdout;
+
+  fs_t* fs = fs_new(blocks);
+  fs_format(fs);
+  memset(buf, 'a', sizeof(buf));
+  double* lat = malloc(ops * sizeof(double));
+
+  for (long e = 1; e <= epochs; e++) {
+    long appends = 0;
+    fs_stats_t st;
+
+    // churn: creates (35%), appends (45%) and deletes (20%)
+    for (long k = 0; k < ops; k++) {
+      int r = rand_r(&seed) % 100;
+      fs_statfs(fs, &st);
+      if (live == 0 || (r < 35 && live < MAX_FILES && st.free_blocks > 2)) {
+        if (age_create(fs) != 0) {
+          age_remove(fs, rand_r(&seed) % live);
+        }
+        continue;
+      }
+      int i = rand_r(&seed) % live;
+      unsigned n = 1 + rand_r(&seed) % APPEND_MAX;
+      if (r < 80 && files[i].size + n <= FILE_MAX) {
+        double t0 = now_ns();
+        int res = fs_write(fs, files[i].id, files[i].size, n, buf);
+        lat[appends++] = now_ns() - t0;
+        if (res == 0) {
+          files[i].size += n;
+          continue;
+        }
+      }
+      // full file, full volume or chosen for removal
+      age_remove(fs, i);
+    }
+
+    // sequential read of every live file
+    unsigned long bytes = 0;
+    double t0 = now_ns();
+    for (int p = 0; p < READ_PASSES; p++) {
+      for (int i = 0; i < live; i++) {
+        int n;
+        fs_read(fs, files[i].id, 0, files[i].size, buf, &n);
+        bytes += n;
+      }
+    }
+    double read_ns = now_ns() - t0;
+
+    // fragmentation
+    int extents = 0, nonempty = 0;
+    for (int i = 0; i < live; i++) {
+      if (files[i].size > 0) {
+        extents += fs_file_extents(fs, files[i].id);
+        nonempty++;
+      }
+    }
+    unsigned hist[RUN_BUCKETS];
+    int runs = fs_free_runs(fs, hist, RUN_BUCKETS);
+    fs_statfs(fs, &st);
+
+    qsort(lat, appends, sizeof(double), cmp_double);
+    fprintf(out, "{\"label\":\"%s\",\"epoch\":%ld,\"ops\":%ld,\"files\":%d,"
+      "\"used_pct\":%.1f,\"seqread_mb_s\":%.2f,\"append_p50_us\":%.2f,"
+      "\"append_p99_us\":%.2f,\"extents_per_file\":%.2f,\"free_runs\":%d,"
+      "\"free_run_hist\":[",
+      label, e, e * ops, live,
+      100.0 * (st.num_blocks - st.free_blocks) / st.num_blocks,
+      read_ns > 0 ? bytes / (read_ns / 1e3) : 0.0,
+      appends ? lat[appends / 2] / 1e3 : 0.0,
+      appends ? lat[appends * 99 / 100] / 1e3 : 0.0,
+      nonempty ? (double) extents / nonempty : 0.0, runs);
+    for (int b = 0; b < RUN_BUCKETS; b++) {
+      fprintf(out, "%s%u", b ? "," : "", hist[b]);
+    }
+    fprintf(out, "]}\n");
+    fflush(out);
+  }
+
+  free(lat);
+  fclose(out);
+  return 0;
+}
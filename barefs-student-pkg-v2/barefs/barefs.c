@@ -18,7 +18,11 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <sys/statvfs.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
@@ -26,6 +30,9 @@
 
 #include "block.h"
 #include "fs.h"
+#include "trace.h"
+#include "stats.h"
+#include "log.h"
 
 #define BLOCK_SIZE 512
 #ifndef NUM_BLOCKS
@@ -33,13 +40,31 @@
 #define NUM_BLOCKS (8*512)
 #endif
 
-// maximum amount of directory entries 
-#define MAX_READDIR_ENTRIES 64 
-// maximum size of a file name used in barefs
-#define MAX_FILE_NAME_SIZE 14
-
-int myparse(char *pathname);
-int myparsepathnames(char* pathname, char* outfilename, char* outdirname);
+// readdir offsets: 1 and 2 follow "." and "..", then the directory cursor
+#define READDIR_OFF(c) ((((off_t)(c)->iblock << 8) | (c)->slot) + 3)
+#define READDIR_IBLOCK(off) ((unsigned)(((off) - 3) >> 8))
+#define READDIR_SLOT(off) ((unsigned)(((off) - 3) & 0xff))
+
+// most creates committed together by create_batched()
+#define CREATE_BATCH_MAX 64
+
+// idle scrubbing of freed blocks: period and most blocks zeroed per pass
+#define SCRUB_INTERVAL_US 100000
+#define SCRUB_BATCH 64
+
+// the control directory, outside of the file system, with the statistics
+// of the handlers and of the layers below, and the I/O accounting of the
+// blocks (read a file to get them as text, write to it or truncate it to
+// reset them)
+// e.g. "cat /mnt/.barefs/stats", "echo > /mnt/.barefs/stats"
+#define CTL_DIR "/.barefs"
+#define CTL_STATS CTL_DIR "/stats"
+#define CTL_BLOCKS CTL_DIR "/blocks"
+#define STATS_FH ((uint64_t) -1)    /* file handle of the statistics */
+#define BLOCKS_FH ((uint64_t) -2)   /* file handle of the block I/O */
+#define IS_CTL_FH(fh) ((fh) >= BLOCKS_FH)
+#define CTL_TEXT_SIZE (64*1024)
+#define BLOCKS_TOP 32               /* blocks ranked by CTL_BLOCKS */
 
 
 static fs_t* FS;
@@ -49,84 +74,266 @@ static fs_t* FS;
 ///////////////////////////////////////////////////////////
 
 
+/** fill_stat() - auxiliar function: fills 'stbuf' with the attributes of a file or directory */
+static void fill_stat(inodeid_t fileid, const fs_file_attrs_t *attrs, struct stat *stbuf)
+{
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = fileid;
+  if (attrs->type == FS_FILE) {
+    stbuf->st_nlink = attrs->links; /* the number of hard links here */
+    stbuf->st_mode = S_IFREG | 0777;
+    stbuf->st_size = attrs->size;
+  } else {
+    stbuf->st_nlink = 2;
+    stbuf->st_mode = S_IFDIR | 0777;
+    stbuf->st_size = BLOCK_SIZE;
+  }
+}
 
-/** myparse() - auxiliar function: checks if the given 'pathname' is coherent with the filesystem */
-int myparse(char* pathname) {
-  char line[MAX_PATH_NAME_SIZE];
-  char *token;
-  char *search = "/";
-  int i;
-  strcpy(line,pathname);
+/** is_control() - auxiliar function: tells whether a path is in the control directory */
+static int is_control(const char *path)
+{
+  size_t len = sizeof(CTL_DIR) - 1;
+  return strncmp(path, CTL_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
 
-  if(strlen(line) >= MAX_PATH_NAME_SIZE || strlen(line) < 1) /* Wrong pathname size */
-      return -1;
+/** ctl_fh() - auxiliar function: the file handle of a control file, 0 if none */
+static uint64_t ctl_fh(const char *path)
+{
+  if (strcmp(path, CTL_STATS) == 0)
+    return STATS_FH;
+  if (strcmp(path, CTL_BLOCKS) == 0)
+    return BLOCKS_FH;
+  return 0;
+}
 
-  if (strchr(line, ' ') != NULL || strstr( (const char *) line, "//") != NULL || line[0] != '/' ) /* verifies if the given pathname is malformed */
-      return -1;
+/** ctl_reset() - auxiliar function: resets the counts of a control file */
+static void ctl_reset(uint64_t fh)
+{
+  unsigned meta;
 
-  if ((i=strlen(pathname)) && line[i]=='/') /* verifies if the given pathname is malformed */
-      return -1;
+  if (fh == BLOCKS_FH)
+    block_io_reset(fs_blocks(FS, &meta));
+  else
+    stats_reset();
+}
+
+/** ctl_read() - auxiliar function: reads the text of a control file */
+static int ctl_read(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+  char *text = (char *) malloc(CTL_TEXT_SIZE);
+  unsigned meta;
+  int len, n;
+
+  if (text == NULL)
+    return -ENOMEM;
+  if (fh == BLOCKS_FH) {
+    blocks_t *bks = fs_blocks(FS, &meta);
+    len = block_io_format(bks, meta, BLOCKS_TOP, text, CTL_TEXT_SIZE);
+  } else
+    len = stats_format(text, CTL_TEXT_SIZE);
+  if (len >= CTL_TEXT_SIZE)
+    len = CTL_TEXT_SIZE - 1;
+  n = (offset < len) ? len - offset : 0;
+  if (n > size)
+    n = size;
+  memcpy(buf, text + offset, n);
+  free(text);
+  return n;
+}
 
-  i=0;
-  token = strtok(line, search);
+/** resolved - the paths resolved by the handler running on the thread, in
+ * order (the first two), so that its call is traced without resolving them
+ * again; reset by the wrapper of the call (see INSTRUMENTATION) */
+#define RESOLVED_MAX 2
+
+static __thread struct {
+  int num;
+  inodeid_t dir[RESOLVED_MAX];
+  inodeid_t fileid[RESOLVED_MAX];
+  const char *leaf[RESOLVED_MAX];
+} resolved;
+
+/** resolve() - auxiliar function: fs_resolve() that keeps the result in
+ * 'resolved' when tracing (ids 0 and no leaf if the path does not resolve) */
+static int resolve(const char *path, inodeid_t *dir, const char **leaf, inodeid_t *fileid)
+{
+  int res = fs_resolve(FS, path, dir, leaf, fileid);
 
-  while(token != NULL) {
-      if ( strlen(token) > MAX_FILE_NAME_SIZE -1) /* verifies if the given pathname sizes exceeds the limits */
-      return -1;
-      i++;
-      token = strtok(NULL, search);
+  if (trace_enabled() && resolved.num < RESOLVED_MAX) {
+    int n = resolved.num++;
+    resolved.dir[n] = (res == 0) ? *dir : 0;
+    resolved.fileid[n] = (res == 0) ? *fileid : 0;
+    resolved.leaf[n] = (res == 0) ? *leaf : NULL;
   }
+  return res;
+}
 
-return 0;
-}
-
-  /** myparsepathnames() - auxiliar function: parses through the input pathname and get it's base-
-  directory name and filename (if any)
-  * - receives as input argument the 'pathname'[in]
-  * - the 'outfilename' is the filename of the given pathname [out]
-  * - the 'outdirname' is the directory path to the base-directory [out]
-  * -» returns the depth of subdirectories the file is in (ie: returns 1 if the file is at the root folder)
-  */
-int myparsepathnames(char* pathname, char* outfilename, char* outdirname){
-  char newfilename[MAX_FILE_NAME_SIZE];
-  char newdirname[MAX_PATH_NAME_SIZE];
-  char fulldirname[MAX_PATH_NAME_SIZE];
-  char *token;
-  char *search="/";
-  int i;
-
-  memset(&newfilename, 0, MAX_FILE_NAME_SIZE);// the name of the file to be parsed(from pathname)
-  memset(&newdirname, 0, MAX_PATH_NAME_SIZE); // the name of the base directory (of the pathname)
-  memset(&fulldirname, 0, MAX_PATH_NAME_SIZE);
-
-  strcpy(fulldirname, pathname);
-  token = strtok(fulldirname, search);
-
-  for(i=0; token != NULL; i++) {// counts the depth of the directories and parses through directories
-    memset(&newfilename, 0, MAX_FILE_NAME_SIZE);
-    strncpy(newfilename, token, strlen(token));
-    newfilename[strlen(newfilename)] = '\0';
-    token = strtok(NULL, search);
+/** attr_cache - the attributes of the entries of the directory last listed,
+ * so that the getattr that FUSE sends for each of them (e.g. for 'ls -l')
+ * is served without resolving the path again: the readdir of FUSE 2 cannot
+ * hand the attributes to the kernel, so this is a best-effort substitute.
+ * The path leads to the same entries while no directory was moved or removed
+ * (generation of inode 0) and the directory did not change (its generation);
+ * an entry is valid while the generation of its own inode is unchanged, so
+ * the changes to other files leave it alone */
+#define ATTR_CACHE_SIZE 256
+
+static struct {
+  pthread_mutex_t lock;
+  unsigned long tree_gen;           /* fs_generation of inode 0 */
+  inodeid_t dirid;
+  unsigned long dir_gen;            /* fs_generation of the directory */
+  char dir[MAX_PATH_NAME_SIZE];     /* path of the directory, "" if none */
+  int num;
+  int last;                         /* entry of the last hit */
+  struct {
+    char name[FS_MAX_FNAME_SZ];
+    inodeid_t inodeid;
+    unsigned long gen;              /* fs_generation of the inode */
+    fs_file_attrs_t attrs;
+  } entries[ATTR_CACHE_SIZE];
+} attr_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+/** attr_cached() - auxiliar function: gets the attributes of 'path' from the
+ * attribute cache, returns 0 if they are not there */
+static int attr_cached(const char *path, struct stat *stbuf)
+{
+  const char *name = strrchr(path, '/') + 1;
+  size_t len = (name - path > 1) ? name - path - 1 : 1;
+  int found = 0;
+
+  pthread_mutex_lock(&attr_cache.lock);
+  if (strlen(attr_cache.dir) == len && strncmp(attr_cache.dir, path, len) == 0 &&
+      attr_cache.tree_gen == fs_generation(FS, 0) &&
+      attr_cache.dir_gen == fs_generation(FS, attr_cache.dirid)) {
+    // the entries are usually asked for in the order they were listed
+    for (int n = 1; n <= attr_cache.num && !found; n++) {
+      int i = (attr_cache.last + n) % attr_cache.num;
+      if (strcmp(attr_cache.entries[i].name, name) == 0) {
+        if (attr_cache.entries[i].gen == fs_generation(FS, attr_cache.entries[i].inodeid)) {
+          fill_stat(attr_cache.entries[i].inodeid, &attr_cache.entries[i].attrs, stbuf);
+          found = 1;
+        }
+        attr_cache.last = i;
+        break;
+      }
+    }
   }
+  pthread_mutex_unlock(&attr_cache.lock);
+  return found;
+}
 
-  if(i > 1) {// not at the root folder
-    strncpy(newdirname, pathname, strlen(pathname)-strlen(newfilename));
-   newdirname[strlen(newdirname)] = '\0'; // assure the string ending
+/** readdir_fill() - auxiliar function: hands a directory entry to the FUSE
+ * filler, keeping its attributes in the attribute cache */
+struct readdir_ctx {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
 
-  } else { // i=1 :: the file is at the root directory (if i=0 then the pathname is wrong)
-    strncpy(newfilename, &pathname[1], strlen(pathname));
-    newfilename[strlen(newfilename)] = '\0'; // assure the string ending
-    strncpy(newdirname, pathname, strlen(pathname)-strlen(newfilename));
-    newdirname[strlen(newdirname)] = '\0'; // assure the string ending
+static int readdir_fill(void *ctx, const fs_file_entry_t *entry, const fs_dir_cursor_t *next)
+{
+  struct readdir_ctx *rd = (struct readdir_ctx *) ctx;
+  struct stat st;
+
+  fill_stat(entry->inodeid, &entry->attrs, &st);
+  if (rd->filler(rd->buf, entry->name, &st, READDIR_OFF(next)))
+    return 1;
+  if (attr_cache.num < ATTR_CACHE_SIZE) {
+    int i = attr_cache.num++;
+    strcpy(attr_cache.entries[i].name, entry->name);
+    attr_cache.entries[i].inodeid = entry->inodeid;
+    attr_cache.entries[i].gen = entry->gen;
+    attr_cache.entries[i].attrs = entry->attrs;
   }
+  return 0;
+}
 
-// set the output variables and assure the string ends with '\0'
-    strncpy(outfilename, newfilename, MAX_FILE_NAME_SIZE);
-    outfilename[MAX_FILE_NAME_SIZE-1]='\0';
-    strncpy(outdirname, newdirname, MAX_PATH_NAME_SIZE);
-    outdirname[MAX_PATH_NAME_SIZE-1]='\0';
+/** create_batched() - auxiliar function: creates a file through fs_create_many,
+ * together with the creates into the same directory that arrive while a
+ * previous batch is being committed (group commit: the first caller of a
+ * batch leads it, the others wait for its result) */
+struct create_batch {
+  inodeid_t dir;
+  int count;
+  int waiting;
+  int done;
+  const char *names[CREATE_BATCH_MAX];
+  inodeid_t ids[CREATE_BATCH_MAX];
+};
 
-return i;
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t create_cond = PTHREAD_COND_INITIALIZER;
+static struct create_batch *create_open;  /* batch taking new creates */
+static int create_busy;                   /* a batch is being committed */
+
+static int create_batched(inodeid_t dir, const char *name, inodeid_t *fileid)
+{
+  struct create_batch mine, *b;
+  int slot;
+
+  pthread_mutex_lock(&create_lock);
+  /* an open batch for another directory (or full) must leave first */
+  while (create_open != NULL &&
+	 (create_open->dir != dir || create_open->count == CREATE_BATCH_MAX))
+    pthread_cond_wait(&create_cond, &create_lock);
+
+  if (create_open == NULL) {
+    memset(&mine, 0, sizeof(mine));
+    mine.dir = dir;
+    create_open = &mine;
+  }
+  b = create_open;
+  slot = b->count++;
+  b->names[slot] = name;
+
+  if (b != &mine) {
+    /* follower: the leader commits the batch */
+    b->waiting++;
+    while (!b->done)
+      pthread_cond_wait(&create_cond, &create_lock);
+    *fileid = b->ids[slot];
+    b->waiting--;
+    pthread_cond_broadcast(&create_cond);
+    pthread_mutex_unlock(&create_lock);
+    return *fileid != 0 ? 0 : -1;
+  }
+
+  /* leader: collect creates until the previous batch is committed */
+  while (create_busy)
+    pthread_cond_wait(&create_cond, &create_lock);
+  create_busy = 1;
+  create_open = NULL;
+  pthread_cond_broadcast(&create_cond);
+  pthread_mutex_unlock(&create_lock);
+
+  fs_create_many(FS, dir, mine.names, mine.count, mine.ids);
+
+  pthread_mutex_lock(&create_lock);
+  create_busy = 0;
+  mine.done = 1;
+  pthread_cond_broadcast(&create_cond);
+  /* the batch lives in this frame: wait for the followers to take their ids */
+  while (mine.waiting > 0)
+    pthread_cond_wait(&create_cond, &create_lock);
+  pthread_mutex_unlock(&create_lock);
+
+  *fileid = mine.ids[slot];
+  return *fileid != 0 ? 0 : -1;
+}
+
+/** scrub_loop() - auxiliar function: background thread zeroing freed blocks
+ * while the file system is idle (see fs_scrub) */
+static pthread_t scrub_thread;
+static volatile int scrub_stop;
+
+static void *scrub_loop(void *arg)
+{
+  while (!scrub_stop) {
+    usleep(SCRUB_INTERVAL_US);
+    fs_scrub(FS, SCRUB_BATCH);
+  }
+  return NULL;
 }
 
 ///////////////////////////////////////////////////////////
@@ -140,8 +347,21 @@ return i;
  */
 void *barefs_init(struct fuse_conn_info *conn)
 {
+    /* move file data with splice() whenever the kernel allows it */
+    conn->want |= conn->capable &
+	(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
     FS = fs_new(NUM_BLOCKS);
     fs_format(FS);
+
+    /* here, as threads started before fuse_main daemonizes do not survive it */
+    if (log_level != LOG_OFF && log_start() != 0)
+	fprintf(stderr, "barefs: cannot start logging\n");
+    if (trace_enabled() && trace_start() != 0)
+	fprintf(stderr, "barefs: cannot start tracing\n");
+
+    if (pthread_create(&scrub_thread, NULL, scrub_loop, NULL) != 0)
+	log_warn("[barefs_init] Freed blocks will not be scrubbed.\n");
     return NULL;
 }
 
@@ -153,6 +373,10 @@ void *barefs_init(struct fuse_conn_info *conn)
  */
 void barefs_destroy(void *userdata)
 {
+    scrub_stop = 1;
+    pthread_join(scrub_thread, NULL);
+    trace_close();
+    log_close();
 }
 
 
@@ -165,46 +389,21 @@ void barefs_destroy(void *userdata)
  */
 int barefs_create(const char *path, mode_t mp, struct fuse_file_info *fi) 
 {
-  char name[MAX_FILE_NAME_SIZE];
-  char dirname[MAX_PATH_NAME_SIZE];
+  const char *name;
   inodeid_t fileid, dir;
 
-  /* check if the pathname is malformed */
-  if(myparse((char*)path) != 0){
-  printf("[barefs_create] Malformed pathname.\n");
-  return -1;
-  }
-
-  /* get filename & dirname*/
-  int i = myparsepathnames((char*)path, name, dirname);
-
+  if (is_control(path))
+    return -EPERM;
 
- /* verifies if the name exists */
-  if(name == NULL) {
-  printf("[barefs_create] Error looking for directory.\n");
+  /* get the parent-directory & filename */
+  if(resolve(path, &dir, &name, &fileid) != 0){
+  log_warn("[barefs_create] Malformed pathname or missing parent-directory.\n");
   return -1;
   }
 
-  /* verifies if the inode of the file exists on the dirname */
-  if(fs_lookup(FS, dirname, &fileid) != 1){
-  printf("[barefs_create] The file '%s' does not exist.\n", path);
-  return -1;
-  }
-
-  /* verifies if the inode of the directory exists on the dirname */
-  if(fs_lookup(FS, dirname,&dir) != 1){
-  printf("[barefs_create] The parent-directory does not exist.\n");
-  return -1;
-  }
-
-
-  /* if file is at the root directory */
-if(i==1)
-  dir = 1; 
-
-   /* verifies if fs_create is successful */
-  if(fs_create(FS, dir, name, &fileid) != 0) {
-    printf("[barefs_create] Error creating file.\n");
+   /* verifies if the create is successful (batched with concurrent ones) */
+  if(create_batched(dir, name, &fileid) != 0) {
+    log_warn("[barefs_create] Error creating file.\n");
     return -1;
   }
 
@@ -222,34 +421,46 @@ int barefs_getattr(const char *path, struct stat *stbuf)
 {
 
    int res = -ENOENT;
-   inodeid_t fileid;
+   inodeid_t fileid, dir;
+   const char *name;
 
    memset(stbuf, 0, sizeof(struct stat));
    
    fs_file_attrs_t attrs;
 
+   // The control directory and the statistics file
+   if (is_control(path)) {
+	if (strcmp(path, CTL_DIR) == 0) {
+	   stbuf->st_mode = S_IFDIR | 0555;
+	   stbuf->st_nlink = 2;
+	   return 0;
+	}
+	if (ctl_fh(path) != 0) {
+	   stbuf->st_mode = S_IFREG | 0644;
+	   stbuf->st_nlink = 1;
+	   return 0;
+	}
+	return -ENOENT;
+   }
+
    // Root Directory Attributes
    if ( strcmp((char*)path,"/")== 0 ) {
+		stbuf->st_ino = 1;   /* the inode of the root */
 		stbuf->st_mode = S_IFDIR | 0777;
 		stbuf->st_nlink = 2;
 		stbuf->st_size = BLOCK_SIZE;
 		return 0;		
    }
+
+   // An entry of the directory just listed
+   if (attr_cached(path, stbuf))
+	return 0;
   
-   if (fs_lookup(FS,(char*)path,&fileid) == 1) {
-    	printf("[barefs_getattr] filename: '%s' [inode: %d]\n", path, fileid);
+   if (resolve(path,&dir,&name,&fileid) == 0 && fileid != 0) {
+    	log_debug("[barefs_getattr] filename: '%s' [inode: %d]\n", path, fileid);
       	if (fs_get_attrs(FS,fileid,&attrs) == 0) {
-	      if (attrs.type == 2) {
-			stbuf->st_nlink = attrs.links; /* the number of hard links here */
-			stbuf->st_mode = S_IFREG | 0777;
-			stbuf->st_size = attrs.size;
-			res = 0;
-              } else if (attrs.type == 1) {
-				stbuf->st_nlink = 2;
-				stbuf->st_mode = S_IFDIR | 0777;
-				stbuf->st_size = BLOCK_SIZE;
-				res = 0;
-	             }
+		fill_stat(fileid, &attrs, stbuf);
+		res = 0;
       	}
    } 
    return res;   
@@ -257,47 +468,61 @@ int barefs_getattr(const char *path, struct stat *stbuf)
 
 /** Read directory
  *
+ * The entries are streamed to the filler from the position given by
+ * 'offset', with their attributes, until the filler buffer is full.
 */ 
 int barefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
     int res = -ENOENT;	
-    (void) offset;
     (void) fi;
-    inodeid_t fileid;
-    int maxentries;	
-    fs_file_attrs_t attrs;
+    inodeid_t fileid, dir;
+    const char *name;
+    fs_dir_cursor_t cursor = {0, 0};
+    struct readdir_ctx rd = {buf, filler};
+
+    if (is_control(path)) {
+	if (strcmp(path, CTL_DIR) != 0)
+	   return -ENOTDIR;
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	filler(buf, "stats", NULL, 0);
+	filler(buf, "blocks", NULL, 0);
+	return 0;
+    }
 
-    if(strcmp(path, "/") == 0) 
-	   fileid=1; //1 is the root directory inode number
-    else { 
-          if (fs_lookup(FS,(char*)path,&fileid) != 1) 
-	      return res;
+    unsigned long tree_gen = fs_generation(FS, 0);
+    if (resolve(path,&dir,&name,&fileid) != 0 || fileid == 0) 
+	return res;
+
+    if (offset < 1 && filler(buf, ".", NULL, 1))
+	return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+	return 0;
+    if (offset > 2) {
+	cursor.iblock = READDIR_IBLOCK(offset);
+	cursor.slot = READDIR_SLOT(offset);
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-	
-    if (fs_get_attrs(FS,fileid,&attrs) == 0) {
-	if (attrs.type == 1) {
-		maxentries = attrs.num_entries;
-		//printf("[barefs_readdir] Directory '%s' has %d entries.\n", path, attrs.num_entries);			
-		res = 0;
-         }
-		
-	if (maxentries) {
-		// Read the directory
-		fs_file_name_t entries[MAX_READDIR_ENTRIES];
-		int numentries;
-		if (!fs_readdir(FS,fileid,entries,maxentries,&numentries)) {
-		    int i;
-	            for (i = 0; i < numentries; i++) {						
-			filler(buf, entries[i].name, NULL, 0);  
-		    }
-		    res = 0;	  
-		}
-	}	
+    // The entries go to the attribute cache too: from scratch, unless
+    // they follow those of the same listing, of the unchanged directory
+    pthread_mutex_lock(&attr_cache.lock);
+    unsigned long dir_gen = fs_generation(FS, fileid);
+    if (offset <= 2 || attr_cache.tree_gen != tree_gen || attr_cache.dirid != fileid ||
+	attr_cache.dir_gen != dir_gen || strcmp(attr_cache.dir, path) != 0) {
+	attr_cache.tree_gen = tree_gen;
+	attr_cache.dirid = fileid;
+	attr_cache.dir_gen = dir_gen;
+	attr_cache.num = attr_cache.last = 0;
+	attr_cache.dir[0] = '\0';
+	if (strlen(path) < MAX_PATH_NAME_SIZE)
+	   strcpy(attr_cache.dir, path);
     }
+	
+    // Read the directory
+    if (!fs_readdir_stream(FS,fileid,&cursor,readdir_fill,&rd))
+	res = 0;	  
+    pthread_mutex_unlock(&attr_cache.lock);
     return res;	
 }
 
@@ -307,51 +532,30 @@ int barefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 */
 int barefs_mkdir(const char* path, mode_t mode) 
 { 
-
-
-  char newfilename[MAX_FILE_NAME_SIZE];
-  char newdirname[MAX_PATH_NAME_SIZE];
-  char fulldirname[MAX_PATH_NAME_SIZE];
-  int i=0;
+  const char *name;
   inodeid_t fileid, dir;
 
-  /* check if the pathname is not malformed */
-  if(myparse((char*)path) != 0 ) {
-    printf("[barefs_mkdir] Malformed pathname.\n");
+  if (is_control(path))
+    return -EPERM;
+
+  /* get the parent-directory & the name of the new directory */
+  if(resolve(path, &dir, &name, &fileid) != 0) {
+    log_warn("[barefs_mkdir] Malformed pathname or missing parent-directory.\n");
     return -1;
   }
 
     /* check if the subdirectory exists */
-   if(fs_lookup(FS,(char*)path,&dir) == 1) {
-    printf("[barefs_mkdir] Error creating a subdirectory that already exists.\n");
+   if(fileid != 0) {
+    log_warn("[barefs_mkdir] Error creating a subdirectory that already exists.\n");
     return -1;
   }
 
-
-  memset(&newfilename,0,MAX_FILE_NAME_SIZE);
-  memset(&newdirname,0,MAX_PATH_NAME_SIZE);
-  memset(&fulldirname,0,MAX_PATH_NAME_SIZE);
-
-  i = myparsepathnames((char *)path, newfilename, newdirname);
-
-
-    /* if directory is on root */
-    if (i==1) 
-      dir = 1;
-    
-    /* create a directory elsewhere */
-    else { 
-      if(fs_lookup(FS,newdirname,&dir) != 1) {
-      printf("[barefs_mkdir] Error creating a subdirectory which has a wrong pathname.\n");
-      return -1;
-        }
-     }
-
      /* verifies if fs_mkdir is successful */
-      if(fs_mkdir(FS,dir,newfilename,&fileid) != 0)  {
-      printf("[barefs_mkdir] Error creating new directory.\n");
+      if(fs_mkdir(FS,dir,name,&fileid) != 0)  {
+      log_warn("[barefs_mkdir] Error creating new directory.\n");
       return -1;
       }
+      resolved.fileid[0] = fileid;   /* the new directory, for its trace */
 
 
    return 0;  
@@ -367,50 +571,28 @@ int barefs_rmdir(const char* path)
 {
    /* check if the user tries to remove the root folder */
   if(path[0]=='/' && path[1]=='\0'){
-  printf("[barefs_rmdir] The root '/' directory cannot be removed.\n");
-  return -1;
-  }
-
-  /* check if the pathname is malformed */
-  if(myparse((char*)path) != 0){
-  printf("[barefs_rmdir] Malformed pathname.\n");
-  return -1;
-  }
-
-  char name[MAX_FILE_NAME_SIZE];
-  char dirname[MAX_PATH_NAME_SIZE];
-
-  /* get filename & dirname */
-  int i = myparsepathnames((char*)path, name, dirname);
-
-
-  /* verifies if the name exists */
-  if(name == NULL) {
-  printf("[barefs_rmdir] Error looking for directory.\n");
+  log_warn("[barefs_rmdir] The root '/' directory cannot be removed.\n");
   return -1;
   }
 
+  const char *name;
   inodeid_t fileid, dir;
 
-  /* verifies if the fileid exists in the path given */
-  if(fs_lookup(FS,(char*)path,&fileid) != 1){
-  printf("[barefs_rmdir] The directory '%s' does not exist.\n", path);
+  /* get the parent-directory & the directory name */
+  if(resolve(path, &dir, &name, &fileid) != 0){
+  log_warn("[barefs_rmdir] Malformed pathname or missing parent-directory.\n");
   return -1;
   }
 
-  /* verifies if the dir exists in the dirname given */
-  if(fs_lookup(FS,dirname,&dir) != 1){
-  printf("[barefs_rmdir] The parent-directory does not exist.\n");
+  /* verifies if the directory exists in the path given */
+  if(fileid == 0){
+  log_warn("[barefs_rmdir] The directory '%s' does not exist.\n", path);
   return -1;
   }
-
-  /* if the directory is at the root directory */
-  if(i==1)
-    dir = 1; 
  
   /* verifies if fs_rmdir is successful */
   if(fs_rmdir(FS, dir, name) != 0) {
-    printf("[barefs_rmdir] Error removing directory.\n");
+    log_warn("[barefs_rmdir] Error removing directory.\n");
     return -1;
   }
 return 0;	
@@ -424,48 +606,27 @@ return 0;
 int barefs_link(const char* from, const char* to)
 {
   int res = -ENOENT;
-  int i = 0;
-  char filename[MAX_FILE_NAME_SIZE];
-  char filedirname[MAX_PATH_NAME_SIZE];
-  char linkname[MAX_FILE_NAME_SIZE];
-  char linkdirname[MAX_PATH_NAME_SIZE];
-  inodeid_t fileid, dir;
-
-   
-  /* check if the pathname is malformed */
-  if(myparse((char*)from) != 0){
-  printf("[barefs_link] Malformed pathname.\n");
-  return -1;
-  }
+  const char *filename, *linkname;
+  inodeid_t fileid, linkid, dir;
 
-  myparsepathnames((char*)from, filename, filedirname);
-  i = myparsepathnames((char*)to, linkname, linkdirname);
-
-  /* verifies if the given filename exists */
-  if(filename == NULL) {
-  printf("[barefs_link] Error looking for file.\n");
-  return -1;
-  }
+  if (is_control(to))
+    return -EPERM;
 
-  /* verifies if the fileid exists in the from given */
-  if(fs_lookup(FS, (char *)from, &fileid) != 1){
-  printf("[barefs_link] The file '%s' does not exist.\n", from);
+  /* verifies if the file exists in the from given */
+  if(resolve(from, &dir, &filename, &fileid) != 0 || fileid == 0){
+  log_warn("[barefs_link] The file '%s' does not exist.\n", from);
   return -1;
   }
 
-  /* verifies if the dir exists in the linkdirname given */
-  if(fs_lookup(FS, linkdirname,&dir) != 1){
-  printf("[barefs_link] The parent-directory does not exist (Hard Link).\n");
+  /* get the parent-directory & name of the hard link */
+  if(resolve(to, &dir, &linkname, &linkid) != 0){
+  log_warn("[barefs_link] The parent-directory does not exist (Hard Link).\n");
   return -1;
   }
 
-  /* if file is at the root directory */
-  if(i==1)
-    dir = 1; 
-
   /*verifies if fs_link is successful */ 
   if(fs_link(FS,dir,linkname,fileid) == 0){
-          printf("[barefs_link] Linking file '%s' \n", to);
+          log_debug("[barefs_link] Linking file '%s' \n", to);
           res = 0;
         } 
 		
@@ -474,56 +635,68 @@ int barefs_link(const char* from, const char* to)
 
 
 
-/** Remove (delete) the given file or hard link 
-*
+/** Rename a file or directory
 *
+* Only the directory entries are changed, the contents of the file
+* are never moved or copied.
 */
-int barefs_unlink(const char* path)
+int barefs_rename(const char* from, const char* to)
 {
-   struct stat * stbuf = NULL;
+  const char *oldname, *newname;
+  inodeid_t fileid, targetid, olddir, newdir;
+  size_t len = strlen(from);
 
-   stbuf = (struct stat *)malloc(sizeof(struct stat));
+  if (is_control(from) || is_control(to))
+    return -EPERM;
 
-   /* check if the pathname is malformed */
-  if(myparse((char*)path) != 0){
-  printf("[barefs_unlink] Malformed pathname.\n");
-  return -1;
+  /* verifies if the object exists in the from given */
+  if(resolve(from, &olddir, &oldname, &fileid) != 0 || fileid == 0){
+  log_warn("[barefs_rename] The file '%s' does not exist.\n", from);
+  return -ENOENT;
   }
 
-  char name[MAX_FILE_NAME_SIZE];
-  char dirname[MAX_PATH_NAME_SIZE];
+  /* a directory cannot be moved into itself */
+  if(strncmp(from, to, len) == 0 && to[len] == '/'){
+  log_warn("[barefs_rename] Cannot move '%s' into itself.\n", from);
+  return -EINVAL;
+  }
 
-  int i = myparsepathnames((char*)path, name, dirname);
+  /* get the new parent-directory & the new name */
+  if(resolve(to, &newdir, &newname, &targetid) != 0){
+  log_warn("[barefs_rename] The parent-directory does not exist.\n");
+  return -ENOENT;
+  }
 
-  /* verifies if the name exists */
-  if(name == NULL) {
-  printf("[barefs_unlink] Error looking for file.\n");
+  /*verifies if fs_rename is successful */ 
+  if(fs_rename(FS, olddir, oldname, newdir, newname) != 0){
+  log_warn("[barefs_rename] Error renaming '%s'.\n", from);
   return -1;
   }
 
-  inodeid_t fileid, dir;
+  return 0;
+}
 
-  /* verifies if the fileid exists in the dirname given */
-  if(fs_lookup(FS, dirname, &fileid) != 1){
-  printf("[barefs_unlink] The file '%s' does not exist.\n", path);
-  return -1;
-  }
 
-  /* if file is at the root directory */
-if(i==1)
-  dir = 1; 
 
-    /* verifies if the dir existes on the dirname given */
-   if (fs_lookup(FS,dirname,&dir) == 1) {
+/** Remove (delete) the given file or hard link 
+*
+*
+*/
+int barefs_unlink(const char* path)
+{
+  const char *name;
+  inodeid_t fileid, dir;
 
-      /* get the atributes of the path */
-      barefs_getattr(path, stbuf);
+  /* get the parent-directory & the filename */
+  if(resolve(path, &dir, &name, &fileid) != 0 || fileid == 0){
+  log_warn("[barefs_unlink] The file '%s' does not exist.\n", path);
+  return -ENOENT;
+  }
 
           /* then removes the link */
           if (fs_remove(FS,dir,name,&fileid) == 0) {
-                  printf("[barefs_unlink] Removing link '%s' \n", path);
+                  log_debug("[barefs_unlink] Removing link '%s' \n", path);
           }
-  }
 
    return 0;  
 }
@@ -540,9 +713,17 @@ if(i==1)
 int barefs_open(const char *path, struct fuse_file_info *fi)
 {
    int res = -ENOENT;
-   inodeid_t fileid;
+   inodeid_t fileid, dir;
+   const char *name;
+
+   /* the control files are generated at each read, and so have no size */
+   if (ctl_fh(path) != 0) {
+	fi->fh = ctl_fh(path);
+	fi->direct_io = 1;
+	return 0;
+   }
 
-   if (fs_lookup(FS,(char*)path,&fileid) == 1) {
+   if (resolve(path,&dir,&name,&fileid) == 0 && fileid != 0) {
 	fi->fh= fileid;
 	res = 0;
    } 
@@ -563,6 +744,9 @@ int barefs_read(const char *path, char *buf, size_t size, off_t offset,
    int res = -1;
    int fileid = fi->fh;
    int nread = 0; 
+
+   if (IS_CTL_FH(fi->fh))
+	return ctl_read(fi->fh, buf, size, offset);
    
    if (fs_read(FS,fileid,offset,size,buf,&nread) == 0){
 	offset += nread;
@@ -590,6 +774,12 @@ int barefs_write(const char *path, const char *buf, size_t size,
    int res=-1;
    int fileid = fi->fh; 
 
+   /* any write to a control file resets its counts */
+   if (IS_CTL_FH(fi->fh)) {
+	ctl_reset(fi->fh);
+	return size;
+   }
+
    if (!fs_write(FS,fileid,offset,size,(char*)buf)){
 		res=(int) size;
    }   
@@ -598,6 +788,158 @@ int barefs_write(const char *path, const char *buf, size_t size,
 }
 
 
+/** Read data from an open file, with a single copy
+ *
+ * The data is copied from the ranges of the block storage holding it
+ * straight into the reply buffer, while fs_read_map keeps the file
+ * locked: FUSE would only splice the ranges after this returns, when
+ * they may already be freed and reused by another file. Falls back to
+ * barefs_read() if the storage has no descriptor to copy from.
+ *
+ */
+int barefs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+   int fileid = fi->fh;
+   int maxext = size / BLOCK_SIZE + 2;
+   int numext = 0, nread = 0, i;
+   struct fuse_bufvec *bufv;
+
+   fs_extent_t *ext = (fs_extent_t*) malloc(maxext * sizeof(fs_extent_t));
+   if (ext == NULL)
+	return -ENOMEM;
+
+   if (IS_CTL_FH(fi->fh) ||
+	fs_read_map(FS,fileid,offset,size,ext,maxext,&numext,&nread) != 0) {
+	free(ext);
+
+	bufv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+	if (bufv == NULL)
+	   return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].mem = malloc(size);
+	if (bufv->buf[0].mem == NULL) {
+	   free(bufv);
+	   return -ENOMEM;
+	}
+	int res = barefs_read(path, bufv->buf[0].mem, size, offset, fi);
+	if (res < 0) {
+	   free(bufv->buf[0].mem);
+	   free(bufv);
+	   return res;
+	}
+	bufv->buf[0].size = res;
+	*bufp = bufv;
+	return 0;
+   }
+
+   struct fuse_bufvec *src = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec) +
+		(numext > 1 ? numext - 1 : 0) * sizeof(struct fuse_buf));
+   bufv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+   char *mem = malloc(nread > 0 ? nread : 1);
+   if (src == NULL || bufv == NULL || mem == NULL) {
+	fs_read_done(FS,fileid);
+	free(ext);
+	free(src);
+	free(bufv);
+	free(mem);
+	return -ENOMEM;
+   }
+   *src = FUSE_BUFVEC_INIT(0);
+   for (i = 0; i < numext; i++) {
+	src->buf[i].size = ext[i].size;
+	src->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[i].mem = NULL;
+	src->buf[i].fd = ext[i].fd;
+	src->buf[i].pos = ext[i].pos;
+   }
+   if (numext > 0)
+	src->count = numext;
+   free(ext);
+
+   *bufv = FUSE_BUFVEC_INIT(nread);
+   bufv->buf[0].mem = mem;
+   ssize_t res = (nread > 0) ? fuse_buf_copy(bufv, src, 0) : 0;
+   fs_read_done(FS,fileid);
+   free(src);
+   if (res < 0) {
+	free(mem);
+	free(bufv);
+	return res;
+   }
+   bufv->buf[0].size = res;
+   *bufp = bufv;
+   return 0;
+}
+
+
+/** Write data to an open file, without copying it
+ *
+ * The data is moved from the request buffer (usually a pipe spliced
+ * from the FUSE device) straight into the block storage ranges
+ * reserved for it. Falls back to barefs_write() if the storage has
+ * no descriptor to splice into.
+ *
+ */
+int barefs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi)
+{
+   int fileid = fi->fh;
+   size_t size = fuse_buf_size(buf);
+   int maxext = size / BLOCK_SIZE + 2;
+   int numext = 0, i;
+   ssize_t res;
+   struct fuse_bufvec *dst;
+
+   fs_extent_t *ext = (fs_extent_t*) malloc(maxext * sizeof(fs_extent_t));
+   if (ext == NULL)
+	return -ENOMEM;
+
+   if (IS_CTL_FH(fi->fh) ||
+	fs_write_map(FS,fileid,offset,size,ext,maxext,&numext) != 0) {
+	free(ext);
+
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	mem.buf[0].mem = malloc(size);
+	if (mem.buf[0].mem == NULL)
+	   return -ENOMEM;
+	res = fuse_buf_copy(&mem, buf, 0);
+	if (res >= 0)
+	   res = barefs_write(path, mem.buf[0].mem, res, offset, fi);
+	free(mem.buf[0].mem);
+	return res;
+   }
+
+   dst = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec) +
+		(numext > 1 ? numext - 1 : 0) * sizeof(struct fuse_buf));
+   if (dst == NULL) {
+	fs_write_done(FS,fileid,offset,size,0);
+	free(ext);
+	return -ENOMEM;
+   }
+   *dst = FUSE_BUFVEC_INIT(0);
+   for (i = 0; i < numext; i++) {
+	dst->buf[i].size = ext[i].size;
+	dst->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst->buf[i].mem = NULL;
+	dst->buf[i].fd = ext[i].fd;
+	dst->buf[i].pos = ext[i].pos;
+   }
+   if (numext > 0)
+	dst->count = numext;
+   free(ext);
+
+   res = fuse_buf_copy(dst, buf, 0);
+   free(dst);
+
+   // the file only grows over the bytes actually copied (and the
+   // ranges, locked since fs_write_map, are released)
+   if (fs_write_done(FS,fileid,offset,size,(res > 0) ? res : 0) != 0)
+	return -EIO;
+   return res;
+}
+
+
 /** Create a file node
  *
  *
@@ -644,14 +986,95 @@ int barefs_chmod(const char *path, mode_t mode)
 int barefs_truncate(const char *path, off_t newsize)
 {
    int res = -ENOENT;
-   inodeid_t fileid;
+   inodeid_t fileid, dir;
+   const char *name;
 
-   if (fs_lookup(FS,(char*)path,&fileid) == 1) {
-        if (fs_truncate(FS, fileid) == 0)
-	   res = 0;
-   } 
-	
-   return res;
+   if (ctl_fh(path) != 0) {
+	ctl_reset(ctl_fh(path));
+	return 0;
+   }
+
+   if (newsize < 0)
+	return -EINVAL;
+   if (newsize > UINT_MAX)
+	return -EFBIG;
+
+   if (resolve(path,&dir,&name,&fileid) != 0 || fileid == 0)
+	return res;
+
+   switch (fs_truncate(FS, fileid, newsize)) {
+   case 0:
+	return 0;
+   case FS_ERR_NOSPC:
+	return -ENOSPC;
+   case FS_ERR_FBIG:
+	return -EFBIG;
+   default:
+	return -EISDIR;
+   }
+}
+
+/** Allocate or release space for a file
+ *
+ * Preallocates (contiguously if possible) the blocks of the range, or
+ * with FALLOC_FL_PUNCH_HOLE releases them, leaving a hole.
+ */
+int barefs_fallocate(const char *path, int mode, off_t offset, off_t length,
+		struct fuse_file_info *fi)
+{
+   int flags = 0;
+
+   if (IS_CTL_FH(fi->fh))
+	return -EPERM;
+   if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+	return -EOPNOTSUPP;
+   if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+	return -EINVAL;
+
+   if (mode & FALLOC_FL_KEEP_SIZE)
+	flags |= FS_FALLOC_KEEP_SIZE;
+   if (mode & FALLOC_FL_PUNCH_HOLE)
+	flags |= FS_FALLOC_PUNCH_HOLE;
+
+   if (offset < 0 || length <= 0)
+	return -EINVAL;
+   if (offset + length > UINT_MAX)
+	return -EFBIG;
+
+   switch (fs_fallocate(FS, fi->fh, flags, offset, length)) {
+   case 0:
+	return 0;
+   case FS_ERR_NOSPC:
+	return -ENOSPC;
+   case FS_ERR_FBIG:
+	return -EFBIG;
+   default:
+	return -EINVAL;
+   }
+}
+
+/** Get file system statistics
+ *
+ * Read from the counters of the superblock, so it costs no scan.
+ */
+int barefs_statfs(const char *path, struct statvfs *statv)
+{
+   fs_stats_t st;
+
+   if (fs_statfs(FS, &st) != 0)
+	return -EIO;
+
+   memset(statv, 0, sizeof(*statv));
+   statv->f_bsize = st.block_size;
+   statv->f_frsize = st.block_size;
+   statv->f_blocks = st.num_blocks;
+   statv->f_bfree = st.free_blocks;
+   statv->f_bavail = st.free_blocks;
+   statv->f_files = st.num_inodes;
+   statv->f_ffree = st.free_inodes;
+   statv->f_favail = st.free_inodes;
+   statv->f_namemax = FS_MAX_FNAME_SZ - 1;
+   return 0;
 }
 
 /** Release an open file
@@ -672,40 +1095,495 @@ int barefs_release(const char *path, struct fuse_file_info *fi)
    return 0;
 }
 
-/** Get extended attributes */
+/** Get extended attributes
+ *
+ *   user.barefs.du  "<bytes> <files>": the total size and the number of
+ *                   files of the directory subtree (of the file itself,
+ *                   on a file), without walking it
+ * e.g. "getfattr -n user.barefs.du /scratch"
+ */
 // Is usefull when executing "ls" shell command
 int barefs_getxattr(const char *path, const char *name, char *value, size_t size)
 {  
+   char du[32];
+   const char *leaf;
+   inodeid_t fileid, dir;
+   unsigned bytes, files;
+   int len;
+
+   if (strcmp(name, "user.barefs.du") != 0)
+	return 0;
+
+   if (resolve(path,&dir,&leaf,&fileid) != 0 || fileid == 0 ||
+	fs_du(FS,fileid,&bytes,&files) != 0)
+	return -ENOENT;
+
+   len = snprintf(du, sizeof(du), "%u %u", bytes, files);
+   if (size == 0)
+	return len;
+   if (size < len)
+	return -ERANGE;
+   memcpy(value, du, len);
+   return len;
+}
+
+/** Set extended attributes
+ *
+ * Used as a control interface, on the destination file:
+ *   user.barefs.clone = <pathname>  makes the file a copy of <pathname>
+ *                                   sharing its blocks (copied on write)
+ *   user.barefs.copy  = <pathname>  makes the file a copy of <pathname>
+ *                                   copying its blocks
+ *   user.barefs.rmtree              removes the file or the directory and
+ *                                   everything below it
+ * e.g. "setfattr -n user.barefs.clone -v /big /big.copy"
+ *      "setfattr -n user.barefs.rmtree /scratch"
+ */
+int barefs_setxattr(const char *path, const char *name, const char *value,
+		size_t size, int flags)
+{
+   char srcpath[MAX_PATH_NAME_SIZE];
+   inodeid_t srcid, dstid, dir;
+   const char *leaf;
+   int copyflags;
+
+   if (strcmp(name, "user.barefs.rmtree") == 0) {
+	/* removes the target and everything below it (the value is ignored) */
+	if (path[0] == '/' && path[1] == '\0')
+	  return -EBUSY;
+	if (resolve(path,&dir,&leaf,&dstid) != 0 || dstid == 0)
+	  return -ENOENT;
+	if (fs_rmtree(FS,dir,leaf) != 0) {
+	  log_warn("[barefs_setxattr] Error removing tree '%s'.\n", path);
+	  return -1;
+	}
+	return 0;
+   }
+
+   if (strcmp(name, "user.barefs.clone") == 0)
+	copyflags = FS_COPY_REFLINK;
+   else if (strcmp(name, "user.barefs.copy") == 0)
+	copyflags = 0;
+   else
+	return -ENOTSUP;
+
+   if (size == 0 || size >= MAX_PATH_NAME_SIZE)
+	return -EINVAL;
+   memcpy(srcpath, value, size);
+   srcpath[size] = '\0';
+
+   if (resolve(path,&dir,&leaf,&dstid) != 0 || dstid == 0 ||
+	resolve(srcpath,&dir,&leaf,&srcid) != 0 || srcid == 0)
+	return -ENOENT;
+
+   if (fs_copy(FS,srcid,dstid,copyflags) != 0) {
+	log_warn("[barefs_setxattr] Error copying '%s' to '%s'.\n", srcpath, path);
+	return -1;
+   }
    return 0;
 }
 
+///////////////////////////////////////////////////////////
+////////////////      INSTRUMENTATION
+///////////////////////////////////////////////////////////
+//
+// The operations go through these wrappers, that time each call into the
+// statistics (stats.h, read through CTL_STATS) and, with BAREFS_TRACE=<file>
+// in the environment, record it to <file> (trace.h) to be replayed by
+// tracereplay. Calls that do nothing (mknod, flush, utime, chown, chmod)
+// are timed but not recorded.
+//
+
+/** timed_begin() - auxiliar function: starts timing a call, forgetting the
+ * paths resolved by the previous one (the record of a call takes the ids
+ * and names of the paths its handler resolved, see resolve()) */
+static uint64_t timed_begin(void)
+{
+   memset(&resolved, 0, sizeof(resolved));
+   return trace_now();
+}
+
+/** timed_end() - auxiliar function: accounts a call started at 'start' to
+ * its probe and, when tracing, fills in the common fields of its record;
+ * returns whether the call is to be recorded */
+static int timed_end(trace_rec_t *rec, int probe, int op, uint64_t start, int res)
+{
+   uint64_t end = trace_now();
+
+   stats_add(probe, end - start);
+   if (!trace_enabled())
+	return 0;
+   rec->op = op;
+   rec->start = start;
+   rec->duration = end - start;
+   rec->result = res;
+   return 1;
+}
+
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_getattr(path, stbuf);
+   if (timed_end(&rec, STATS_GETATTR, TRACE_GETATTR, t0, res)) {
+	rec.ino = (res == 0) ? stbuf->st_ino : 0;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	   off_t offset, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_readdir(path, buf, filler, offset, fi);
+   if (timed_end(&rec, STATS_READDIR, TRACE_READDIR, t0, res)) {
+	rec.ino = resolved.fileid[0];
+	rec.offset = offset;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_open(path, fi);
+   if (timed_end(&rec, STATS_OPEN, TRACE_OPEN, t0, res)) {
+	rec.ino = (res == 0) ? fi->fh : 0;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_release(path, fi);
+   if (timed_end(&rec, STATS_RELEASE, TRACE_RELEASE, t0, res)) {
+	rec.ino = fi->fh;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_create(path, mode, fi);
+   if (timed_end(&rec, STATS_CREATE, TRACE_CREATE, t0, res)) {
+	rec.ino = resolved.dir[0];
+	rec.ino2 = (res == 0) ? fi->fh : 0;
+	trace_record(&rec, resolved.leaf[0], NULL);
+   }
+   return res;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_mkdir(path, mode);
+   if (timed_end(&rec, STATS_MKDIR, TRACE_MKDIR, t0, res)) {
+	rec.ino = resolved.dir[0];
+	rec.ino2 = (res == 0) ? resolved.fileid[0] : 0;
+	trace_record(&rec, resolved.leaf[0], NULL);
+   }
+   return res;
+}
+
+static int timed_unlink(const char *path)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_unlink(path);
+   if (timed_end(&rec, STATS_UNLINK, TRACE_UNLINK, t0, res)) {
+	rec.ino = resolved.dir[0];
+	trace_record(&rec, resolved.leaf[0], NULL);
+   }
+   return res;
+}
+
+static int timed_rmdir(const char *path)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_rmdir(path);
+   if (timed_end(&rec, STATS_RMDIR, TRACE_RMDIR, t0, res)) {
+	rec.ino = resolved.dir[0];
+	trace_record(&rec, resolved.leaf[0], NULL);
+   }
+   return res;
+}
+
+static int timed_rename(const char *from, const char *to)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_rename(from, to);
+   if (timed_end(&rec, STATS_RENAME, TRACE_RENAME, t0, res)) {
+	rec.ino = resolved.dir[0];
+	rec.ino2 = resolved.dir[1];
+	trace_record(&rec, resolved.leaf[0], resolved.leaf[1]);
+   }
+   return res;
+}
+
+static int timed_link(const char *from, const char *to)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_link(from, to);
+   if (timed_end(&rec, STATS_LINK, TRACE_LINK, t0, res)) {
+	rec.ino = resolved.dir[1];
+	rec.ino2 = resolved.fileid[0];
+	trace_record(&rec, resolved.leaf[1], NULL);
+   }
+   return res;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+	   struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_read(path, buf, size, offset, fi);
+   if (timed_end(&rec, STATS_READ, TRACE_READ, t0, res)) {
+	rec.ino = fi->fh;
+	rec.offset = offset;
+	rec.size = size;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+	   off_t offset, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_write(path, buf, size, offset, fi);
+   if (timed_end(&rec, STATS_WRITE, TRACE_WRITE, t0, res)) {
+	rec.ino = fi->fh;
+	rec.offset = offset;
+	rec.size = size;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+	   off_t offset, struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_read_buf(path, bufp, size, offset, fi);
+   if (timed_end(&rec, STATS_READ, TRACE_READ, t0, res)) {
+	rec.ino = fi->fh;
+	rec.offset = offset;
+	rec.size = size;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+	   struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   size_t size = fuse_buf_size(buf);
+   uint64_t t0 = trace_now();
+   int res = barefs_write_buf(path, buf, offset, fi);
+   if (timed_end(&rec, STATS_WRITE, TRACE_WRITE, t0, res)) {
+	rec.ino = fi->fh;
+	rec.offset = offset;
+	rec.size = size;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_truncate(const char *path, off_t newsize)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_truncate(path, newsize);
+   if (timed_end(&rec, STATS_TRUNCATE, TRACE_TRUNCATE, t0, res)) {
+	rec.ino = resolved.fileid[0];
+	rec.size = newsize;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t length,
+	   struct fuse_file_info *fi)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_fallocate(path, mode, offset, length, fi);
+   if (timed_end(&rec, STATS_FALLOCATE, TRACE_FALLOCATE, t0, res)) {
+	rec.ino = fi->fh;
+	rec.ino2 = ((mode & FALLOC_FL_KEEP_SIZE) ? FS_FALLOC_KEEP_SIZE : 0) |
+	   ((mode & FALLOC_FL_PUNCH_HOLE) ? FS_FALLOC_PUNCH_HOLE : 0);
+	rec.offset = offset;
+	rec.size = length;
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_statfs(const char *path, struct statvfs *statv)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = trace_now();
+   int res = barefs_statfs(path, statv);
+   if (timed_end(&rec, STATS_STATFS, TRACE_STATFS, t0, res)) {
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+   trace_rec_t rec = {0};
+   uint64_t t0 = timed_begin();
+   int res = barefs_getxattr(path, name, value, size);
+   int op = (strcmp(name, "user.barefs.du") == 0) ? TRACE_DU : TRACE_XATTR;
+   if (timed_end(&rec, STATS_GETXATTR, op, t0, res)) {
+	rec.ino = resolved.fileid[0];
+	trace_record(&rec, NULL, NULL);
+   }
+   return res;
+}
+
+static int timed_setxattr(const char *path, const char *name, const char *value,
+	   size_t size, int flags)
+{
+   trace_rec_t rec = {0};
+   int op = TRACE_XATTR;
+
+   if (strcmp(name, "user.barefs.rmtree") == 0)
+	op = TRACE_RMTREE;
+   else if (strcmp(name, "user.barefs.clone") == 0)
+	op = TRACE_CLONE;
+   else if (strcmp(name, "user.barefs.copy") == 0)
+	op = TRACE_COPY;
+
+   uint64_t t0 = timed_begin();
+   int res = barefs_setxattr(path, name, value, size, flags);
+   if (timed_end(&rec, STATS_SETXATTR, op, t0, res)) {
+	if (op == TRACE_RMTREE) {
+	   rec.ino = resolved.dir[0];
+	   trace_record(&rec, resolved.leaf[0], NULL);
+	} else {
+	   rec.ino = resolved.fileid[0];
+	   rec.ino2 = resolved.fileid[1];
+	   trace_record(&rec, NULL, NULL);
+	}
+   }
+   return res;
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{
+   uint64_t t0 = trace_now();
+   int res = barefs_mknod(path, mode, dev);
+   stats_add(STATS_MKNOD, trace_now() - t0);
+   return res;
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+   uint64_t t0 = trace_now();
+   int res = barefs_flush(path, fi);
+   stats_add(STATS_FLUSH, trace_now() - t0);
+   return res;
+}
+
+static int timed_utime(const char *path, struct utimbuf *ubuf)
+{
+   uint64_t t0 = trace_now();
+   int res = barefs_utime(path, ubuf);
+   stats_add(STATS_UTIME, trace_now() - t0);
+   return res;
+}
+
+static int timed_chown(const char *path, uid_t uid, gid_t gid)
+{
+   uint64_t t0 = trace_now();
+   int res = barefs_chown(path, uid, gid);
+   stats_add(STATS_CHOWN, trace_now() - t0);
+   return res;
+}
+
+static int timed_chmod(const char *path, mode_t mode)
+{
+   uint64_t t0 = trace_now();
+   int res = barefs_chmod(path, mode);
+   stats_add(STATS_CHMOD, trace_now() - t0);
+   return res;
+}
+
 static struct fuse_operations barefs_oper = {
-	.getattr	= barefs_getattr,
-	.readdir	= barefs_readdir,
-	.open		= barefs_open,
-	.create		= barefs_create,
-	.mkdir		= barefs_mkdir,
-	.rmdir		= barefs_rmdir,
-	.link		= barefs_link,
-	.unlink		= barefs_unlink,  
-	.mknod		= barefs_mknod,
-	.read		= barefs_read,
-	.write		= barefs_write,
+	.getattr	= timed_getattr,
+	.readdir	= timed_readdir,
+	.open		= timed_open,
+	.create		= timed_create,
+	.mkdir		= timed_mkdir,
+	.rmdir		= timed_rmdir,
+	.link		= timed_link,
+	.rename		= timed_rename,
+	.unlink		= timed_unlink,  
+	.mknod		= timed_mknod,
+	.read		= timed_read,
+	.write		= timed_write,
+	.read_buf	= timed_read_buf,
+	.write_buf	= timed_write_buf,
 	.init		= barefs_init,
-	.flush		= barefs_flush,
+	.flush		= timed_flush,
 	.destroy	= barefs_destroy,
-	.release	= barefs_release,
-	.utime		= barefs_utime,
-	.chown		= barefs_chown,
-	.chmod		= barefs_chmod,
-	.truncate	= barefs_truncate,
-	.getxattr 	= barefs_getxattr,	
+	.release	= timed_release,
+	.utime		= timed_utime,
+	.chown		= timed_chown,
+	.chmod		= timed_chmod,
+	.truncate	= timed_truncate,
+	.fallocate	= timed_fallocate,
+	.statfs		= timed_statfs,
+	.getxattr 	= timed_getxattr,	
+	.setxattr	= timed_setxattr,
 	
 };
 
+/*
+ * BAREFS_LOG=<level> in the environment logs the messages of that level
+ * (off, error, warn, info, debug) and below to BAREFS_LOG_FILE (barefs.log
+ * if not set), to be read with logdump
+ */
 int main(int argc, char *argv[])
 {
+    const char *trace = getenv("BAREFS_TRACE");
+    const char *level = getenv("BAREFS_LOG");
+    const char *logfile = getenv("BAREFS_LOG_FILE");
+
+    if (trace != NULL && trace_open(trace, NUM_BLOCKS) != 0) {
+	fprintf(stderr, "barefs: cannot open the trace '%s'\n", trace);
+	return 1;
+    }
+    if (level != NULL) {
+	int l = log_level_parse(level);
+	if (l < 0) {
+	   fprintf(stderr, "barefs: unknown log level '%s'\n", level);
+	   return 1;
+	}
+	if (l != LOG_OFF && log_open(logfile ? logfile : "barefs.log", l) != 0) {
+	   fprintf(stderr, "barefs: cannot open the log '%s'\n", logfile ? logfile : "barefs.log");
+	   return 1;
+	}
+    }
     return fuse_main(argc, argv, &barefs_oper, NULL);	
 }
-
-
@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# Compares the build variants (make release o3 lto pgo, built in build/)
+# with the debug build of this directory on the library benchmarks: the
+# fsbench throughput of every operation, the pathbench cost of resolving
+# a pathname, and an agebench run, whose fixed-seed churn must leave the
+# same volume as with the debug build for the variant to be verified.
+# The fastest verified variant, by the geometric mean of its fsbench
+# speedups over the debug build, is linked as build/best, e.g.
+#     make bench-compare && cp build/best/barefs /usr/local/bin
+#
+# Usage: benchcompare.sh [iterations]
+
+set -e
+cd "$(dirname "$0")"
+
+iters=${1:-20000}
+out=$(mktemp -d "${TMPDIR:-/tmp}/benchcompare.XXXXXX")
+trap 'rm -rf "$out"' EXIT
+
+variants=debug
+for v in release o3 lto pgo; do
+  if [ -x "build/$v/fsbench" ]; then
+    variants="$variants $v"
+  fi
+done
+
+for v in $variants; do
+  if [ "$v" = debug ]; then d=.; else d=build/$v; fi
+  echo "benchcompare.sh: running $v" >&2
+  ok=yes
+  "$d/fsbench" "$iters" > "$out/$v.fs" || ok=no
+  "$d/pathbench" "$iters" > "$out/$v.path" || ok=no
+  # the volume left by the churn, without the timings
+  "$d/agebench" -e 10 | sed 's/"seqread_mb_s":[^,]*,"append_p50_us":[^,]*,"append_p99_us":[^,]*,//' \
+    > "$out/$v.age" || ok=no
+  if [ "$v" != debug ] && ! cmp -s "$out/debug.age" "$out/$v.age"; then
+    ok=no
+  fi
+  echo "$ok" > "$out/$v.ok"
+done
+
+awk -v out="$out" -v variants="$variants" '
+  function load(v,   f, line, n, sum) {
+    f = out "/" v ".fs"
+    while ((getline line < f) > 0) {
+      n = split(line, w, " ")
+      if (n == 5 && w[1] != "op") {
+        if (!((w[1]) in seen)) { seen[w[1]] = 1; ops[++nops] = w[1] }
+        rate[w[1], v] = w[3]
+      }
+    }
+    f = out "/" v ".path"
+    sum = 0
+    while ((getline line < f) > 0) {
+      n = split(line, w, " ")
+      if (n == 4 && w[1] ~ /^[0-9]+$/) { sum += w[3] }
+    }
+    resolve[v] = sum
+    f = out "/" v ".ok"
+    getline ok[v] < f
+  }
+  BEGIN {
+    nv = split(variants, vs, " ")
+    for (i = 1; i <= nv; i++) { load(vs[i]) }
+
+    printf "%-14s", "ops/s"
+    for (i = 1; i <= nv; i++) { printf " %10s", vs[i] }
+    printf "\n"
+    for (o = 1; o <= nops; o++) {
+      printf "%-14s", ops[o]
+      for (i = 1; i <= nv; i++) { printf " %10s", rate[ops[o], vs[i]] }
+      printf "\n"
+    }
+    printf "%-14s", "resolve ns"
+    for (i = 1; i <= nv; i++) { printf " %10.0f", resolve[vs[i]] }
+    printf "\n"
+
+    # geometric mean of the fsbench speedups over the debug build
+    printf "%-14s", "speedup"
+    bestv = ""; bests = 0
+    for (i = 1; i <= nv; i++) {
+      logs = 0; n = 0
+      for (o = 1; o <= nops; o++) {
+        if (rate[ops[o], "debug"] > 0 && rate[ops[o], vs[i]] > 0) {
+          logs += log(rate[ops[o], vs[i]] / rate[ops[o], "debug"]); n++
+        }
+      }
+      s = n ? exp(logs / n) : 0
+      printf " %9.2fx", s
+      if (ok[vs[i]] == "yes" && s > bests) { bests = s; bestv = vs[i] }
+    }
+    printf "\n%-14s", "verified"
+    for (i = 1; i <= nv; i++) { printf " %10s", ok[vs[i]] }
+    printf "\n"
+    print "best " bestv
+  }' > "$out/table"
+grep -v '^best ' "$out/table"
+
+fastest=$(sed -n 's/^best //p' "$out/table")
+if [ -n "$fastest" ] && [ "$fastest" != debug ]; then
+  ln -sfn "$fastest" build/best
+  echo "fastest verified variant: $fastest (build/best)"
+else
+  echo "fastest verified variant: debug"
+fi
@@ -4,10 +4,16 @@
  * block.c
  *
  * Storage layer which offers the abstraction of a sequence of 
- * blocks of fixed size. Blocks are kept in memory.
+ * blocks of fixed size. Blocks are kept in memory, in an anonymous
+ * memory file when the system supports it, so that block ranges can
+ * also be handed out as file descriptor ranges (e.g. for splicing).
+ * Every block counts its reads and writes, and the bytes they moved, with
+ * relaxed atomic adds so that the accounting can stay on: the totals are
+ * summed when asked for.
  * 
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,33 +21,104 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include "block.h"
+#include "stats.h"
+#include "probes.h"
 
 
 // internal implementation of 'blocks_t' 
 struct blocks_ {
    unsigned block_size;
    unsigned num_blocks;
-   char blocks[0];
+   int fd;          // memory file holding the blocks, -1 if plain memory
+   char* blocks;
+   unsigned meta;   // blocks, from block 0, holding metadata
+   uint64_t* reads;     // reads per block
+   uint64_t* writes;    // writes per block
+   uint64_t* read_bytes;    // bytes read per block
+   uint64_t* write_bytes;   // bytes written per block
 };
 
 
-blocks_t* block_new(unsigned num_blocks, unsigned block_sz)
+// heatmap geometry: cells per row and maximum rows
+#define HEAT_COLS 64
+#define HEAT_ROWS 16
+
+// heatmap chars, from no I/O to the busiest cell
+static const char heat_chars[] = " .:-=+*#%@";
+
+
+/*
+ * Internal function allocating the (zeroed) storage of the blocks
+ */
+
+static blocks_t* block_alloc(unsigned block_sz, unsigned num_blocks)
 {
-   if (num_blocks * block_sz == 0) {
+   size_t size = (size_t) num_blocks * block_sz;
+   blocks_t* bks = (blocks_t*) malloc(sizeof(blocks_t));
+   if (bks == NULL) {
       return NULL;
    }
-   blocks_t* bks = (blocks_t*) 
-      malloc(sizeof(blocks_t) + num_blocks * block_sz);
    bks->block_size = block_sz;
    bks->num_blocks = num_blocks;
-   memset(&bks->blocks[0], 0, num_blocks * block_sz);
+   bks->fd = -1;
+   bks->blocks = NULL;
+   bks->meta = 0;
+   bks->reads = (uint64_t*) calloc(4 * (size_t) num_blocks, sizeof(uint64_t));
+   if (bks->reads == NULL) {
+      free(bks);
+      return NULL;
+   }
+   bks->writes = bks->reads + num_blocks;
+   bks->read_bytes = bks->writes + num_blocks;
+   bks->write_bytes = bks->read_bytes + num_blocks;
+
+#ifdef MFD_CLOEXEC
+   int fd = memfd_create("barefs-blocks", MFD_CLOEXEC);
+   if (fd >= 0) {
+      void* ptr = MAP_FAILED;
+      if (ftruncate(fd, size) == 0) {
+         ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      if (ptr != MAP_FAILED) {
+         bks->fd = fd;
+         bks->blocks = (char*) ptr;
+         return bks;
+      }
+      close(fd);
+   }
+#endif
+
+   // no memory file: keep the blocks in plain memory
+   bks->blocks = (char*) calloc(1, size);
+   if (bks->blocks == NULL) {
+      free(bks->reads);
+      free(bks);
+      return NULL;
+   }
    return bks;
 }
 
 
+blocks_t* block_new(unsigned num_blocks, unsigned block_sz)
+{
+   if (num_blocks * block_sz == 0) {
+      return NULL;
+   }
+   return block_alloc(block_sz, num_blocks);
+}
+
+
 void block_free(blocks_t* bks)
 {
+   if (bks->fd >= 0) {
+      munmap(bks->blocks, (size_t) bks->num_blocks * bks->block_size);
+      close(bks->fd);
+   } else {
+      free(bks->blocks);
+   }
+   free(bks->reads);
    free(bks);
 }
 
@@ -58,14 +135,25 @@ unsigned block_num_blocks(blocks_t* bks)
 }
 
 
+void block_layout(blocks_t* bks, unsigned meta)
+{
+   bks->meta = meta;
+}
+
+
 int block_read(blocks_t* bks, unsigned block_no, char* block)
 {
    if (block_no >= bks->num_blocks) {
 	  return -1;
    }
+   STATS_BEGIN(t0);
  
    char* ptr = &bks->blocks[block_no * bks->block_size]; 
    memcpy(block,ptr,bks->block_size);
+   __atomic_fetch_add(&bks->reads[block_no], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&bks->read_bytes[block_no], bks->block_size, __ATOMIC_RELAXED);
+   STATS_END(STATS_BLOCK_READ, t0);
+   PROBE2(block__read, block_no, bks->block_size);
    return 0;
 }
 
@@ -75,9 +163,46 @@ int block_write(blocks_t* bks, unsigned block_no, char* block)
    if (block_no >= bks->num_blocks) {
 	  return -1;
    }
+   STATS_BEGIN(t0);
 
    char* ptr = &bks->blocks[block_no * bks->block_size]; 
    memcpy(ptr,block,bks->block_size);
+   __atomic_fetch_add(&bks->writes[block_no], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&bks->write_bytes[block_no], bks->block_size, __ATOMIC_RELAXED);
+   STATS_END(STATS_BLOCK_WRITE, t0);
+   STATS_WRITTEN(block_no, bks->block_size);
+   PROBE2(block__write, block_no, bks->block_size);
+   return 0;
+}
+
+
+int block_fd(blocks_t* bks, unsigned block_no, off_t* pos)
+{
+   if (block_no >= bks->num_blocks || bks->fd < 0) {
+      return -1;
+   }
+
+   *pos = (off_t) block_no * bks->block_size;
+   return bks->fd;
+}
+
+
+int block_account(blocks_t* bks, unsigned block_no, unsigned bytes, int write)
+{
+   if (block_no >= bks->num_blocks || bytes > bks->block_size) {
+      return -1;
+   }
+
+   if (write) {
+      __atomic_fetch_add(&bks->writes[block_no], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&bks->write_bytes[block_no], bytes, __ATOMIC_RELAXED);
+      STATS_WRITTEN(block_no, bytes);
+      PROBE2(block__write, block_no, bytes);
+   } else {
+      __atomic_fetch_add(&bks->reads[block_no], 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&bks->read_bytes[block_no], bytes, __ATOMIC_RELAXED);
+      PROBE2(block__read, block_no, bytes);
+   }
    return 0;
 }
 
@@ -109,16 +234,23 @@ blocks_t* block_load(char* file)
       return NULL;
    }
 
-   blocks_t* bks = (blocks_t*)
-      malloc(sizeof(blocks_t) + num_blocks * block_size);
+   if (num_blocks * block_size == 0) {
+      close(fd);
+      return NULL;
+   }
+
+   blocks_t* bks = block_alloc(block_size, num_blocks);
+   if (bks == NULL) {
+      close(fd);
+      return NULL;
+   }
    status = read(fd, bks->blocks, num_blocks * block_size);
    if (status != num_blocks * block_size) {
       close(fd);
-      free(bks);
+      block_free(bks);
       return NULL;
    }
-   bks->block_size = block_size;
-   bks->num_blocks = num_blocks;
+   close(fd);
    return bks;
 }
 
@@ -134,9 +266,16 @@ int block_store(blocks_t* bks, char* file)
       return -1;
    }
 
-   unsigned size = sizeof(blocks_t) + bks->block_size * bks->num_blocks;
+   // image format: block size, number of blocks and then the blocks
+   unsigned header[2] = { bks->block_size, bks->num_blocks };
+   int status = write(fd, (char*)header, sizeof(header));
+   if (status != sizeof(header)) {
+      close(fd);
+      return -1;
+   }
 
-   int status = write(fd, (char*)bks, size);
+   unsigned size = bks->block_size * bks->num_blocks;
+   status = write(fd, bks->blocks, size);
    if (status != size) {
       close(fd);
       return -1;
@@ -147,9 +286,180 @@ int block_store(blocks_t* bks, char* file)
 }
 
 
+void block_io(blocks_t* bks, unsigned first, unsigned end, block_io_t* io)
+{
+   memset(io, 0, sizeof(block_io_t));
+   if (end > bks->num_blocks) {
+      end = bks->num_blocks;
+   }
+   for (unsigned b = first; b < end; b++) {
+      io->reads += __atomic_load_n(&bks->reads[b], __ATOMIC_RELAXED);
+      io->writes += __atomic_load_n(&bks->writes[b], __ATOMIC_RELAXED);
+      io->read_bytes += __atomic_load_n(&bks->read_bytes[b], __ATOMIC_RELAXED);
+      io->write_bytes += __atomic_load_n(&bks->write_bytes[b], __ATOMIC_RELAXED);
+   }
+}
+
+
+int block_io_count(blocks_t* bks, unsigned block_no, uint64_t* reads,
+   uint64_t* writes)
+{
+   if (block_no >= bks->num_blocks) {
+      return -1;
+   }
+   *reads = __atomic_load_n(&bks->reads[block_no], __ATOMIC_RELAXED);
+   *writes = __atomic_load_n(&bks->writes[block_no], __ATOMIC_RELAXED);
+   return 0;
+}
+
+
+void block_io_reset(blocks_t* bks)
+{
+   for (unsigned b = 0; b < bks->num_blocks; b++) {
+      __atomic_store_n(&bks->reads[b], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&bks->writes[b], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&bks->read_bytes[b], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&bks->write_bytes[b], 0, __ATOMIC_RELAXED);
+   }
+}
+
+
+/*
+ * Internal functions formatting the I/O accounting
+ */
+
+#define APPEND(...) len += snprintf(buf + (len < size ? len : size), \
+      len < size ? size - len : 0, __VA_ARGS__)
+
+// the heatmap char of a cell with 'ops' I/O, the busiest cell having 'max'
+static char heat_char(uint64_t ops, uint64_t max)
+{
+   int levels = sizeof(heat_chars) - 2;
+
+   if (ops == 0) {
+      return heat_chars[0];
+   }
+   int l = 64 - __builtin_clzll(ops), lmax = 64 - __builtin_clzll(max);
+   return heat_chars[1 + (lmax > 1 ? (l - 1) * (levels - 1) / (lmax - 1) : levels - 1)];
+}
+
+// the I/O of cell 'c' of a heatmap, of 'per_cell' blocks
+static uint64_t heat_cell(blocks_t* bks, const uint64_t* counts, unsigned c,
+   unsigned per_cell)
+{
+   uint64_t ops = 0;
+
+   for (unsigned b = c * per_cell; b < (c + 1) * per_cell && b < bks->num_blocks; b++) {
+      ops += __atomic_load_n(&counts[b], __ATOMIC_RELAXED);
+   }
+   return ops;
+}
+
+// appends the heatmap of the counts 'counts', a row of HEAT_COLS cells
+// per line
+static int heat_format(blocks_t* bks, const uint64_t* counts, const char* what,
+   char* buf, int size)
+{
+   unsigned num = bks->num_blocks;
+   unsigned cells = HEAT_COLS * HEAT_ROWS;
+   unsigned per_cell = (num + cells - 1) / cells;
+   unsigned ncells = (num + per_cell - 1) / per_cell;
+   uint64_t max = 0;
+   int len = 0;
+
+   for (unsigned c = 0; c < ncells; c++) {
+      uint64_t ops = heat_cell(bks, counts, c, per_cell);
+      max = (ops > max) ? ops : max;
+   }
+
+   APPEND("# %s heatmap: %u block(s) per cell, '%c' for 1 to '%c' for %llu (log2)\n",
+      what, per_cell, heat_chars[1], heat_chars[sizeof(heat_chars) - 2],
+      (unsigned long long) max);
+   for (unsigned c = 0; c < ncells; c++) {
+      uint64_t ops = heat_cell(bks, counts, c, per_cell);
+      if (c % HEAT_COLS == 0) {
+         APPEND("%8u |", c * per_cell);
+      }
+      APPEND("%c", heat_char(ops, max));
+      if (c % HEAT_COLS == HEAT_COLS - 1 || c == ncells - 1) {
+         APPEND("|\n");
+      }
+   }
+   return len;
+}
+
+
+int block_io_format(blocks_t* bks, unsigned meta, int top, char* buf, int size)
+{
+   block_io_t io[3];
+   const char* names[3] = { "metadata", "data", "total" };
+   int len = 0;
+
+   block_io(bks, 0, meta, &io[0]);
+   block_io(bks, meta, bks->num_blocks, &io[1]);
+   block_io(bks, 0, bks->num_blocks, &io[2]);
+
+   APPEND("# blocks: %u of %u bytes, %u of metadata\n", bks->num_blocks,
+      bks->block_size, meta < bks->num_blocks ? meta : bks->num_blocks);
+   APPEND("# range reads writes read_bytes write_bytes\n");
+   for (int i = 0; i < 3; i++) {
+      APPEND("%s %llu %llu %llu %llu\n", names[i],
+         (unsigned long long) io[i].reads, (unsigned long long) io[i].writes,
+         (unsigned long long) io[i].read_bytes,
+         (unsigned long long) io[i].write_bytes);
+   }
+
+   len += heat_format(bks, bks->reads, "read", buf + (len < size ? len : size),
+      len < size ? size - len : 0);
+   len += heat_format(bks, bks->writes, "write", buf + (len < size ? len : size),
+      len < size ? size - len : 0);
+
+   // the 'top' blocks with the most I/O, kept sorted by insertion
+   unsigned* hot = (unsigned*) malloc((top > 0 ? top : 1) * sizeof(unsigned));
+   uint64_t* hot_ops = (uint64_t*) malloc((top > 0 ? top : 1) * sizeof(uint64_t));
+   int nhot = 0;
+   if (hot == NULL || hot_ops == NULL) {
+      top = 0;
+   }
+   for (unsigned b = 0; b < bks->num_blocks && top > 0; b++) {
+      uint64_t ops = __atomic_load_n(&bks->reads[b], __ATOMIC_RELAXED) +
+         __atomic_load_n(&bks->writes[b], __ATOMIC_RELAXED);
+      if (ops == 0 || (nhot == top && ops <= hot_ops[nhot - 1])) {
+         continue;
+      }
+      int i = (nhot < top) ? nhot++ : nhot - 1;
+      for (; i > 0 && hot_ops[i - 1] < ops; i--) {
+         hot[i] = hot[i - 1];
+         hot_ops[i] = hot_ops[i - 1];
+      }
+      hot[i] = b;
+      hot_ops[i] = ops;
+   }
+
+   APPEND("# hottest blocks: block reads writes kind\n");
+   for (int i = 0; i < nhot; i++) {
+      APPEND("%u %llu %llu %s\n", hot[i], (unsigned long long) bks->reads[hot[i]],
+         (unsigned long long) bks->writes[hot[i]], hot[i] < meta ? "meta" : "data");
+   }
+   free(hot);
+   free(hot_ops);
+   return len;
+}
+
+#undef APPEND
+
+
 void block_dump(blocks_t* bks)
 {
+   int size = 64 * 1024;
+   char* text = (char*) malloc(size);
+
    printf("Blocks:\n");
    printf("- Block size: %u\n", bks->block_size);
    printf("- Num blocks: %u\n", bks->num_blocks);
+   if (text != NULL) {
+      int len = block_io_format(bks, bks->meta, 16, text, size);
+      fwrite(text, 1, len < size ? len : size - 1, stdout);
+      free(text);
+   }
 }
@@ -11,6 +11,8 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+#include <stdint.h>
 
 /*
  * blocks_t: the storage abstraction of a virtual disk
@@ -47,6 +49,14 @@ unsigned block_size(blocks_t* bks);
 unsigned block_num_blocks(blocks_t* bks);
 
 
+/*
+ * block_layout: sets the blocks holding metadata, for block_dump
+ * - bks: the blocks instance
+ * - meta: the number of blocks, from block 0, holding metadata
+ */
+void block_layout(blocks_t* bks, unsigned meta);
+
+
 /*
  * block_read: read a whole block
  * - bks: the blocks instance
@@ -67,6 +77,30 @@ int block_read(blocks_t* bks, unsigned block_no, char* block);
 int block_write(blocks_t* bks, unsigned block_no, char* block);
 
 
+/*
+ * block_fd: get the file descriptor range holding a block, so that the
+ * block can be transferred (e.g. spliced) without copying it to a buffer
+ * - bks: the blocks instance
+ * - block_no: the number of the block
+ * - pos: the position of the block in the file descriptor [out]
+ *   returns: the file descriptor, -1 if not available
+ */
+int block_fd(blocks_t* bks, unsigned block_no, off_t* pos);
+
+
+/*
+ * block_account: counts the I/O of a transfer through block_fd, which
+ * the blocks instance does not see (a write is also accounted to the
+ * operation written for, as block_write does)
+ * - bks: the blocks instance
+ * - block_no: the number of the block
+ * - bytes: the bytes of the block moved
+ * - write: if the block was written, rather than read
+ *   returns: 0 if sucessful, -1 if not
+ */
+int block_account(blocks_t* bks, unsigned block_no, unsigned bytes, int write);
+
+
 /*
  * block_load: load an image of blocks from a file
  * - file: the name of the file
@@ -85,7 +119,65 @@ int block_store(blocks_t* bks, char* file);
 
 
 /*
- * block_dump: dumps the content of blocks
+ * block_io_t: the I/O of a range of blocks since they were created (or the
+ * counts reset); every block_read and block_write is counted, to the block
+ * it moves, and so is every transfer through block_fd given to
+ * block_account
+ */
+typedef struct {
+   uint64_t reads;          // block_read calls and accounted reads
+   uint64_t writes;         // block_write calls and accounted writes
+   uint64_t read_bytes;
+   uint64_t write_bytes;
+} block_io_t;
+
+
+/*
+ * block_io: sums the I/O of a range of blocks
+ * - bks: the blocks instance
+ * - first: the first block of the range
+ * - end: the block following the range (clipped to the number of blocks)
+ * - io: the I/O of the range [out]
+ */
+void block_io(blocks_t* bks, unsigned first, unsigned end, block_io_t* io);
+
+
+/*
+ * block_io_count: gets the I/O counts of a block
+ * - bks: the blocks instance
+ * - block_no: the number of the block
+ * - reads: the reads of the block [out]
+ * - writes: the writes of the block [out]
+ *   returns: 0 if sucessful, -1 if not
+ */
+int block_io_count(blocks_t* bks, unsigned block_no, uint64_t* reads,
+   uint64_t* writes);
+
+
+/*
+ * block_io_reset: starts counting the I/O from zero
+ * - bks: the blocks instance
+ */
+void block_io_reset(blocks_t* bks);
+
+
+/*
+ * block_io_format: writes the I/O accounting as text: the totals of the
+ * metadata blocks, of the data blocks and of all blocks, heatmaps of the
+ * reads and of the writes (a char per range of blocks, on a log scale)
+ * and the blocks with the most I/O
+ * - bks: the blocks instance
+ * - meta: the number of blocks, from block 0, holding metadata
+ * - top: the number of blocks ranked
+ * - buf: where to write the text [out]
+ * - size: the size of 'buf'
+ *   returns: the length of the text, that was truncated if not below 'size'
+ */
+int block_io_format(blocks_t* bks, unsigned meta, int top, char* buf, int size);
+
+
+/*
+ * block_dump: dumps the content of blocks, with their I/O accounting
  * - bks - the blocks instance
  */
 void block_dump(blocks_t* bks);
@@ -9,13 +9,18 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
 #include "fs.h"
+#include "stats.h"
+#include "log.h"
+#include "probes.h"
 
-#define dprintf if(1) printf
 
 #define BLOCK_SIZE 512
 
@@ -40,44 +45,215 @@ typedef struct fs_inode {
 
 typedef unsigned int fs_inode_ext_t;
 
+/*
+ * Usage accounting, in the reserved words of the inodes
+ * - a directory keeps the bytes (apparent size) and the number of files of
+ *   its whole subtree, and its parent to pass the changes up
+ * - a file is accounted once, in one of the directories linking it
+ */
+
+#define DU_BYTES 1    // directory: bytes of the files of the subtree
+
+#define DU_FILES 2    // directory: number of files of the subtree
+
+#define DU_PARENT 3   // directory: parent directory (0 for the root)
+
+#define DU_OWNER 1    // file: directory the file is accounted in
+
 
 /*
  * Directory entry
  * - directory entry size = 16 bytes
  * - filename max size - 14 bytes (13 chars + '\0') defined in fs.h
+ * - the type of the object is kept with the inode id, so that listing
+ *   a directory does not need to read the inodes of its entries
+ * - a removed entry is left as a free slot (inode id 0) for a later entry
+ *   to reuse, so that the others never move; the last entry of a
+ *   directory is always in use
  */
 
 #define DIR_PAGE_ENTRIES (BLOCK_SIZE / sizeof(fs_dentry_t))
 
 typedef struct dentry {
    char name[FS_MAX_FNAME_SZ];
-   inodeid_t inodeid;
+   inodeid_t inodeid : 12;
+   inodeid_t type : 4;      // fs_itype_t of the object
 } fs_dentry_t;
 
 
 /*
  * File syste structure
  * - inode table size = 64 entries (8 blocks)
+ * - block reference counts = 1 byte per block (8 blocks), counting the
+ *   references to a block besides the first one (blocks shared by
+ *   copies of a file are copied on write)
+ * - discard bitmap = 1 bit per block, set for the free blocks that were
+ *   not zeroed when freed (they are zeroed when reused partially written,
+ *   or by fs_scrub while the file system is idle)
+ * - superblock = the free block and inode counts, kept up to date by every
+ *   allocation and free so that the free space is known without a scan
  * 
  * Internal organization 
- *   - block 0        - free block bitmap
- *   - block 1        - free inode bitmap
- *   - block 2-9      - inode table (8 blocks)
- *   - block 10-(N-1) - data blocks, where N is the number of blocks
+ *   - block 0         - free block bitmap
+ *   - block 1         - free inode bitmap
+ *   - block 2-9       - inode table (8 blocks)
+ *   - block 10-17     - block reference counts (8 blocks)
+ *   - block 18        - discard bitmap
+ *   - block 19        - superblock
+ *   - block 20-(N-1)  - data blocks, where N is the number of blocks
  */
 
 #define ITAB_NUM_BLKS 8
 
 #define ITAB_SIZE (ITAB_NUM_BLKS*BLOCK_SIZE / sizeof(fs_inode_t))
 
+#define REFS_NUM_BLKS 8
+
+#define DISC_BLK (2 + ITAB_NUM_BLKS + REFS_NUM_BLKS)
+
+#define SUPER_BLK (DISC_BLK + 1)
+
+#define META_NUM_BLKS (SUPER_BLK + 1)
+
+typedef struct fs_super {
+   unsigned int num_blocks;
+   unsigned int free_blks;
+   unsigned int free_inodes;
+} fs_super_t;
+
+
+/*
+ * Allocation groups
+ * - the blocks and the inodes are split in NUM_GROUPS groups, each with
+ *   its (byte aligned) slice of the bitmaps, free counters and lock, so
+ *   that allocations in different groups do not contend
+ * - a file is placed in the group of its directory and its blocks in the
+ *   group of its inode; a new directory goes to the group of the thread
+ *   creating it, so parallel writers fill different groups
+ */
+
+#define NUM_GROUPS 8
+
+#define GROUP_INODES (ITAB_SIZE / NUM_GROUPS)
+
+#define INODE_GROUP(id) ((id) / GROUP_INODES)
+
+typedef struct fs_group {
+   pthread_mutex_t lock;
+   unsigned first_blk;   // the group has blocks [first_blk, end_blk[
+   unsigned end_blk;
+   unsigned free_blks;
+   unsigned free_inodes;
+   unsigned next_blk;   // block where the next search starts
+   unsigned long alloc_gen;   // block allocations and frees so far
+   unsigned long scrub_gen;   // alloc_gen seen by the last fs_scrub
+   unsigned scrub_next;   // block where the next fs_scrub starts
+} fs_group_t;
+
 struct fs_ {
+   pthread_rwlock_t lock;   // see 'File system lock' below
+   pthread_mutex_t inode_locks [ITAB_SIZE];
+   pthread_mutex_t store_lock;   // serializes fsi_store_fsdata
+   unsigned long gens [ITAB_SIZE];   // see 'Generations' below
    blocks_t* blocks;
    char inode_bmap [BLOCK_SIZE];
    char blk_bmap [BLOCK_SIZE];
    fs_inode_t inode_tab [ITAB_SIZE];
+   unsigned char blk_refs [REFS_NUM_BLKS*BLOCK_SIZE];
+   int refs_dirty;   // reference counts changed since last stored
+   char blk_discard [BLOCK_SIZE];
+   int discard_dirty;   // discard bitmap changed since last stored
+   fs_super_t super;
+   unsigned group_blks;   // blocks per allocation group
+   fs_group_t groups [NUM_GROUPS];
+   unsigned short dir_links [ITAB_SIZE][ITAB_SIZE];   // see fsi_file_linked
+   unsigned short dir_free [ITAB_SIZE];   // free slots of each directory
 };
 
 #define NOT_FS_INITIALIZER  1
+
+
+/*
+ * File system lock
+ * - the operations changing the namespace (directories, links, inodes
+ *   taken or freed) and fs_copy take the lock alone
+ * - the other operations share it; those on the contents or the size of
+ *   a file also hold the lock of its inode, so that calls on different
+ *   files (reads, writes, fallocate, truncate) run in parallel
+ * - the allocation groups keep their own locks, taken under these ones:
+ *   the bitmaps, the block reference counts and the discard bitmap only
+ *   change under the lock of their group (fs_scrub included)
+ * - the usage of the directories is updated atomically (fsi_du_add), as
+ *   writers to different files of a directory share the lock
+ * - FS_RDLOCK/FS_WRLOCK/FS_FILELOCK hold the locks until the end of the
+ *   enclosing block (a function); fs_read_map/fs_write_map keep the ones
+ *   of the file when they succeed, and FS_FILEHELD in fs_read_done/
+ *   fs_write_done releases them, so that the storage ranges handed out
+ *   cannot be freed or reused while the data is copied
+ * - order: file system lock, inode lock, group lock, store lock
+ */
+
+static pthread_rwlock_t* fsi_lock(fs_t* fs, int write)
+{
+   if (write) {
+      pthread_rwlock_wrlock(&fs->lock);
+   } else {
+      pthread_rwlock_rdlock(&fs->lock);
+   }
+   return &fs->lock;
+}
+
+static void fsi_unlock(pthread_rwlock_t** lock)
+{
+   pthread_rwlock_unlock(*lock);
+}
+
+#define FS_RDLOCK(fs) pthread_rwlock_t* fs_lock_held __attribute__((unused)) \
+   __attribute__((cleanup(fsi_unlock))) = fsi_lock(fs, 0)
+#define FS_WRLOCK(fs) pthread_rwlock_t* fs_lock_held __attribute__((unused)) \
+   __attribute__((cleanup(fsi_unlock))) = fsi_lock(fs, 1)
+
+typedef struct {
+   fs_t* fs;
+   inodeid_t file;
+} fsi_held_t;
+
+static fsi_held_t fsi_lock_file(fs_t* fs, inodeid_t file)
+{
+   pthread_rwlock_rdlock(&fs->lock);
+   pthread_mutex_lock(&fs->inode_locks[file]);
+   return (fsi_held_t){fs, file};
+}
+
+static void fsi_unlock_file(fsi_held_t* held)
+{
+   if (held->fs == NULL) {
+      return;   // kept by a mapping
+   }
+   pthread_mutex_unlock(&held->fs->inode_locks[held->file]);
+   pthread_rwlock_unlock(&held->fs->lock);
+}
+
+#define FS_FILELOCK(fs, file) fsi_held_t fs_lock_held __attribute__((unused)) \
+   __attribute__((cleanup(fsi_unlock_file))) = fsi_lock_file(fs, file)
+#define FS_FILEHELD(fs, file) fsi_held_t fs_lock_held __attribute__((unused)) \
+   __attribute__((cleanup(fsi_unlock_file))) = (fsi_held_t){fs, file}
+#define FS_FILEKEEP() (fs_lock_held.fs = NULL)
+
+
+/*
+ * Generations (kept in memory only)
+ * - gens[i] changes with every change of the attributes of inode i (its
+ *   size, its links, the entries of a directory) and when it is reused
+ * - gens[0] (inode 0 is never used) changes when a directory is moved or
+ *   removed, i.e. when a pathname may lead to another directory
+ */
+
+static void fsi_touch(fs_t* fs, inodeid_t id)
+{
+   __atomic_add_fetch(&fs->gens[id], 1, __ATOMIC_RELAXED);
+}
+
                                
 /*
  * Internal functions for loading/storing file system metadata do the blocks
@@ -98,13 +274,38 @@ static void fsi_load_fsdata(fs_t* fs)
    for (int i = 0; i < ITAB_NUM_BLKS; i++) {
       block_read(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
    }
+
+   // load block reference counts from blocks 10-17
+   for (int i = 0; i < REFS_NUM_BLKS; i++) {
+      block_read(bks,i+2+ITAB_NUM_BLKS,(char*)&fs->blk_refs[i*BLOCK_SIZE]);
+   }
+   fs->refs_dirty = 0;
+
+   // load discard bitmap from block 18
+   block_read(bks,DISC_BLK,fs->blk_discard);
+   fs->discard_dirty = 0;
+
+   // load the free counts from block 19
+   char block[BLOCK_SIZE];
+   block_read(bks,SUPER_BLK,block);
+   memcpy(&fs->super,block,sizeof(fs->super));
 #define NOT_FS_INITIALIZER  1  //file system is already initialized, subsequent block acess will be delayed using a sleep function.
 }
 
 
+// the calls sharing the file system lock may change the metadata while it
+// is copied: each of them stores after its change, and the stores are
+// serialized, so the last store holds every change
 static void fsi_store_fsdata(fs_t* fs)
 {
    blocks_t* bks = fs->blocks;
+   STATS_BEGIN(t0);
+   pthread_mutex_lock(&fs->store_lock);
+   // a flag set again after here makes the next store write the blocks
+   int refs_dirty = __atomic_exchange_n(&fs->refs_dirty, 0, __ATOMIC_ACQUIRE);
+   int discard_dirty = __atomic_exchange_n(&fs->discard_dirty, 0, __ATOMIC_ACQUIRE);
+   PROBE1(meta__flush, 3 + ITAB_NUM_BLKS + (refs_dirty ? REFS_NUM_BLKS : 0) +
+      (discard_dirty != 0));
  
    // store free block bitmap to block 0
    block_write(bks,0,fs->blk_bmap);
@@ -116,6 +317,26 @@ static void fsi_store_fsdata(fs_t* fs)
    for (int i = 0; i < ITAB_NUM_BLKS; i++) {
       block_write(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
    }
+
+   // store block reference counts to blocks 10-17, only if changed
+   if (refs_dirty) {
+      for (int i = 0; i < REFS_NUM_BLKS; i++) {
+         block_write(bks,i+2+ITAB_NUM_BLKS,(char*)&fs->blk_refs[i*BLOCK_SIZE]);
+      }
+   }
+
+   // store discard bitmap to block 18, only if changed
+   if (discard_dirty) {
+      block_write(bks,DISC_BLK,fs->blk_discard);
+   }
+
+   // store the free counts to block 19
+   char block[BLOCK_SIZE];
+   memset(block,0,sizeof(block));
+   memcpy(block,&fs->super,sizeof(fs->super));
+   block_write(bks,SUPER_BLK,block);
+   pthread_mutex_unlock(&fs->store_lock);
+   STATS_END(STATS_STORE_FSDATA, t0);
 }
 
 
@@ -130,18 +351,244 @@ static void fsi_store_fsdata(fs_t* fs)
 #define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))
 
 
-static int fsi_bmap_find_free(char* bmap, int size, unsigned* free)
+// the group a thread puts its new directories in, handed round robin
+static __thread int fsi_home_group = -1;
+static unsigned fsi_groups_handed;
+
+static int fsi_thread_group(void)
+{
+   if (fsi_home_group < 0) {
+      fsi_home_group = __sync_fetch_and_add(&fsi_groups_handed,1) % NUM_GROUPS;
+   }
+   return fsi_home_group;
+}
+
+
+// recounts the free blocks and inodes of every group, and of the whole
+// file system, from the bitmaps
+static void fsi_groups_count(fs_t* fs)
+{
+   fs->super.num_blocks = block_num_blocks(fs->blocks);
+   fs->super.free_blks = fs->super.free_inodes = 0;
+   for (int g = 0; g < NUM_GROUPS; g++) {
+      fs_group_t* grp = &fs->groups[g];
+      pthread_mutex_lock(&grp->lock);
+      grp->free_blks = grp->free_inodes = 0;
+      for (unsigned b = grp->first_blk; b < grp->end_blk; b++) {
+         grp->free_blks += !BMAP_ISSET(fs->blk_bmap,b);
+      }
+      for (int i = g*GROUP_INODES; i < (g+1)*GROUP_INODES; i++) {
+         grp->free_inodes += !BMAP_ISSET(fs->inode_bmap,i);
+      }
+      fs->super.free_blks += grp->free_blks;
+      fs->super.free_inodes += grp->free_inodes;
+      pthread_mutex_unlock(&grp->lock);
+   }
+}
+
+
+// takes a free block, from group 'goal' if possible, else from the
+// following groups in turn
+static int fsi_block_alloc(fs_t* fs, int goal, unsigned* blk)
+{
+   int found = 0;
+
+   if (__atomic_load_n(&fs->super.free_blks, __ATOMIC_RELAXED) == 0) {
+      return 0;
+   }
+   STATS_BEGIN(t0);
+   for (int n = 0; n < NUM_GROUPS && !found; n++) {
+      fs_group_t* grp = &fs->groups[(goal + n) % NUM_GROUPS];
+      pthread_mutex_lock(&grp->lock);
+      if (grp->free_blks > 0) {
+         // search from the last allocation, wrapping around the group
+         unsigned b = grp->next_blk;
+         while (BMAP_ISSET(fs->blk_bmap,b)) {
+            b = (b + 1 < grp->end_blk) ? b + 1 : grp->first_blk;
+         }
+         BMAP_SET(fs->blk_bmap,b);
+         grp->free_blks--;
+         __sync_fetch_and_sub(&fs->super.free_blks,1);
+         grp->next_blk = (b + 1 < grp->end_blk) ? b + 1 : grp->first_blk;
+         grp->alloc_gen++;
+         *blk = b;
+         found = 1;
+         PROBE2(block__alloc, b, (goal + n) % NUM_GROUPS);
+      }
+      pthread_mutex_unlock(&grp->lock);
+   }
+   STATS_END(STATS_BLOCK_ALLOC, t0);
+   return found;
+}
+
+
+// allocates 'num' contiguous data blocks, the first one in '*blk', within
+// a group: from group 'goal' if possible, else from the following ones
+static int fsi_block_alloc_run(fs_t* fs, int goal, int num, unsigned* blk)
 {
-   for (int i = 0; i < size; i++) {
-      if (!BMAP_ISSET(bmap,i)) {
-         *free = i;
-         return 1;
+   if (__atomic_load_n(&fs->super.free_blks, __ATOMIC_RELAXED) < num) {
+      return 0;
+   }
+   for (int n = 0; n < NUM_GROUPS; n++) {
+      fs_group_t* grp = &fs->groups[(goal + n) % NUM_GROUPS];
+      int run = 0;
+      pthread_mutex_lock(&grp->lock);
+      for (unsigned i = grp->first_blk; i < grp->end_blk && grp->free_blks >= num; i++) {
+         run = BMAP_ISSET(fs->blk_bmap,i) ? 0 : run + 1;
+         if (run == num) {
+            *blk = i - num + 1;
+            for (unsigned j = *blk; j <= i; j++) {
+               BMAP_SET(fs->blk_bmap,j);
+            }
+            grp->free_blks -= num;
+            __sync_fetch_and_sub(&fs->super.free_blks,num);
+            grp->alloc_gen++;
+            pthread_mutex_unlock(&grp->lock);
+            PROBE2(block__alloc_run, *blk, num);
+            return 1;
+         }
       }
+      pthread_mutex_unlock(&grp->lock);
    }
    return 0;
 }
 
 
+// drops a reference to a data block, freeing it with the last one
+static void fsi_block_free(fs_t* fs, unsigned blk)
+{
+   fs_group_t* grp = &fs->groups[blk / fs->group_blks];
+
+   PROBE1(block__free, blk);
+   pthread_mutex_lock(&grp->lock);
+   if (fs->blk_refs[blk] > 0) {
+      // read without the group lock by fsi_block_unshare
+      __atomic_sub_fetch(&fs->blk_refs[blk], 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&fs->refs_dirty, 1, __ATOMIC_RELEASE);
+   } else {
+      // the contents are left as they are, to be zeroed when needed
+      BMAP_CLR(fs->blk_bmap,blk);
+      BMAP_SET(fs->blk_discard,blk);
+      __atomic_store_n(&fs->discard_dirty, 1, __ATOMIC_RELEASE);
+      grp->free_blks++;
+      __sync_fetch_and_add(&fs->super.free_blks,1);
+      grp->alloc_gen++;
+   }
+   pthread_mutex_unlock(&grp->lock);
+}
+
+
+// makes a newly allocated block read as zeros, writing it only if it
+// was freed without being zeroed
+static void fsi_block_zero(fs_t* fs, unsigned blk)
+{
+   fs_group_t* grp = &fs->groups[blk / fs->group_blks];
+
+   pthread_mutex_lock(&grp->lock);
+   if (BMAP_ISSET(fs->blk_discard,blk)) {
+      char null_block[BLOCK_SIZE];
+      memset(null_block,0,sizeof(null_block));
+      block_write(fs->blocks,blk,null_block);
+      BMAP_CLR(fs->blk_discard,blk);
+      __atomic_store_n(&fs->discard_dirty, 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&grp->lock);
+}
+
+
+// takes a free inode, from group 'goal' if possible, else from the
+// following groups in turn
+static int fsi_inode_alloc(fs_t* fs, int goal, unsigned* inode)
+{
+   int found = 0;
+
+   if (__atomic_load_n(&fs->super.free_inodes, __ATOMIC_RELAXED) == 0) {
+      return 0;
+   }
+   STATS_BEGIN(t0);
+   for (int n = 0; n < NUM_GROUPS && !found; n++) {
+      int g = (goal + n) % NUM_GROUPS;
+      fs_group_t* grp = &fs->groups[g];
+      pthread_mutex_lock(&grp->lock);
+      if (grp->free_inodes > 0) {
+         unsigned i = g*GROUP_INODES;
+         while (BMAP_ISSET(fs->inode_bmap,i)) {
+            i++;
+         }
+         BMAP_SET(fs->inode_bmap,i);
+         grp->free_inodes--;
+         __sync_fetch_and_sub(&fs->super.free_inodes,1);
+         *inode = i;
+         fsi_touch(fs, i);
+         found = 1;
+         PROBE2(inode__alloc, i, g);
+      }
+      pthread_mutex_unlock(&grp->lock);
+   }
+   STATS_END(STATS_INODE_ALLOC, t0);
+   return found;
+}
+
+
+// gives back an inode
+static void fsi_inode_free(fs_t* fs, inodeid_t inode)
+{
+   fs_group_t* grp = &fs->groups[INODE_GROUP(inode)];
+
+   PROBE1(inode__free, inode);
+   fsi_touch(fs, inode);
+   if (fs->inode_tab[inode].type == FS_DIR) {
+      fsi_touch(fs, 0);
+   }
+   pthread_mutex_lock(&grp->lock);
+   BMAP_CLR(fs->inode_bmap,inode);
+   grp->free_inodes++;
+   __sync_fetch_and_add(&fs->super.free_inodes,1);
+   pthread_mutex_unlock(&grp->lock);
+}
+
+
+// makes '*blk' a block of its own, copying it if shared with other files
+// (the copy is taken from group 'goal' if possible)
+static int fsi_block_unshare(fs_t* fs, int goal, unsigned* blk)
+{
+   char block[BLOCK_SIZE];
+   unsigned nblk;
+
+   // if another file drops its reference meanwhile, the copy is just
+   // not needed: the old block is freed by fsi_block_free
+   if (__atomic_load_n(&fs->blk_refs[*blk], __ATOMIC_RELAXED) == 0) {
+      return 1;
+   }
+   if (!fsi_block_alloc(fs,goal,&nblk)) {
+      return 0;
+   }
+   block_read(fs->blocks,*blk,block);
+   block_write(fs->blocks,nblk,block);
+   // drop the reference under the group lock, as any other
+   fsi_block_free(fs,*blk);
+   *blk = nblk;
+   return 1;
+}
+
+
+// adds a reference to a data block, if it can still be shared
+static int fsi_block_share(fs_t* fs, unsigned blk)
+{
+   fs_group_t* grp = &fs->groups[blk / fs->group_blks];
+   int ok = 0;
+
+   pthread_mutex_lock(&grp->lock);
+   if (fs->blk_refs[blk] < UCHAR_MAX) {
+      fs->blk_refs[blk]++;
+      __atomic_store_n(&fs->refs_dirty, 1, __ATOMIC_RELEASE);
+      ok = 1;
+   }
+   pthread_mutex_unlock(&grp->lock);
+   return ok;
+}
+
+
 
 /*
  * Other internal file system macros and functions
@@ -164,171 +611,895 @@ static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
       inode->blocks[i] = 0;
    }
    
-   for (i = 0; i < RES_NUM_BLKS; i++) {
-	   inode->reserved[i] = 1;
+   // one link, no usage accounted yet
+   inode->reserved[0] = 1;
+   for (i = 1; i < RES_NUM_BLKS; i++) {
+	   inode->reserved[i] = 0;
+   }
+}
+
+
+// adds to the usage of directory 'dir' and of all the directories above it
+// (atomically: writes to different files of a directory share the file
+// system lock, and update the same directories)
+static void fsi_du_add(fs_t* fs, inodeid_t dir, int bytes, int files)
+{
+   while (dir != 0) {
+      fs_inode_t* idir = &fs->inode_tab[dir];
+      __atomic_add_fetch(&idir->reserved[DU_BYTES], bytes, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&idir->reserved[DU_FILES], files, __ATOMIC_RELAXED);
+      dir = idir->reserved[DU_PARENT];
+   }
+}
+
+
+// accounts an object moved from directory 'olddir' to 'newdir'
+static void fsi_du_move(fs_t* fs, inodeid_t id, inodeid_t olddir,
+   inodeid_t newdir)
+{
+   fs_inode_t* inode = &fs->inode_tab[id];
+
+   if (olddir == newdir) {
+      return;
    }
+   if (inode->type == FS_DIR) {
+      unsigned bytes = __atomic_load_n(&inode->reserved[DU_BYTES], __ATOMIC_RELAXED);
+      unsigned files = __atomic_load_n(&inode->reserved[DU_FILES], __ATOMIC_RELAXED);
+      fsi_du_add(fs, olddir, -bytes, -files);
+      fsi_du_add(fs, newdir, bytes, files);
+      inode->reserved[DU_PARENT] = newdir;
+   } else if (inode->reserved[DU_OWNER] == olddir) {
+      fsi_du_add(fs, olddir, -inode->size, -1);
+      fsi_du_add(fs, newdir, inode->size, 1);
+      inode->reserved[DU_OWNER] = newdir;
+   }
+}
+
+
+// changes the size of a file, accounting the difference
+static void fsi_file_resize(fs_t* fs, fs_inode_t* ifile, unsigned size)
+{
+   fsi_du_add(fs, ifile->reserved[DU_OWNER], (int)(size - ifile->size), 0);
+   ifile->size = size;
+   fsi_touch(fs, ifile - fs->inode_tab);
 }
 
 
-static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
-   inodeid_t* fileid)
+// searches 'dir' for the entry named by the first 'len' chars of 'file';
+// 'pos', if not NULL, gets the index of the entry in the directory
+static int fsi_dir_search(fs_t* fs, inodeid_t dir, const char* file, int len,
+   inodeid_t* fileid, int* pos)
 {
    fs_dentry_t page[DIR_PAGE_ENTRIES];
    fs_inode_t* idir = &fs->inode_tab[dir];
    int num = idir->size / sizeof(fs_dentry_t);
-   int iblock = 0;
+   int iblock = 0, res = -1;
 
-   while (num > 0) {
+   if (len >= FS_MAX_FNAME_SZ) {
+      return -1;
+   }
+
+   STATS_BEGIN(t0);
+   while (num > 0 && res != 0) {
       block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
       for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         if (strlen(file) == strlen(page[i].name) && strncmp(page[i].name,file,strlen(file)) == 0) {
+         if (page[i].inodeid != 0 && page[i].name[len] == '\0' &&
+               strncmp(page[i].name,file,len) == 0) {
             *fileid = page[i].inodeid;
-            return 0;
+            if (pos != NULL) {
+               *pos = (iblock - 1) * DIR_PAGE_ENTRIES + i;
+            }
+            res = 0;
+            break;
          }
       }
    }
-   return -1;
+   STATS_END(STATS_DIR_SEARCH, t0);
+   PROBE3(dir__search, dir, idir->size / sizeof(fs_dentry_t) - num, res == 0);
+   return res;
 }
 
 
-/*
- * File system interface functions
- */
-
-fs_t* fs_new(unsigned num_blocks)
+// removes the entry at index 'pos' of 'dir', leaving its slot free: the
+// other entries keep their places, so that a listing in progress
+// (fs_readdir_stream) misses none of them. The free slots at the end of
+// the directory are dropped, with the pages they leave empty.
+static void fsi_dir_remove(fs_t* fs, inodeid_t dir, int pos)
 {
-   fs_t* fs = (fs_t*) malloc(sizeof(fs_t));
-   fs->blocks = block_new(num_blocks,BLOCK_SIZE);
-   fsi_load_fsdata(fs);
-   return fs;
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   int num = idir->size / sizeof(fs_dentry_t);
+   int iblock = pos / DIR_PAGE_ENTRIES;
+
+   block_read(fs->blocks,idir->blocks[iblock],(char*)page);
+   memset(&page[pos % DIR_PAGE_ENTRIES], 0, sizeof(fs_dentry_t));
+   fs->dir_free[dir]++;
+   if (pos != num - 1) {
+      block_write(fs->blocks,idir->blocks[iblock],(char*)page);
+   }
+
+   // drop the free slots at the end (the last one was not written)
+   while (num > 0) {
+      int last = num - 1;
+      if (last / DIR_PAGE_ENTRIES != iblock) {
+         iblock = last / DIR_PAGE_ENTRIES;
+         block_read(fs->blocks,idir->blocks[iblock],(char*)page);
+      }
+      if (page[last % DIR_PAGE_ENTRIES].inodeid != 0) {
+         break;
+      }
+      num--;
+      fs->dir_free[dir]--;
+      if (num % DIR_PAGE_ENTRIES == 0) {
+         fsi_block_free(fs, idir->blocks[iblock]);
+         idir->blocks[iblock] = 0;
+      }
+   }
+   idir->size = num * sizeof(fs_dentry_t);
+   fsi_touch(fs, dir);
 }
 
-int fs_format(fs_t* fs)
+
+// adds the entry 'file' -> 'fileid' to 'dir', in its first free slot or
+// else at the end, growing the directory by a page if necessary
+static int fsi_dir_add(fs_t* fs, inodeid_t dir, const char* file,
+   inodeid_t fileid, fs_itype_t type)
 {
-   if (fs == NULL) {
-      printf("[fs] argument is null.\n");
-      return -1;
+   fs_inode_t* idir = &fs->inode_tab[dir];
+
+   if (fs->dir_free[dir] > 0) {
+      fs_dentry_t page[DIR_PAGE_ENTRIES];
+      int num = idir->size / sizeof(fs_dentry_t);
+      for (int i = 0; i < num; i++) {
+         if (i % DIR_PAGE_ENTRIES == 0) {
+            block_read(fs->blocks,idir->blocks[i/DIR_PAGE_ENTRIES],(char*)page);
+         }
+         fs_dentry_t* entry = &page[i % DIR_PAGE_ENTRIES];
+         if (entry->inodeid == 0) {
+            strcpy(entry->name, file);
+            entry->inodeid = fileid;
+            entry->type = type;
+            block_write(fs->blocks,idir->blocks[i/DIR_PAGE_ENTRIES],(char*)page);
+            fs->dir_free[dir]--;
+            fsi_touch(fs, dir);
+            return 0;
+         }
+      }
    }
 
-   // erase all blocks
-   char null_block[BLOCK_SIZE];
-   memset(null_block,0,sizeof(null_block));
-   for (int i = 0; i < block_num_blocks(fs->blocks); i++) {
-      block_write(fs->blocks,i,null_block);
+   // add a new block to the directory if necessary
+   if (idir->size % BLOCK_SIZE == 0) {
+      unsigned fblock;
+      if (idir->size / BLOCK_SIZE >= INODE_NUM_BLKS ||
+            !fsi_block_alloc(fs,INODE_GROUP(dir),&fblock)) {
+         return -1;
+      }
+      idir->blocks[idir->size / BLOCK_SIZE] = fblock;
    }
 
-   // reserve file system meta data blocks
-   BMAP_SET(fs->blk_bmap,0);
-   BMAP_SET(fs->blk_bmap,1);
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      BMAP_SET(fs->blk_bmap,i+2);
+   // add the entry to the directory
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
+   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
+   strcpy(entry->name, file);
+   entry->inodeid = fileid;
+   entry->type = type;
+   block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
+   idir->size += sizeof(fs_dentry_t);
+   fsi_touch(fs, dir);
+   return 0;
+}
+
+
+// rewrites the entry at index 'pos' of 'dir' (the name is kept if NULL)
+static void fsi_dir_set(fs_t* fs, inodeid_t dir, int pos, const char* file,
+   inodeid_t fileid, fs_itype_t type)
+{
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   int iblock = pos / DIR_PAGE_ENTRIES;
+
+   block_read(fs->blocks,idir->blocks[iblock],(char*)page);
+   fs_dentry_t* entry = &page[pos % DIR_PAGE_ENTRIES];
+   if (file != NULL) {
+      memset(entry->name, 0, FS_MAX_FNAME_SZ);
+      strcpy(entry->name, file);
    }
+   entry->inodeid = fileid;
+   entry->type = type;
+   block_write(fs->blocks,idir->blocks[iblock],(char*)page);
+   fsi_touch(fs, dir);
+}
 
-   // reserve inodes 0 (will never be used) and 1 (the root)
-   BMAP_SET(fs->inode_bmap,0);
-   BMAP_SET(fs->inode_bmap,1);
-   fsi_inode_init(&fs->inode_tab[1],FS_DIR);
 
-   // save the file system metadata
-   fsi_store_fsdata(fs);
-   return 0;
+// releases the blocks of a file from block index 'first' on
+static void fsi_file_release(fs_t* fs, fs_inode_t* ifile, int first)
+{
+	for (int i = first; i < INODE_NUM_BLKS; i++) {
+		if (ifile->blocks[i] != 0) {
+			fsi_block_free(fs, ifile->blocks[i]);
+			ifile->blocks[i] = 0;
+		}
+	}
 }
 
-int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+
+// counts 'n' more links to 'file' in directory 'dir': dir_links keeps, in
+// memory only, the links of each file per directory, so that the
+// directory a file is accounted in is replaced without reading any
+static void fsi_file_linked(fs_t* fs, inodeid_t dir, inodeid_t file, int n)
 {
+   fs->dir_links[file][dir] += n;
+}
 
-   if (!BMAP_ISSET(fs->inode_bmap,file)) {
-      dprintf("[fs_get_attrs] inode is not being used.\n");
-      return -1;
+
+// recounts the links of every file per directory, and the free slots of
+// each directory, from the directories
+static void fsi_links_count(fs_t* fs)
+{
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+
+   memset(fs->dir_links, 0, sizeof(fs->dir_links));
+   memset(fs->dir_free, 0, sizeof(fs->dir_free));
+   for (inodeid_t dir = 1; dir < ITAB_SIZE; dir++) {
+      fs_inode_t* idir = &fs->inode_tab[dir];
+      if (!BMAP_ISSET(fs->inode_bmap,dir) || idir->type != FS_DIR) {
+         continue;
+      }
+      int entries = idir->size / sizeof(fs_dentry_t);
+      for (int i = 0; i < entries; i++) {
+         if (i % DIR_PAGE_ENTRIES == 0) {
+            block_read(fs->blocks,idir->blocks[i/DIR_PAGE_ENTRIES],(char*)page);
+         }
+         if (page[i % DIR_PAGE_ENTRIES].inodeid == 0) {
+            fs->dir_free[dir]++;
+         } else if (page[i % DIR_PAGE_ENTRIES].type == FS_FILE) {
+            fsi_file_linked(fs, dir, page[i % DIR_PAGE_ENTRIES].inodeid, 1);
+         }
+      }
    }
+}
 
-   fs_inode_t* inode = &fs->inode_tab[file];
-   attrs->type = inode->type;  
-   attrs->size = inode->size;
-   switch (inode->type) {
-      case FS_DIR:
-         attrs->num_entries = inode->size / sizeof(fs_dentry_t);
-         attrs->links = 2;
-         break;
-      case FS_FILE:
-         attrs->num_entries = -1;
-         attrs->links = inode->reserved[0]; /*number of hard links of a file */
-         break;
-      default:
-         dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
-         exit(-1);
+
+// finds a directory holding a link to 'file', or 0 if there is none
+static inodeid_t fsi_file_holder(fs_t* fs, inodeid_t file)
+{
+   for (inodeid_t dir = 1; dir < ITAB_SIZE; dir++) {
+      if (fs->dir_links[file][dir] > 0) {
+         return dir;
+      }
    }
    return 0;
 }
 
 
-int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
+// drops the link of 'file' that was in directory 'dir' (the entry must be
+// gone already), freeing the file with the last link; returns 1 if freed
+static int fsi_file_drop(fs_t* fs, inodeid_t dir, inodeid_t file)
 {
+   fs_inode_t* ifile = &fs->inode_tab[file];
+
+   /*subtracts in the reseved array the number of hard links */
+   ifile->reserved[0] -= 1;
+   fsi_touch(fs, file);
+   fsi_file_linked(fs, dir, file, -1);
+
+   if (ifile->reserved[0] == 0) {
+      fsi_du_add(fs, ifile->reserved[DU_OWNER], -ifile->size, -1);
+      fsi_file_release(fs, ifile, 0);
+      fsi_inode_free(fs, file);
+      return 1;
+   }
 
-char *token;
-char line[MAX_PATH_NAME_SIZE]; 
-char *search = "/";
-int i=0;
-int dir=0;
-   if (fs==NULL || file==NULL ) {
-      dprintf("[fs_lookup] malformed arguments.\n");
-      return -1;
+   // the file is accounted in the directory of another link
+   if (ifile->reserved[DU_OWNER] == dir) {
+      fsi_du_move(fs, file, dir, fsi_file_holder(fs, file));
    }
+   return 0;
+}
 
 
-    if(file[0] != '/') {
-        dprintf("[fs_lookup] malformed pathname.\n");
-        return -1;
-    }
-	
-    strcpy(line,file);
-    token = strtok(line, search);
-    
-   while(token != NULL) {
-     i++;
-     if(i==1) dir=1;  //Root directory
-     
-     if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-	      dprintf("[fs_lookup] inode is not being used.\n");
-	      return -1;
-     }
-     fs_inode_t* idir = &fs->inode_tab[dir];
-     if (idir->type != FS_DIR) {
-        dprintf("[fs_lookup] inode is not a directory.\n");
-        return -1;
-     }
-     inodeid_t fid;
-     if (fsi_dir_search(fs,dir,token,&fid) < 0) {
-        dprintf("[fs_lookup] file '%s' does not exist.\n", file);
-        return 0;
-     }
-     *fileid = fid;
-     dir=fid;
-     token = strtok(NULL, search);
-   }
-
-   if (i==0) *fileid=1;
+static void fsi_file_unlink(fs_t* fs, inodeid_t dir, inodeid_t file)
+{
+   fs_inode_t* ifile = &fs->inode_tab[file];
 
-   return 1;
+   /* verifies if its the last link associated with the file */    
+   if (ifile->reserved[0] == 1 && LOG_ENABLED(LOG_DEBUG)) {
+      for (int i = 0; i < INODE_NUM_BLKS; i++) { 
+         if (ifile->blocks[i] != 0) {
+            log_debug("[fs_remove] Deallocating Block %d\n",ifile->blocks[i]);
+         }
+      }
+   }
+
+   if (fsi_file_drop(fs, dir, file)) {
+      log_debug("[fs_remove] Deallocating the file inode %d\n",file);
+   } else {
+      log_debug("[fs_remove] Links remaining. File wasn't removed\n");
+   }
 }
 
 
-int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
-   char* buffer, int* nread)
+// drops the entry of directory 'dir' pointing at 'id' from a subtree being
+// removed: files lose a link, directories release all their entries and
+// their pages (the entry itself is left in place)
+static void fsi_tree_release(fs_t* fs, inodeid_t dir, inodeid_t id)
 {
+   fs_inode_t* inode = &fs->inode_tab[id];
+
+   if (inode->type == FS_DIR) {
+      fs_dentry_t page[DIR_PAGE_ENTRIES];
+      int entries = inode->size / sizeof(fs_dentry_t);
+      for (int i = 0; i < entries; i++) {
+         if (i % DIR_PAGE_ENTRIES == 0) {
+            block_read(fs->blocks,inode->blocks[i/DIR_PAGE_ENTRIES],(char*)page);
+         }
+         if (page[i % DIR_PAGE_ENTRIES].inodeid != 0) {
+            fsi_tree_release(fs, id, page[i % DIR_PAGE_ENTRIES].inodeid);
+         }
+      }
+      fs->dir_free[id] = 0;
+      fsi_file_release(fs, inode, 0);
+      fsi_inode_init(inode, FS_DIR);
+      fsi_inode_free(fs, id);
+      return;
+   }
+
+   fsi_file_drop(fs, dir, id);
+}
+
+
+// makes every block of [offset, offset+count[ a block of the file's own:
+// holes get a new block and shared blocks are copied; 'fresh' gets a bit
+// set for each new block (with undefined contents). Either all blocks are
+// reserved or none is.
+static int fsi_file_reserve(fs_t* fs, fs_inode_t* ifile, unsigned offset,
+   unsigned count, unsigned* fresh)
+{
+	int first = offset/BLOCK_SIZE;
+	int last = OFFSET_TO_BLOCKS(offset+count);
+	int goal = INODE_GROUP(ifile - fs->inode_tab);
+
+	log_debug("[fs_write] count=%d, offset=%d, fsize=%d, blocks %d-%d\n",
+		count,offset,ifile->size,first,last-1);
+
+	*fresh = 0;
+	if (last > INODE_NUM_BLKS) {
+		log_warn("[fs_write] no free block entries in inode.\n");
+		return -1;
+	}
+
+	// give up early if the file system cannot hold the new blocks
+	unsigned needed = 0;
+	for (int i = first; i < last; i++) {
+		needed += (ifile->blocks[i] == 0 ||
+			__atomic_load_n(&fs->blk_refs[ifile->blocks[i]], __ATOMIC_RELAXED) > 0);
+	}
+	if (needed > __atomic_load_n(&fs->super.free_blks, __ATOMIC_RELAXED)) {
+		log_warn("[fs_write] there are no free blocks.\n");
+		return -1;
+	}
+
+	for (int i = first; i < last; i++) {
+		unsigned *blk = &ifile->blocks[i];
+		int ok;
+		if (*blk == 0) {
+			ok = fsi_block_alloc(fs,goal,blk);
+			*fresh |= ok << i;
+		} else {
+			ok = fsi_block_unshare(fs,goal,blk);
+		}
+		if (!ok) {
+			log_warn("[fs_write] there are no free blocks.\n");
+			// give back the blocks just allocated
+			for (int j = first; j < i; j++) {
+				if (*fresh & (1 << j)) {
+					fsi_block_free(fs, ifile->blocks[j]);
+					ifile->blocks[j] = 0;
+				}
+			}
+			*fresh = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+// gets the storage ranges of [offset, offset+count[ (within the blocks
+// of the first 'end' bytes of the file); fails on holes, which have no
+// storage
+static int fsi_file_map(fs_t* fs, fs_inode_t* ifile, unsigned end,
+   unsigned offset, unsigned count, fs_extent_t* ext, int maxext, int* numext)
+{
+	int pos = 0, n = 0;
+	int iblock = offset/BLOCK_SIZE;
+	int blks_used = OFFSET_TO_BLOCKS(end);
+
+	while (pos < count && iblock < blks_used) {
+		off_t bpos;
+		int fd = -1;
+		if (ifile->blocks[iblock] != 0) {
+			fd = block_fd(fs->blocks, ifile->blocks[iblock], &bpos);
+		}
+		if (fd < 0) {
+			return -1;
+		}
+		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
+		int num = MIN(BLOCK_SIZE - start, count - pos);
+		bpos += start;
+
+		// merge with the previous range if contiguous in the storage
+		if (n > 0 && ext[n-1].fd == fd && ext[n-1].pos + ext[n-1].size == bpos) {
+			ext[n-1].size += num;
+		} else if (n < maxext) {
+			ext[n].fd = fd;
+			ext[n].pos = bpos;
+			ext[n].size = num;
+			n++;
+		} else {
+			break;
+		}
+
+		pos += num;
+		iblock++;
+	}
+	*numext = n;
+	return pos;
+}
+
+
+// counts the I/O of [offset, offset+count[ moved through the mapped
+// ranges, that the storage does not see
+static void fsi_file_account(fs_t* fs, fs_inode_t* ifile, unsigned offset,
+   unsigned count, int write)
+{
+	for (unsigned pos = offset; pos < offset + count; ) {
+		int i = pos/BLOCK_SIZE;
+		unsigned num = MIN((i+1)*BLOCK_SIZE, offset+count) - pos;
+		if (i < INODE_NUM_BLKS && ifile->blocks[i] != 0) {
+			block_account(fs->blocks, ifile->blocks[i], num, write);
+		}
+		pos += num;
+	}
+}
+
+
+static void fsi_get_attrs(fs_t* fs, inodeid_t id, fs_file_attrs_t* attrs)
+{
+   fs_inode_t* inode = &fs->inode_tab[id];
+
+   attrs->type = inode->type;  
+   attrs->size = inode->size;
+   switch (inode->type) {
+      case FS_DIR:
+         attrs->num_entries = inode->size / sizeof(fs_dentry_t) - fs->dir_free[id];
+         attrs->links = 2;
+         break;
+      case FS_FILE:
+         attrs->num_entries = -1;
+         attrs->links = inode->reserved[0]; /*number of hard links of a file */
+         break;
+      default:
+         log_error("[fs_get_attrs] fatal error - invalid inode.\n");
+         exit(-1);
+   }
+}
+
+
+/*
+ * File system interface functions
+ */
+
+// the return probes of the fs_* functions (see probes.h)
+PROBE_FS_RETURN(fs_new)
+PROBE_FS_RETURN(fs_format)
+PROBE_FS_RETURN(fs_scrub)
+PROBE_FS_RETURN(fs_du)
+PROBE_FS_RETURN(fs_statfs)
+PROBE_FS_RETURN(fs_file_extents)
+PROBE_FS_RETURN(fs_free_runs)
+PROBE_FS_RETURN(fs_blocks)
+PROBE_FS_RETURN(fs_generation)
+PROBE_FS_RETURN(fs_get_attrs)
+PROBE_FS_RETURN(fs_resolve)
+PROBE_FS_RETURN(fs_lookup)
+PROBE_FS_RETURN(fs_read)
+PROBE_FS_RETURN(fs_write)
+PROBE_FS_RETURN(fs_read_map)
+PROBE_FS_RETURN(fs_read_done)
+PROBE_FS_RETURN(fs_write_map)
+PROBE_FS_RETURN(fs_write_done)
+PROBE_FS_RETURN(fs_fallocate)
+PROBE_FS_RETURN(fs_copy)
+PROBE_FS_RETURN(fs_create)
+PROBE_FS_RETURN(fs_create_many)
+PROBE_FS_RETURN(fs_remove)
+PROBE_FS_RETURN(fs_rename)
+PROBE_FS_RETURN(fs_mkdir)
+PROBE_FS_RETURN(fs_readdir)
+PROBE_FS_RETURN(fs_readdir_stream)
+PROBE_FS_RETURN(fs_readdirplus)
+PROBE_FS_RETURN(fs_truncate)
+PROBE_FS_RETURN(fs_rmdir)
+PROBE_FS_RETURN(fs_rmtree)
+PROBE_FS_RETURN(fs_link)
+
+fs_t* fs_new(unsigned num_blocks)
+{
+   PROBE_FS(fs_new, 0, 0, num_blocks);
+   fs_t* fs = (fs_t*) malloc(sizeof(fs_t));
+   pthread_rwlock_init(&fs->lock,NULL);
+   for (int i = 0; i < ITAB_SIZE; i++) {
+      pthread_mutex_init(&fs->inode_locks[i],NULL);
+   }
+   pthread_mutex_init(&fs->store_lock,NULL);
+   memset(fs->gens,0,sizeof(fs->gens));
+   fs->blocks = block_new(num_blocks,BLOCK_SIZE);
+   block_layout(fs->blocks, META_NUM_BLKS);
+   stats_amp_layout(META_NUM_BLKS);
+
+   // split the blocks in groups, of a multiple of 8 blocks each
+   unsigned num = block_num_blocks(fs->blocks);
+   fs->group_blks = ((num + NUM_GROUPS - 1) / NUM_GROUPS + 7) / 8 * 8;
+   for (int g = 0; g < NUM_GROUPS; g++) {
+      fs_group_t* grp = &fs->groups[g];
+      pthread_mutex_init(&grp->lock,NULL);
+      grp->first_blk = MIN(g * fs->group_blks, num);
+      grp->end_blk = MIN(grp->first_blk + fs->group_blks, num);
+      grp->next_blk = grp->scrub_next = grp->first_blk;
+      grp->alloc_gen = grp->scrub_gen = 0;
+   }
+
+   fsi_load_fsdata(fs);
+   fsi_groups_count(fs);
+   fsi_links_count(fs);
+   return fs;
+}
+
+int fs_format(fs_t* fs)
+{
+   PROBE_FS(fs_format, 0, 0, 0);
+   if (fs == NULL) {
+      log_warn("[fs] argument is null.\n");
+      return -1;
+   }
+   FS_WRLOCK(fs);
+
+   // erase all blocks
+   char null_block[BLOCK_SIZE];
+   memset(null_block,0,sizeof(null_block));
+   for (int i = 0; i < block_num_blocks(fs->blocks); i++) {
+      block_write(fs->blocks,i,null_block);
+   }
+   fsi_load_fsdata(fs);
+
+   // reserve file system meta data blocks
+   for (int i = 0; i < META_NUM_BLKS; i++) {
+      BMAP_SET(fs->blk_bmap,i);
+   }
+
+   // reserve inodes 0 (will never be used) and 1 (the root)
+   BMAP_SET(fs->inode_bmap,0);
+   BMAP_SET(fs->inode_bmap,1);
+   fsi_inode_init(&fs->inode_tab[1],FS_DIR);
+   fsi_groups_count(fs);
+   fsi_links_count(fs);
+   for (int i = 0; i < ITAB_SIZE; i++) {
+      fsi_touch(fs, i);
+   }
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+int fs_scrub(fs_t* fs, int maxblocks)
+{
+   PROBE_FS(fs_scrub, 0, 0, maxblocks);
+   if (fs == NULL || maxblocks <= 0) {
+      log_warn("[fs_scrub] malformed arguments.\n");
+      return -1;
+   }
+
+   // the file system is not idle if any operation holds its lock
+   if (pthread_rwlock_trywrlock(&fs->lock) != 0) {
+      return 0;
+   }
+
+   char null_block[BLOCK_SIZE];
+   memset(null_block,0,sizeof(null_block));
+   int zeroed = 0;
+   for (int g = 0; g < NUM_GROUPS && zeroed < maxblocks; g++) {
+      fs_group_t* grp = &fs->groups[g];
+      pthread_mutex_lock(&grp->lock);
+
+      // only scrub if nothing was allocated or freed since the last call
+      if (grp->alloc_gen != grp->scrub_gen) {
+         grp->scrub_gen = grp->alloc_gen;
+         pthread_mutex_unlock(&grp->lock);
+         continue;
+      }
+
+      for (unsigned n = grp->first_blk; n < grp->end_blk && zeroed < maxblocks; n++) {
+         unsigned blk = grp->scrub_next;
+         grp->scrub_next = (blk + 1 < grp->end_blk) ? blk + 1 : grp->first_blk;
+         if (!BMAP_ISSET(fs->blk_bmap,blk) && BMAP_ISSET(fs->blk_discard,blk)) {
+            block_write(fs->blocks,blk,null_block);
+            BMAP_CLR(fs->blk_discard,blk);
+            __atomic_store_n(&fs->discard_dirty, 1, __ATOMIC_RELEASE);
+            zeroed++;
+         }
+      }
+      pthread_mutex_unlock(&grp->lock);
+   }
+   pthread_rwlock_unlock(&fs->lock);
+   // the cleared bits are stored with the next metadata update; until then
+   // the blocks are only zeroed again if reused
+   return zeroed;
+}
+
+
+int fs_du(fs_t* fs, inodeid_t file, unsigned* bytes, unsigned* files)
+{
+   PROBE_FS(fs_du, file, 0, 0);
+   if (fs == NULL || file >= ITAB_SIZE || bytes == NULL || files == NULL) {
+      log_warn("[fs_du] malformed arguments.\n");
+      return -1;
+   }
+   FS_FILELOCK(fs, file);
+
+   if (!BMAP_ISSET(fs->inode_bmap,file)) {
+      log_warn("[fs_du] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* inode = &fs->inode_tab[file];
+   if (inode->type == FS_DIR) {
+      *bytes = __atomic_load_n(&inode->reserved[DU_BYTES], __ATOMIC_RELAXED);
+      *files = __atomic_load_n(&inode->reserved[DU_FILES], __ATOMIC_RELAXED);
+   } else {
+      *bytes = inode->size;
+      *files = 1;
+   }
+   return 0;
+}
+
+
+int fs_statfs(fs_t* fs, fs_stats_t* stats)
+{
+   PROBE_FS(fs_statfs, 0, 0, 0);
+   if (fs == NULL || stats == NULL) {
+      log_warn("[fs_statfs] malformed arguments.\n");
+      return -1;
+   }
+   FS_RDLOCK(fs);
+
+   stats->block_size = BLOCK_SIZE;
+   stats->num_blocks = fs->super.num_blocks;
+   stats->free_blocks = __atomic_load_n(&fs->super.free_blks, __ATOMIC_RELAXED);
+   stats->num_inodes = ITAB_SIZE;
+   stats->free_inodes = __atomic_load_n(&fs->super.free_inodes, __ATOMIC_RELAXED);
+   return 0;
+}
+
+
+int fs_file_extents(fs_t* fs, inodeid_t file)
+{
+   PROBE_FS(fs_file_extents, file, 0, 0);
+   if (fs == NULL || file >= ITAB_SIZE) {
+      log_warn("[fs_file_extents] malformed arguments.\n");
+      return -1;
+   }
+   FS_FILELOCK(fs, file);
+
+   if (!BMAP_ISSET(fs->inode_bmap,file)) {
+      log_warn("[fs_file_extents] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* inode = &fs->inode_tab[file];
+   int extents = 0;
+   for (int i = 0; i < INODE_NUM_BLKS; i++) {
+      unsigned blk = inode->blocks[i];
+      if (blk != 0 && (i == 0 || blk != inode->blocks[i-1] + 1)) {
+         extents++;
+      }
+   }
+   return extents;
+}
+
+
+int fs_free_runs(fs_t* fs, unsigned* hist, int nbuckets)
+{
+   PROBE_FS(fs_free_runs, 0, 0, nbuckets);
+   if (fs == NULL || hist == NULL || nbuckets <= 0) {
+      log_warn("[fs_free_runs] malformed arguments.\n");
+      return -1;
+   }
+   FS_RDLOCK(fs);
+
+   // hold every group (in order) to see the bitmap as a whole
+   for (int g = 0; g < NUM_GROUPS; g++) {
+      pthread_mutex_lock(&fs->groups[g].lock);
+   }
+
+   int runs = 0;
+   unsigned len = 0, num_blocks = block_num_blocks(fs->blocks);
+   memset(hist, 0, nbuckets * sizeof(unsigned));
+   for (unsigned blk = META_NUM_BLKS; blk <= num_blocks; blk++) {
+      if (blk < num_blocks && !BMAP_ISSET(fs->blk_bmap,blk)) {
+         len++;
+         continue;
+      }
+      if (len > 0) {
+         int bucket = 0;
+         while (bucket < nbuckets - 1 && (len >> (bucket + 1)) > 0) {
+            bucket++;
+         }
+         hist[bucket]++;
+         runs++;
+         len = 0;
+      }
+   }
+
+   for (int g = NUM_GROUPS - 1; g >= 0; g--) {
+      pthread_mutex_unlock(&fs->groups[g].lock);
+   }
+   return runs;
+}
+
+
+blocks_t* fs_blocks(fs_t* fs, unsigned* meta)
+{
+   PROBE_FS(fs_blocks, 0, 0, 0);
+   *meta = META_NUM_BLKS;
+   return fs->blocks;
+}
+
+
+unsigned long fs_generation(fs_t* fs, inodeid_t inode)
+{
+   PROBE_FS(fs_generation, inode, 0, 0);
+   return __atomic_load_n(&fs->gens[inode % ITAB_SIZE], __ATOMIC_RELAXED);
+}
+
+
+int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
+{
+   PROBE_FS(fs_get_attrs, file, 0, 0);
+   FS_FILELOCK(fs, file);
+
+   if (!BMAP_ISSET(fs->inode_bmap,file)) {
+      log_warn("[fs_get_attrs] inode is not being used.\n");
+      return -1;
+   }
+
+   fsi_get_attrs(fs, file, attrs);
+   return 0;
+}
+
+
+// the body of fs_resolve (which measures it)
+static int fsi_resolve(fs_t* fs, const char* path, inodeid_t* parent,
+   const char** leaf, inodeid_t* fileid)
+{
+   if (fs == NULL || path == NULL || parent == NULL || leaf == NULL ||
+      fileid == NULL) {
+      log_warn("[fs_resolve] malformed arguments.\n");
+      return -1;
+   }
+
+   if (path[0] != '/') {
+      log_warn("[fs_resolve] malformed pathname.\n");
+      return -1;
+   }
+
+   // the root directory
+   if (path[1] == '\0') {
+      *parent = 1;
+      *leaf = &path[1];
+      *fileid = 1;
+      return 0;
+   }
+
+   inodeid_t dir = 1;
+   const char* name = &path[1];
+
+   while (1) {
+      // delimit the current component in place
+      const char* end = name;
+      while (*end != '\0' && *end != '/') {
+         if (*end == ' ') {
+            return -1;
+         }
+         end++;
+      }
+      int len = end - name;
+      if (len == 0 || len >= FS_MAX_FNAME_SZ || end - path >= MAX_PATH_NAME_SIZE) {
+         return -1;
+      }
+
+      fs_inode_t* idir = &fs->inode_tab[dir];
+      if (idir->type != FS_DIR) {
+         log_warn("[fs_resolve] inode is not a directory.\n");
+         return -1;
+      }
+
+      inodeid_t fid;
+      int found = (fsi_dir_search(fs,dir,name,len,&fid,NULL) == 0);
+
+      // the last component: the parent directory is resolved
+      if (*end == '\0') {
+         *parent = dir;
+         *leaf = name;
+         *fileid = found ? fid : 0;
+         return 0;
+      }
+
+      if (!found) {
+         return -1;
+      }
+      dir = fid;
+      name = end + 1;
+   }
+}
+
+
+int fs_resolve(fs_t* fs, const char* path, inodeid_t* parent,
+   const char** leaf, inodeid_t* fileid)
+{
+   PROBE_FS(fs_resolve, 0, 0, 0);
+   FS_RDLOCK(fs);
+   STATS_BEGIN(t0);
+   int res = fsi_resolve(fs,path,parent,leaf,fileid);
+   STATS_END(STATS_FS_RESOLVE, t0);
+   return res;
+}
+
+
+int fs_lookup(fs_t* fs, const char* file, inodeid_t* fileid)
+{
+   PROBE_FS(fs_lookup, 0, 0, 0);
+   inodeid_t parent, fid;
+   const char* leaf;
+
+   if (fs==NULL || file==NULL || fileid==NULL) {
+      log_warn("[fs_lookup] malformed arguments.\n");
+      return -1;
+   }
+
+   STATS_BEGIN(t0);
+   int found = fs_resolve(fs,file,&parent,&leaf,&fid) == 0 && fid != 0;
+   STATS_END(STATS_FS_LOOKUP, t0);
+   if (!found) {
+      log_warn("[fs_lookup] file '%s' does not exist.\n", file);
+      return 0;
+   }
+
+   *fileid = fid;
+   return 1;
+}
+
+
+int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
+   char* buffer, int* nread)
+{
+	PROBE_FS(fs_read, file, offset, count);
 	if (fs==NULL || file >= ITAB_SIZE || buffer==NULL || nread==NULL) {
-		dprintf("[fs_read] malformed arguments.\n");
+		log_warn("[fs_read] malformed arguments.\n");
 		return -1;
 	}
+	FS_FILELOCK(fs, file);
 
 	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_read] inode is not being used.\n");
+		log_warn("[fs_read] inode is not being used.\n");
 		return -1;
 	}
 
 	fs_inode_t* ifile = &fs->inode_tab[file];
 	if (ifile->type != FS_FILE) {
-		dprintf("[fs_read] inode is not a file.\n");
+		log_warn("[fs_read] inode is not a file.\n");
 		return -1;
 	}
 
@@ -342,8 +1513,8 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 	int iblock = offset/BLOCK_SIZE;
 	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
 	int max = MIN(count,ifile->size-offset);
-	int tbl_pos;
-	unsigned int *blk;
+	int tbl_pos = 0;
+	unsigned int *blk = ifile->blocks;
 	char block[BLOCK_SIZE];
    
 	while (pos < max && iblock < blks_used) {
@@ -352,7 +1523,12 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 			tbl_pos = iblock;
 		}
 		
-		block_read(fs->blocks, blk[tbl_pos], block);
+		// holes read as zeros
+		if (blk[tbl_pos] == 0) {
+			memset(block, 0, BLOCK_SIZE);
+		} else {
+			block_read(fs->blocks, blk[tbl_pos], block);
+		}
 		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
 		int num = MIN(BLOCK_SIZE - start, max - pos);
 		memcpy(&buffer[pos],&block[start],num);
@@ -368,169 +1544,458 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer)
 {
+	PROBE_FS(fs_write, file, offset, count);
+	STATS_AMP(STATS_AMP_WRITE, count);
 	if (fs == NULL || file >= ITAB_SIZE || buffer == NULL) {
-		dprintf("[fs_write] malformed arguments.\n");
+		log_warn("[fs_write] malformed arguments.\n");
 		return -1;
 	}
+	FS_FILELOCK(fs, file);
 
 	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_write] inode is not being used.\n");
+		log_warn("[fs_write] inode is not being used.\n");
 		return -1;
 	}
 
 	fs_inode_t* ifile = &fs->inode_tab[file];
 	if (ifile->type != FS_FILE) {
-		dprintf("[fs_write] inode is not a file.\n");
+		log_warn("[fs_write] inode is not a file.\n");
 		return -1;
 	}
 
-	if (offset > ifile->size) {
-		offset = ifile->size;
+	// nothing to write: neither blocks nor the size change
+	if (count == 0) {
+		return 0;
 	}
 
-	unsigned *blk;
+	unsigned fresh;
+	if (fsi_file_reserve(fs, ifile, offset, count, &fresh) < 0) {
+		return -1;
+	}
+   
+	char block[BLOCK_SIZE];
+	int num = 0;
+	int iblock = offset/BLOCK_SIZE;
 
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-	int blks_req = MAX(OFFSET_TO_BLOCKS(offset+count),blks_used)-blks_used;
+   	// write block by block, reading a block only if partially written
+	while (num < count) {
+		unsigned blk = ifile->blocks[iblock];
+		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
+		int n = MIN(BLOCK_SIZE - start, count - num);
 
-	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
-		count,offset,ifile->size,blks_used,blks_req);
-	
-	if (blks_req > 0) {
-		if(blks_req > INODE_NUM_BLKS-blks_used) {
-			dprintf("[fs_write] no free block entries in inode.\n");
-			return -1;
+		if (fresh & (1 << iblock)) {
+			// contents past the end of file are kept zeroed
+			memset(block, 0, BLOCK_SIZE);
+		} else if (n < BLOCK_SIZE) {
+			block_read(fs->blocks, blk, block);
 		}
+		memcpy(&block[start], &buffer[num], n);
+		block_write(fs->blocks, blk, block);
+
+		num += n;
+		iblock++;
+	}
+
+	if (num != count) {
+		log_error("[fs_write] severe error: num=%d != count=%d!\n", num, count);
+		exit(-1);
+	}
+
+	// new blocks the loop did not write must not show old contents
+	for (int i = iblock; i < OFFSET_TO_BLOCKS(offset+count); i++) {
+		if (fresh & (1 << i)) {
+			fsi_block_zero(fs, ifile->blocks[i]);
+		}
+	}
+
+	fsi_file_resize(fs, ifile, MAX(offset + count, ifile->size));
+
+   	// update the inode in disk
+	fsi_store_fsdata(fs);
+
+	log_debug("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
+	return 0;
+}
+
+
+int fs_read_map(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   fs_extent_t* ext, int maxext, int* numext, int* nread)
+{
+	PROBE_FS(fs_read_map, file, offset, count);
+	if (fs == NULL || file >= ITAB_SIZE || ext == NULL || maxext <= 0 ||
+		numext == NULL || nread == NULL) {
+		log_warn("[fs_read_map] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILELOCK(fs, file);
 
-		dprintf("[fs_write] required %d blocks, used %d\n", blks_req, blks_used);
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		log_warn("[fs_read_map] inode is not being used.\n");
+		return -1;
+	}
 
-      		// check and reserve if there are free blocks
-		for (int i = blks_used; i < blks_used + blks_req; i++) {
+	fs_inode_t* ifile = &fs->inode_tab[file];
+	if (ifile->type != FS_FILE) {
+		log_warn("[fs_read_map] inode is not a file.\n");
+		return -1;
+	}
 
-			if(i < INODE_NUM_BLKS)
-				blk = &ifile->blocks[i];
-	 
-			if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),blk)) { // ITAB_SIZE
-				dprintf("[fs_write] there are no free blocks.\n");
-				return -1;
+	if (offset >= ifile->size) {
+		*numext = 0;
+		*nread = 0;
+		FS_FILEKEEP();
+		return 0;
+	}
+
+	int max = MIN(count,ifile->size-offset);
+	int pos = fsi_file_map(fs, ifile, ifile->size, offset, max, ext, maxext,
+		numext);
+	if (pos < 0) {
+		return -1;
+	}
+	fsi_file_account(fs, ifile, offset, pos, 0);
+	*nread = pos;
+	// the ranges stay valid until fs_read_done
+	FS_FILEKEEP();
+	return 0;
+}
+
+
+int fs_read_done(fs_t* fs, inodeid_t file)
+{
+	PROBE_FS(fs_read_done, file, 0, 0);
+	if (fs == NULL || file >= ITAB_SIZE) {
+		log_warn("[fs_read_done] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILEHELD(fs, file);
+	return 0;
+}
+
+
+int fs_write_map(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   fs_extent_t* ext, int maxext, int* numext)
+{
+	PROBE_FS(fs_write_map, file, offset, count);
+	STATS_AMP(STATS_AMP_WRITE, count);
+	off_t bpos;
+
+	if (fs == NULL || file >= ITAB_SIZE || ext == NULL || numext == NULL) {
+		log_warn("[fs_write_map] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILELOCK(fs, file);
+
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		log_warn("[fs_write_map] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = &fs->inode_tab[file];
+	if (ifile->type != FS_FILE) {
+		log_warn("[fs_write_map] inode is not a file.\n");
+		return -1;
+	}
+
+	// nothing to write: neither blocks nor the size change
+	if (count == 0) {
+		*numext = 0;
+		FS_FILEKEEP();
+		return 0;
+	}
+
+	// the ranges must fit in 'ext' and the storage must provide them
+	if (maxext < count / BLOCK_SIZE + 2 || block_fd(fs->blocks, 0, &bpos) < 0) {
+		log_warn("[fs_write_map] cannot map the write.\n");
+		return -1;
+	}
+
+	unsigned fresh;
+	if (fsi_file_reserve(fs, ifile, offset, count, &fresh) < 0) {
+		return -1;
+	}
+
+	// new blocks not entirely written keep zeros past the data
+	for (int i = offset/BLOCK_SIZE; i < OFFSET_TO_BLOCKS(offset+count); i++) {
+		if ((fresh & (1 << i)) && (i*BLOCK_SIZE < offset ||
+			(i+1)*BLOCK_SIZE > offset+count)) {
+			fsi_block_zero(fs, ifile->blocks[i]);
+		}
+	}
+
+	if (fsi_file_map(fs, ifile, offset + count, offset, count, ext, maxext,
+		numext) != count) {
+		log_error("[fs_write_map] severe error: write range not mapped!\n");
+		exit(-1);
+	}
+
+	// the ranges stay valid until fs_write_done, which stores the
+	// metadata (the new blocks with the size) once
+	FS_FILEKEEP();
+	return 0;
+}
+
+
+int fs_write_done(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   unsigned written)
+{
+	PROBE_FS(fs_write_done, file, offset, written);
+	STATS_AMP_MORE(STATS_AMP_WRITE);
+	if (fs == NULL || file >= ITAB_SIZE) {
+		log_warn("[fs_write_done] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILEHELD(fs, file);
+
+	if (written > count) {
+		log_warn("[fs_write_done] malformed arguments.\n");
+		return -1;
+	}
+
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		log_warn("[fs_write_done] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = &fs->inode_tab[file];
+	if (ifile->type != FS_FILE) {
+		log_warn("[fs_write_done] inode is not a file.\n");
+		return -1;
+	}
+
+	// bytes past the end of file the copy did not reach are kept zeroed
+	unsigned from = MAX(offset + written, ifile->size);
+	char block[BLOCK_SIZE];
+	for (int i = from/BLOCK_SIZE; i < OFFSET_TO_BLOCKS(offset+count); i++) {
+		unsigned start = MAX(from, i*BLOCK_SIZE) - i*BLOCK_SIZE;
+		unsigned end = MIN(offset+count, (i+1)*BLOCK_SIZE) - i*BLOCK_SIZE;
+		if (i >= INODE_NUM_BLKS || ifile->blocks[i] == 0 || start >= end) {
+			continue;
+		}
+		block_read(fs->blocks, ifile->blocks[i], block);
+		memset(&block[start], 0, end - start);
+		block_write(fs->blocks, ifile->blocks[i], block);
+	}
+
+	fsi_file_account(fs, ifile, offset, written, 1);
+	fsi_file_resize(fs, ifile, MAX(offset + written, ifile->size));
+
+   	// update the block maps and the inode in disk
+	fsi_store_fsdata(fs);
+	return 0;
+}
+
+
+int fs_fallocate(fs_t* fs, inodeid_t file, int mode, unsigned offset,
+   unsigned len)
+{
+	PROBE_FS(fs_fallocate, file, offset, len);
+	STATS_AMP(STATS_AMP_FALLOCATE, 0);
+	if (fs == NULL || file >= ITAB_SIZE || len == 0 ||
+		(mode & ~(FS_FALLOC_KEEP_SIZE | FS_FALLOC_PUNCH_HOLE)) != 0) {
+		log_warn("[fs_fallocate] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILELOCK(fs, file);
+
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		log_warn("[fs_fallocate] inode is not being used.\n");
+		return -1;
+	}
+
+	fs_inode_t* ifile = &fs->inode_tab[file];
+	if (ifile->type != FS_FILE) {
+		log_warn("[fs_fallocate] inode is not a file.\n");
+		return -1;
+	}
+
+	if (offset + len < offset) {
+		log_warn("[fs_fallocate] range past the largest file.\n");
+		return FS_ERR_FBIG;
+	}
+
+	int first = offset/BLOCK_SIZE;
+	int last = MIN(OFFSET_TO_BLOCKS(offset+len), INODE_NUM_BLKS);
+	char block[BLOCK_SIZE];
+
+	if (mode & FS_FALLOC_PUNCH_HOLE) {
+		// whole blocks in the range are released, the edges zeroed
+		for (int i = first; i < last; i++) {
+			unsigned *blk = &ifile->blocks[i];
+			unsigned start = MAX(offset, i*BLOCK_SIZE) - i*BLOCK_SIZE;
+			unsigned end = MIN(offset+len, (i+1)*BLOCK_SIZE) - i*BLOCK_SIZE;
+			if (*blk == 0) {
+				continue;
 			}
-			BMAP_SET(fs->blk_bmap, *blk);
-			dprintf("[fs_write] block %d allocated.\n", *blk);
+			if (start == 0 && end == BLOCK_SIZE) {
+				fsi_block_free(fs, *blk);
+				*blk = 0;
+				continue;
+			}
+			if (!fsi_block_unshare(fs, INODE_GROUP(file), blk)) {
+				log_warn("[fs_fallocate] there are no free blocks.\n");
+				fsi_store_fsdata(fs);
+				return FS_ERR_NOSPC;
+			}
+			block_read(fs->blocks, *blk, block);
+			memset(&block[start], 0, end - start);
+			block_write(fs->blocks, *blk, block);
+		}
+		fsi_store_fsdata(fs);
+		return 0;
+	}
+
+	if (OFFSET_TO_BLOCKS(offset+len) > INODE_NUM_BLKS) {
+		log_warn("[fs_fallocate] no free block entries in inode.\n");
+		return FS_ERR_FBIG;
+	}
+
+	// allocate the holes of the range, contiguously if possible
+	int holes = 0;
+	for (int i = first; i < last; i++) {
+		holes += (ifile->blocks[i] == 0);
+	}
+	if (holes > __atomic_load_n(&fs->super.free_blks, __ATOMIC_RELAXED)) {
+		log_warn("[fs_fallocate] there are no free blocks.\n");
+		return FS_ERR_NOSPC;
+	}
+	unsigned run = 0;
+	int contiguous = (holes > 0 &&
+		fsi_block_alloc_run(fs, INODE_GROUP(file), holes, &run));
+
+	for (int i = first; i < last; i++) {
+		unsigned *blk = &ifile->blocks[i];
+		if (*blk != 0) {
+			continue;
+		}
+		if (contiguous) {
+			*blk = run++;
+		} else if (!fsi_block_alloc(fs, INODE_GROUP(file), blk)) {
+			log_warn("[fs_fallocate] there are no free blocks.\n");
+			fsi_store_fsdata(fs);
+			return FS_ERR_NOSPC;
 		}
+		// preallocated blocks read as zeros
+		fsi_block_zero(fs, *blk);
+	}
+
+	if (!(mode & FS_FALLOC_KEEP_SIZE)) {
+		fsi_file_resize(fs, ifile, MAX(offset + len, ifile->size));
+	}
+
+   	// update the inode in disk
+	fsi_store_fsdata(fs);
+	return 0;
+}
+
+
+int fs_copy(fs_t* fs, inodeid_t src, inodeid_t dst, int flags)
+{
+	PROBE_FS(fs_copy, dst, 0, src);
+	STATS_AMP(STATS_AMP_COPY, 0);
+	if (fs == NULL || src >= ITAB_SIZE || dst >= ITAB_SIZE || src == dst) {
+		log_warn("[fs_copy] malformed arguments.\n");
+		return -1;
 	}
-   
-	char block[BLOCK_SIZE];
-	int num = 0, pos;
-	int iblock = offset/BLOCK_SIZE;
+	FS_WRLOCK(fs);
 
-   	// write within the existent blocks
-	while (num < count && iblock < blks_used) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-      
-		block_read(fs->blocks, blk[pos], block);
+	if (!BMAP_ISSET(fs->inode_bmap,src) || !BMAP_ISSET(fs->inode_bmap,dst)) {
+		log_warn("[fs_copy] inode is not being used.\n");
+		return -1;
+	}
 
-		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
-		for (int i = start; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
-		block_write(fs->blocks, blk[pos], block);
-		iblock++;
+	fs_inode_t* isrc = &fs->inode_tab[src];
+	fs_inode_t* idst = &fs->inode_tab[dst];
+	if (isrc->type != FS_FILE || idst->type != FS_FILE) {
+		log_warn("[fs_copy] inode is not a file.\n");
+		return -1;
 	}
 
-	dprintf("[fs_write] written %d bytes within.\n", num);
+	// drop the former contents of the destination
+	fsi_file_release(fs, idst, 0);
+	fsi_file_resize(fs, idst, 0);
 
-  	// write within the allocated blocks
-	while (num < count && iblock < blks_used + blks_req) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
+	// share the blocks of the source, or copy them (holes stay holes)
+	char block[BLOCK_SIZE];
+	int blks_used = OFFSET_TO_BLOCKS(isrc->size);
+	for (int i = 0; i < blks_used; i++) {
+		unsigned blk = isrc->blocks[i];
+		if (blk == 0) {
+			continue;
 		}
-      
-		for (int i = 0; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
+		if ((flags & FS_COPY_REFLINK) && fsi_block_share(fs, blk)) {
+			idst->blocks[i] = blk;
+			continue;
 		}
 
-		block_write(fs->blocks, blk[pos], block);
-		iblock++;
-	}
-
-	if (num != count) {
-		printf("[fs_write] severe error: num=%d != count=%d!\n", num, count);
-		exit(-1);
+		if (!fsi_block_alloc(fs,INODE_GROUP(dst),&idst->blocks[i])) {
+			log_warn("[fs_copy] there are no free blocks.\n");
+			idst->blocks[i] = 0;
+			fsi_file_resize(fs, idst, i * BLOCK_SIZE);
+			fsi_store_fsdata(fs);
+			return -1;
+		}
+		block_read(fs->blocks, blk, block);
+		block_write(fs->blocks, idst->blocks[i], block);
 	}
-
-	ifile->size = MAX(offset + count, ifile->size);
+	fsi_file_resize(fs, idst, isrc->size);
 
    	// update the inode in disk
 	fsi_store_fsdata(fs);
-
-	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
 	return 0;
 }
 
 
-int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
+int fs_create(fs_t* fs, inodeid_t dir, const char* file, inodeid_t* fileid)
 {
+   PROBE_FS(fs_create, dir, 0, 0);
+   STATS_AMP(STATS_AMP_CREATE, 0);
    if (fs == NULL || dir >= ITAB_SIZE || file == NULL || fileid == NULL) {
-      printf("[fs_create] malformed arguments.\n");
+      log_warn("[fs_create] malformed arguments.\n");
       return -1;
    }
+   FS_WRLOCK(fs);
 
    if (strlen(file) == 0 || strlen(file)+1 > FS_MAX_FNAME_SZ){
-      dprintf("[fs_create] file name size error.\n");
+      log_warn("[fs_create] file name size error.\n");
       return -1;
    }
 
    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_create] inode is not being used.\n");
+      log_warn("[fs_create] inode is not being used.\n");
       return -1;
    }
 
    fs_inode_t* idir = &fs->inode_tab[dir];
    if (idir->type != FS_DIR) {
-      dprintf("[fs_create] inode is not a directory.\n");
+      log_warn("[fs_create] inode is not a directory.\n");
       return -1;
    }
 
-   if (fsi_dir_search(fs,dir,file,fileid) == 0) {
-      dprintf("[fs_create] file already exists.\n");
+   if (fsi_dir_search(fs,dir,file,strlen(file),fileid,NULL) == 0) {
+      log_warn("[fs_create] file already exists.\n");
       return -1;
    }
    
-   // check if there are free inodes
+   // reserve an inode near the directory
    unsigned finode;
-   if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-      dprintf("[fs_create] there are no free inodes.\n");
+   if (!fsi_inode_alloc(fs,INODE_GROUP(dir),&finode)) {
+      log_warn("[fs_create] there are no free inodes.\n");
       return -1;
    }
 
-   // add a new block to the directory if necessary
-   if (idir->size % BLOCK_SIZE == 0) {
-      unsigned fblock;
-      if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-         dprintf("[fs_create] no free blocks to augment directory.\n");
-         return -1;
-      }
-      BMAP_SET(fs->blk_bmap,fblock);
-      idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-   }
-
    // add the entry to the directory
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-   strcpy(entry->name, file);
-   entry->inodeid = finode;
-   block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   idir->size += sizeof(fs_dentry_t);
-
+   if (fsi_dir_add(fs,dir,file,finode,FS_FILE) < 0) {
+      log_warn("[fs_create] no free blocks to augment directory.\n");
+      fsi_inode_free(fs,finode);
+      return -1;
+   }
 
-   // reserve and init the new file inode
-   BMAP_SET(fs->inode_bmap,finode);
+   // init the new file inode, accounted in the directory
    fsi_inode_init(&fs->inode_tab[finode],FS_FILE);
+   fs->inode_tab[finode].reserved[DU_OWNER] = dir;
+   fsi_file_linked(fs, dir, finode, 1);
+   fsi_du_add(fs,dir,0,1);
 
    // save the file system metadata
    fsi_store_fsdata(fs);
@@ -540,152 +2005,314 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
 }
 
 
- int fs_remove(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
- {
-    if (fs == NULL || dir >= ITAB_SIZE || file == NULL ) {
-      printf("[fs_remove] malformed arguments.\n");
+int fs_create_many(fs_t* fs, inodeid_t dir, const char** files, int count,
+   inodeid_t* fileids)
+{
+   PROBE_FS(fs_create_many, dir, 0, count);
+   STATS_AMP(STATS_AMP_CREATE, 0);
+   if (fs == NULL || dir >= ITAB_SIZE || files == NULL || fileids == NULL ||
+         count < 0) {
+      log_warn("[fs_create_many] malformed arguments.\n");
       return -1;
-    }
-   
-    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_remove] inode is not being used.\n");
+   }
+   FS_WRLOCK(fs);
+
+   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+      log_warn("[fs_create_many] inode is not being used.\n");
       return -1;
-    }
+   }
+
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   if (idir->type != FS_DIR) {
+      log_warn("[fs_create_many] inode is not a directory.\n");
+      return -1;
+   }
+
+   // pick the names that can be created: valid, new and not repeated
+   int accepted = 0;
+   for (int i = 0; i < count; i++) {
+      inodeid_t id;
+      fileids[i] = 0;
+      if (files[i] == NULL || strlen(files[i]) == 0 ||
+            strlen(files[i])+1 > FS_MAX_FNAME_SZ) {
+         log_warn("[fs_create_many] file name size error.\n");
+         continue;
+      }
+      if (fsi_dir_search(fs,dir,files[i],strlen(files[i]),&id,NULL) == 0) {
+         log_warn("[fs_create_many] file '%s' already exists.\n", files[i]);
+         continue;
+      }
+      int j;
+      for (j = 0; j < i && (fileids[j] == 0 || strcmp(files[j],files[i])); j++);
+      if (j < i) {
+         log_warn("[fs_create_many] file '%s' repeated.\n", files[i]);
+         continue;
+      }
+      fileids[i] = 1;  // placeholder until an inode is assigned
+      accepted++;
+   }
+
+   // take the inodes near the directory
+   for (int i = 0; i < count; i++) {
+      unsigned finode;
+      if (fileids[i] == 0) {
+         continue;
+      }
+      if (!fsi_inode_alloc(fs,INODE_GROUP(dir),&finode)) {
+         log_warn("[fs_create_many] there are no free inodes.\n");
+         fileids[i] = 0;
+         accepted--;
+         continue;
+      }
+      fsi_inode_init(&fs->inode_tab[finode],FS_FILE);
+      fs->inode_tab[finode].reserved[DU_OWNER] = dir;
+      fileids[i] = finode;
+   }
+
+   // fill the directory a page at a time
+   int created = 0, i = 0;
+   while (created < accepted) {
+      unsigned iblock = idir->size / BLOCK_SIZE;
+      fs_dentry_t page[DIR_PAGE_ENTRIES];
+      if (idir->size % BLOCK_SIZE == 0) {
+         if (iblock >= INODE_NUM_BLKS ||
+               !fsi_block_alloc(fs,INODE_GROUP(dir),&idir->blocks[iblock])) {
+            log_warn("[fs_create_many] no free blocks to augment directory.\n");
+            break;
+         }
+         memset(page,0,sizeof(page));
+      } else {
+         block_read(fs->blocks,idir->blocks[iblock],(char*)page);
+      }
+      unsigned slot = idir->size % BLOCK_SIZE / sizeof(fs_dentry_t);
+      for (; slot < DIR_PAGE_ENTRIES && created < accepted; i++) {
+         if (fileids[i] == 0) {
+            continue;
+         }
+         strcpy(page[slot].name, files[i]);
+         page[slot].inodeid = fileids[i];
+         page[slot].type = FS_FILE;
+         fsi_file_linked(fs, dir, fileids[i], 1);
+         idir->size += sizeof(fs_dentry_t);
+         slot++;
+         created++;
+      }
+      block_write(fs->blocks,idir->blocks[iblock],(char*)page);
+      fsi_touch(fs, dir);
+   }
+
+   // give back the inodes that did not fit in the directory
+   for (; i < count; i++) {
+      if (fileids[i] != 0) {
+         fsi_inode_free(fs,fileids[i]);
+         fileids[i] = 0;
+      }
+   }
 
+   // save the file system metadata once for the whole batch
+   fsi_du_add(fs,dir,0,created);
+   fsi_store_fsdata(fs);
+   return created;
+}
+
+
+int fs_remove(fs_t* fs, inodeid_t dir, const char* file, inodeid_t* fileid)
+{
+   PROBE_FS(fs_remove, dir, 0, 0);
+   STATS_AMP(STATS_AMP_REMOVE, 0);
+   if (fs == NULL || dir >= ITAB_SIZE || file == NULL || fileid == NULL) {
+      log_warn("[fs_remove] malformed arguments.\n");
+      return -1;
+   }
+   FS_WRLOCK(fs);
+   
+   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+      log_warn("[fs_remove] inode is not being used.\n");
+      return -1;
+   }
 
-    if (strlen(file) == 0 || strlen(file)+1 > FS_MAX_FNAME_SZ){
-      dprintf("[fs_remove] file name size error.\n");
+   if (strlen(file) == 0 || strlen(file)+1 > FS_MAX_FNAME_SZ){
+      log_warn("[fs_remove] file name size error.\n");
       return -1;
-    }
+   }
 
    fs_inode_t* idir = &fs->inode_tab[dir];
+   if (idir->type != FS_DIR) {
+      log_warn("[fs_remove] inode is not a directory.\n");
+      return -1;
+   }
 
-   // fill in the entries with the directory content
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   fs_dentry_t updt_page[DIR_PAGE_ENTRIES];
-   int num = idir->size / sizeof(fs_dentry_t);
-   int iblock = 0, ientry = 0;
-   //to check the file entry   
-   int fdentry= 0; 
-   while (num > 0) {
-      block_read(fs->blocks,idir->blocks[iblock],(char*)page); 
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-    if (strcmp(page[i].name,file)!=0) {  //strcmp substituiu strncmp
-       strcpy(updt_page[ientry].name, page[i].name);
-       updt_page[ientry].inodeid = page[i].inodeid;
-       ientry++;
-       }
-     else{
-       //file entry exists
-                          fdentry = 1;
-        //acede ao i-node fo ficheiro: page[i].inodeid
-              inodeid_t ind = page[i].inodeid;
-              *fileid = ind;                     
-        fs_inode_t* ifile = &fs->inode_tab[ind];
-
-            /*subtracts in the reseved array the number of hard links */
-            ifile->reserved[0] -= 1;
-
-         /* verifies if its the last link associated with the file */    
-          if (ifile->reserved[0] == 0) {
- 
-         unsigned *blk;
-         int blks_used = OFFSET_TO_BLOCKS(ifile->size);            
-         // verifica os blocos usados
-         for( int i = 0; i< blks_used; i++){ 
-          blk = &ifile->blocks[i];
-          BMAP_CLR(fs->blk_bmap, *blk);         
-          printf("[fs_remove] Deallocating Block %d\n",*blk);
+   int pos;
+   inodeid_t ind;
+   if (fsi_dir_search(fs,dir,file,strlen(file),&ind,&pos) < 0) {
+      log_warn("[fs_remove] file does not exist.\n");
+      return -1;
+   }
+
+   fs_inode_t* ifile = &fs->inode_tab[ind];
+   if (ifile->type != FS_FILE) {
+      log_warn("[fs_remove] inode is not a file.\n");
+      return -1;
+   }
+   *fileid = ind;
+
+   // move the last entry of the directory into the removed one
+   fsi_dir_remove(fs, dir, pos);
+
+   fsi_file_unlink(fs, dir, ind);
+
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_rename(fs_t* fs, inodeid_t olddir, const char* oldname,
+   inodeid_t newdir, const char* newname)
+{
+   PROBE_FS(fs_rename, olddir, 0, newdir);
+   STATS_AMP(STATS_AMP_RENAME, 0);
+   if (fs == NULL || olddir >= ITAB_SIZE || newdir >= ITAB_SIZE ||
+      oldname == NULL || newname == NULL) {
+      log_warn("[fs_rename] malformed arguments.\n");
+      return -1;
+   }
+   FS_WRLOCK(fs);
+
+   if (strlen(newname) == 0 || strlen(newname)+1 > FS_MAX_FNAME_SZ) {
+      log_warn("[fs_rename] file name size error.\n");
+      return -1;
+   }
+
+   if (!BMAP_ISSET(fs->inode_bmap,olddir) || !BMAP_ISSET(fs->inode_bmap,newdir)) {
+      log_warn("[fs_rename] inode is not being used.\n");
+      return -1;
+   }
+
+   if (fs->inode_tab[olddir].type != FS_DIR || fs->inode_tab[newdir].type != FS_DIR) {
+      log_warn("[fs_rename] inode is not a directory.\n");
+      return -1;
+   }
+
+   int pos, tpos;
+   inodeid_t ind, target;
+   if (fsi_dir_search(fs,olddir,oldname,strlen(oldname),&ind,&pos) < 0) {
+      log_warn("[fs_rename] file does not exist.\n");
+      return -1;
+   }
+   fs_inode_t* inode = &fs->inode_tab[ind];
+
+   // a directory cannot be moved below itself: it would leave the tree
+   if (inode->type == FS_DIR) {
+      for (inodeid_t d = newdir; d != 0; d = fs->inode_tab[d].reserved[DU_PARENT]) {
+         if (d == ind) {
+            log_warn("[fs_rename] cannot move a directory into itself.\n");
+            return -1;
          }
-        
-         BMAP_CLR(fs->inode_bmap, ind);
-        printf("[fs_remove] Deallocating the file inode %d\n",ind);
+      }
+   }
 
-        }else   printf("[fs_remove] Links remaining. File wasn't removed\n");                          
-     }
-     
+   if (fsi_dir_search(fs,newdir,newname,strlen(newname),&target,&tpos) == 0) {
+      // both names are links to the same file: nothing to do
+      if (target == ind) {
+         return 0;
       }
-    /* reescreve o conteúdo da directoria, sem o entry do ficheiro removido, no respectivo bloco 
-     * Considera-se que apenas um bloco contém a lista de ficheiros da directoria, se forem mais é preciso fazer o
-     * processamento adequado.
-     */
 
-        block_write(fs->blocks,idir->blocks[iblock],(char*)updt_page); 
-        iblock++;
+      fs_inode_t* itarget = &fs->inode_tab[target];
+      if (itarget->type != inode->type) {
+         log_warn("[fs_rename] cannot replace an object of another type.\n");
+         return -1;
+      }
+      if (itarget->type == FS_DIR && itarget->size > 0) {
+         log_warn("[fs_rename] cannot replace directory: not empty.\n");
+         return -1;
+      }
 
+      // the entry of the target now refers to the object
+      fsi_dir_set(fs, newdir, tpos, NULL, ind, inode->type);
+      fsi_dir_remove(fs, olddir, pos);
+      fsi_du_move(fs, ind, olddir, newdir);
+
+      // and the target loses that name
+      if (itarget->type == FS_FILE) {
+         fsi_file_unlink(fs, newdir, target);
+      } else {
+         fsi_inode_init(itarget, FS_DIR);
+         fsi_inode_free(fs, target);
+      }
+   } else if (olddir == newdir) {
+      // just rename the entry in place
+      fsi_dir_set(fs, olddir, pos, newname, ind, inode->type);
+   } else {
+      // move the entry to the other directory
+      if (fsi_dir_add(fs,newdir,newname,ind,inode->type) < 0) {
+         log_warn("[fs_rename] no free blocks to augment directory.\n");
+         return -1;
+      }
+      fsi_dir_remove(fs, olddir, pos);
+      fsi_du_move(fs, ind, olddir, newdir);
    }
-    if (fdentry) {
-     //actualiza o size do inode 
-     idir->size-=sizeof(fs_dentry_t);
-     
-     // save the file system metadata
-     fsi_store_fsdata(fs);
-
-       return 0;
+   if (inode->type == FS_DIR) {
+      fsi_touch(fs, 0);
+   } else {
+      fsi_file_linked(fs, olddir, ind, -1);
+      fsi_file_linked(fs, newdir, ind, 1);
    }
 
-   return -1;
- }
+   // save the file system metadata
+   fsi_store_fsdata(fs);
+   return 0;
+}
 
 
-int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
+int fs_mkdir(fs_t* fs, inodeid_t dir, const char* newdir, inodeid_t* newdirid)
 {
+	PROBE_FS(fs_mkdir, dir, 0, 0);
+	STATS_AMP(STATS_AMP_MKDIR, 0);
 	if (fs==NULL || dir>=ITAB_SIZE || newdir==NULL || newdirid==NULL) {
-		printf("[fs_mkdir] malformed arguments.\n");
+		log_warn("[fs_mkdir] malformed arguments.\n");
 		return -1;
 	}
+	FS_WRLOCK(fs);
 
 	if (strlen(newdir) == 0 || strlen(newdir)+1 > FS_MAX_FNAME_SZ){
-		dprintf("[fs_mkdir] directory size error.\n");
+		log_warn("[fs_mkdir] directory size error.\n");
 		return -1;
 	}
 
 	if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-		dprintf("[fs_mkdir] inode is not being used.\n");
+		log_warn("[fs_mkdir] inode is not being used.\n");
 		return -1;
 	}
 
 	fs_inode_t* idir = &fs->inode_tab[dir];
 	if (idir->type != FS_DIR) {
-		dprintf("[fs_mkdir] inode is not a directory.\n");
+		log_warn("[fs_mkdir] inode is not a directory.\n");
 		return -1;
 	}
 
-	if (fsi_dir_search(fs,dir,newdir,newdirid) == 0) {
-		dprintf("[fs_mkdir] directory already exists.\n");
+	if (fsi_dir_search(fs,dir,newdir,strlen(newdir),newdirid,NULL) == 0) {
+		log_warn("[fs_mkdir] directory already exists.\n");
 		return -1;
 	}
    
-   	// check if there are free inodes
+   	// reserve an inode in the group of this thread
 	unsigned finode;
-	if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-		dprintf("[fs_mkdir] there are no free inodes.\n");
+	if (!fsi_inode_alloc(fs,fsi_thread_group(),&finode)) {
+		log_warn("[fs_mkdir] there are no free inodes.\n");
 		return -1;
 	}
 
-   	// add a new block to the directory if necessary
-	if (idir->size % BLOCK_SIZE == 0) {
-		unsigned fblock;
-		if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-			dprintf("[fs_mkdir] no free blocks to augment directory.\n");
-			return -1;
-		}
-		BMAP_SET(fs->blk_bmap,fblock);
-		idir->blocks[idir->size / BLOCK_SIZE] = fblock;
+   	// add the entry to the directory
+	if (fsi_dir_add(fs,dir,newdir,finode,FS_DIR) < 0) {
+		log_warn("[fs_mkdir] no free blocks to augment directory.\n");
+		fsi_inode_free(fs,finode);
+		return -1;
 	}
 
-   	// add the entry to the directory
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-	block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-	strcpy(entry->name,newdir);
-	entry->inodeid = finode;
-	block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	idir->size += sizeof(fs_dentry_t);
-
-   	// reserve and init the new file inode
-	BMAP_SET(fs->inode_bmap,finode);
+   	// init the new file inode
 	fsi_inode_init(&fs->inode_tab[finode],FS_DIR);
+	fs->inode_tab[finode].reserved[DU_PARENT] = dir;
 
    	// save the file system metadata
 	fsi_store_fsdata(fs);
@@ -698,33 +2325,38 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
    int* numentries)
 {
+   PROBE_FS(fs_readdir, dir, 0, maxentries);
    if (fs == NULL || dir >= ITAB_SIZE || entries == NULL ||
       numentries == NULL || maxentries < 0) {
-      dprintf("[fs_readdir] malformed arguments.\n");
+      log_warn("[fs_readdir] malformed arguments.\n");
       return -1;
    }
+   FS_RDLOCK(fs);
 
    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_readdir] inode is not being used.\n");
+      log_warn("[fs_readdir] inode is not being used.\n");
       return -1;
    }
 
    fs_inode_t* idir = &fs->inode_tab[dir];
    if (idir->type != FS_DIR) {
-      dprintf("[fs_readdir] inode is not a directory.\n");
+      log_warn("[fs_readdir] inode is not a directory.\n");
       return -1;
    }
 
    // fill in the entries with the directory content
    fs_dentry_t page[DIR_PAGE_ENTRIES];
-   int num = MIN(idir->size / sizeof(fs_dentry_t), maxentries);
+   int num = idir->size / sizeof(fs_dentry_t);
    int iblock = 0, ientry = 0;
 
-   while (num > 0) {
+   while (num > 0 && ientry < maxentries) {
       block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
+      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0 && ientry < maxentries; i++, num--) {
+         if (page[i].inodeid == 0) {
+            continue;
+         }
          strcpy(entries[ientry].name, page[i].name);
-         entries[ientry].type = fs->inode_tab[page[i].inodeid].type;
+         entries[ientry].type = page[i].type;
          ientry++;
       }
    }
@@ -732,153 +2364,307 @@ int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
    return 0;
 }
 
-int fs_truncate(fs_t* fs, inodeid_t file)
+
+int fs_readdir_stream(fs_t* fs, inodeid_t dir, fs_dir_cursor_t* cursor,
+   fs_dir_filler_t filler, void* ctx)
+{
+   PROBE_FS(fs_readdir_stream, dir, 0, 0);
+   if (fs == NULL || dir >= ITAB_SIZE || cursor == NULL || filler == NULL ||
+      cursor->slot >= DIR_PAGE_ENTRIES) {
+      log_warn("[fs_readdir_stream] malformed arguments.\n");
+      return -1;
+   }
+   FS_RDLOCK(fs);
+
+   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+      log_warn("[fs_readdir_stream] inode is not being used.\n");
+      return -1;
+   }
+
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   if (idir->type != FS_DIR) {
+      log_warn("[fs_readdir_stream] inode is not a directory.\n");
+      return -1;
+   }
+
+   // hand out the entries from the cursor on, one page at a time
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   fs_file_entry_t entry;
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   unsigned index = cursor->iblock * DIR_PAGE_ENTRIES + cursor->slot;
+
+   while (index < num) {
+      block_read(fs->blocks,idir->blocks[cursor->iblock],(char*)page);
+      for (int i = cursor->slot; i < DIR_PAGE_ENTRIES && index < num; i++, index++) {
+         fs_dir_cursor_t next = {cursor->iblock, i + 1};
+         if (next.slot == DIR_PAGE_ENTRIES) {
+            next.iblock++;
+            next.slot = 0;
+         }
+         if (page[i].inodeid == 0) {
+            *cursor = next;
+            continue;
+         }
+
+         strcpy(entry.name, page[i].name);
+         entry.inodeid = page[i].inodeid;
+         // the files may be written meanwhile: read them under their lock
+         pthread_mutex_lock(&fs->inode_locks[entry.inodeid]);
+         entry.gen = __atomic_load_n(&fs->gens[entry.inodeid], __ATOMIC_RELAXED);
+         fsi_get_attrs(fs, entry.inodeid, &entry.attrs);
+         pthread_mutex_unlock(&fs->inode_locks[entry.inodeid]);
+         if (filler(ctx, &entry, &next) != 0) {
+            return 0;
+         }
+         *cursor = next;
+      }
+   }
+   return 0;
+}
+
+
+// fills the array of entries of fs_readdirplus
+typedef struct {
+   fs_file_entry_t* entries;
+   int maxentries;
+   int numentries;
+} fsi_readdir_array_t;
+
+static int fsi_readdir_fill(void* ctx, const fs_file_entry_t* entry,
+   const fs_dir_cursor_t* next)
+{
+   fsi_readdir_array_t* array = (fsi_readdir_array_t*) ctx;
+   if (array->numentries == array->maxentries) {
+      return 1;
+   }
+   array->entries[array->numentries++] = *entry;
+   return 0;
+}
+
+
+int fs_readdirplus(fs_t* fs, inodeid_t dir, fs_file_entry_t* entries,
+   int maxentries, int* numentries)
+{
+   PROBE_FS(fs_readdirplus, dir, 0, maxentries);
+   if (entries == NULL || numentries == NULL || maxentries < 0) {
+      log_warn("[fs_readdirplus] malformed arguments.\n");
+      return -1;
+   }
+
+   fs_dir_cursor_t cursor = {0, 0};
+   fsi_readdir_array_t array = {entries, maxentries, 0};
+   if (fs_readdir_stream(fs,dir,&cursor,fsi_readdir_fill,&array) != 0) {
+      return -1;
+   }
+   *numentries = array.numentries;
+   return 0;
+}
+
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size)
 {
+	PROBE_FS(fs_truncate, file, 0, size);
+	STATS_AMP(STATS_AMP_TRUNCATE, 0);
+	if (fs == NULL || file >= ITAB_SIZE) {
+		log_warn("[fs_truncate] malformed arguments.\n");
+		return -1;
+	}
+	FS_FILELOCK(fs, file);
+
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		log_warn("[fs_truncate] inode is not being used.\n");
+		return -1;
+	}
+
 	fs_inode_t* ifile = &fs->inode_tab[file];
 	if (ifile->type != FS_FILE) {
-		dprintf("[fs_write] inode is not a file.\n");
+		log_warn("[fs_truncate] inode is not a file.\n");
 		return -1;
 	}
 
-				     
-	unsigned *blk;
-	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-				    				   
-	// e verifica os blocos usados pelo file
-	for( int i = 0; i< blks_used; i++){ 
-		blk = &ifile->blocks[i];					
-		BMAP_CLR(fs->blk_bmap, *blk);						
+	if (OFFSET_TO_BLOCKS(size) > INODE_NUM_BLKS) {
+		log_warn("[fs_truncate] no free block entries in inode.\n");
+		return FS_ERR_FBIG;
+	}
+
+	if (size < ifile->size) {
+		// zero the rest of the new last block (read back if extended)
+		// first: it may need a copy, and nothing is lost if that fails
+		unsigned *blk = &ifile->blocks[size/BLOCK_SIZE];
+		if (size % BLOCK_SIZE != 0 && *blk != 0) {
+			char block[BLOCK_SIZE];
+			if (!fsi_block_unshare(fs, INODE_GROUP(file), blk)) {
+				log_warn("[fs_truncate] there are no free blocks.\n");
+				return FS_ERR_NOSPC;
+			}
+			block_read(fs->blocks, *blk, block);
+			memset(&block[size % BLOCK_SIZE], 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			block_write(fs->blocks, *blk, block);
+		}
+
+		// then release the blocks past the new end of file
+		fsi_file_release(fs, ifile, OFFSET_TO_BLOCKS(size));
 	}
 
-	ifile->size = 0;	
+	// extending leaves a hole: blocks are allocated when written
+	fsi_file_resize(fs, ifile, size);
+
+   	// update the inode in disk
+	fsi_store_fsdata(fs);
    	return 0;	
 }
 
 
-int fs_rmdir(fs_t* fs, inodeid_t dir, char* subdirname){
+int fs_rmdir(fs_t* fs, inodeid_t dir, const char* subdirname){
+   PROBE_FS(fs_rmdir, dir, 0, 0);
+   STATS_AMP(STATS_AMP_RMDIR, 0);
 
   if (fs == NULL || dir >= ITAB_SIZE || subdirname == NULL) {
-  printf("[fs_rmdir] malformed arguments.\n");
+  log_warn("[fs_rmdir] malformed arguments.\n");
   return -1;
   }
+  FS_WRLOCK(fs);
 
   if (strlen(subdirname) == 0 || strlen(subdirname)+1 > FS_MAX_FNAME_SZ){
-  dprintf("[fs_rmdir] file name size error.\n");
+  log_warn("[fs_rmdir] file name size error.\n");
   return -1;
   }
 
   if (!BMAP_ISSET(fs->inode_bmap, dir)) {
-  dprintf("[fs_rmdir] inode is not being used.\n");
+  log_warn("[fs_rmdir] inode is not being used.\n");
   return -1;
   }
 
 fs_inode_t* idir = &fs->inode_tab[dir];
 
   if(idir->type != FS_DIR) {
-  printf("[fs_rmdir] malformed argument: the given inodeID does not correspond to a directory.\n");
+  log_warn("[fs_rmdir] malformed argument: the given inodeID does not correspond to a directory.\n");
   return -1;
   }
 
- if(fsi_dir_search(fs, dir, subdirname, &dir) == -1){ // get the inode id of the inode to remove
-  printf("[fs_rmdir] malformed argument: the given file-name does not exist in the given directory.\n");
+ int pos;
+ inodeid_t subdir;
+ if(fsi_dir_search(fs, dir, subdirname, strlen(subdirname), &subdir, &pos) == -1){ // get the inode id of the inode to remove
+  log_warn("[fs_rmdir] malformed argument: the given file-name does not exist in the given directory.\n");
   return -1;
   }
 
-fs_inode_t* inode = &fs->inode_tab[dir];
+fs_inode_t* inode = &fs->inode_tab[subdir];
 
-  if(inode->type == FS_DIR){ // if it is a directory
-  // check if has files
-  if(inode->size > 0){
-  printf("[fs_rmdir] cannot remove directory: not empty.\n");
+  if(inode->type != FS_DIR){
+  log_warn("[fs_rmdir] malformed argument: the given file-name is not a directory.\n");
   return -1;
   }
-}
 
-  // go clear inode's associated blocks
-  char null_block[BLOCK_SIZE];
-  memset(null_block, 0, sizeof(null_block));
-  int i;
-  for(i=0; i < INODE_NUM_BLKS; i++) {
-  block_write(fs->blocks, inode->blocks[i], null_block);
-  if(inode->blocks[i] > 10)
-  BMAP_CLR(fs->blk_bmap, inode->blocks[i]);
+  // check if has files
+  if(inode->size > 0){
+  log_warn("[fs_rmdir] cannot remove directory: not empty.\n");
+  return -1;
   }
 
-// get the page entry
-  fs_dentry_t page[DIR_PAGE_ENTRIES];
-  fs_dentry_t* entry;
-  idir->size -= sizeof(fs_dentry_t);
-  // iterate through parent-directory associated entries to search for the inode entry
-  for(i=0; i < INODE_NUM_BLKS; i++){
-  block_read(fs->blocks, idir->blocks[i], (char*)page);
-  entry = &page[(idir->size % BLOCK_SIZE / sizeof(fs_dentry_t))];
-  if(!strcmp(entry->name, subdirname))
-  break;
-}
+  // release inode's associated blocks (an empty directory has none left)
+  fsi_file_release(fs, inode, 0);
 
-  // clean up the entry data
-  strcpy(entry->name, "");
-  entry->inodeid = 0; // clean up the inode
+  // move the last entry of the parent-directory into the removed one
+  fsi_dir_remove(fs, dir, pos);
 
-  // write the page and clean up the inode
-  block_write(fs->blocks, idir->blocks[i], (char*)page);
+  // clean up the inode
   fsi_inode_init(inode, FS_DIR); // reset the inode (the type can be ignored)
 
   // set the inode of the file as free
-  BMAP_CLR(fs->inode_bmap, dir);
+  fsi_inode_free(fs, subdir);
   // save the file system metadata
   fsi_store_fsdata(fs);
 
- 
-
 return 0;
 }
 
 	
 
-int fs_link(fs_t* fs, inodeid_t dir, char* filename, inodeid_t finode)
+int fs_rmtree(fs_t* fs, inodeid_t dir, const char* name)
 {
-   if (fs == NULL || dir >= ITAB_SIZE || filename == NULL || finode == 0) {
-      printf("[fs_link] malformed arguments.\n");
+   PROBE_FS(fs_rmtree, dir, 0, 0);
+   STATS_AMP(STATS_AMP_RMTREE, 0);
+   if (fs == NULL || dir >= ITAB_SIZE || name == NULL) {
+      log_warn("[fs_rmtree] malformed arguments.\n");
       return -1;
    }
+   FS_WRLOCK(fs);
 
-   if (strlen(filename) == 0 || strlen(filename)+1 > FS_MAX_FNAME_SZ){
-      dprintf("[fs_link] file name size error.\n");
+   if (strlen(name) == 0 || strlen(name)+1 > FS_MAX_FNAME_SZ) {
+      log_warn("[fs_rmtree] file name size error.\n");
       return -1;
    }
 
    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
-      dprintf("[fs_link] inode is not being used.\n");
+      log_warn("[fs_rmtree] inode is not being used.\n");
       return -1;
    }
-  
-  fs_inode_t* idir = &fs->inode_tab[dir];  
 
-  if (idir->size % BLOCK_SIZE == 0) {
-      unsigned fblock;
-      if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-         dprintf("[fs_link] no free blocks to augment directory.\n");
-         return -1;
-      }
-      BMAP_SET(fs->blk_bmap,fblock);
-      idir->blocks[idir->size / BLOCK_SIZE] = fblock;
+   if (fs->inode_tab[dir].type != FS_DIR) {
+      log_warn("[fs_rmtree] inode is not a directory.\n");
+      return -1;
    }
 
-   fs_inode_t* ifile = &fs->inode_tab[finode];
+   int pos;
+   inodeid_t fileid;
+   if (fsi_dir_search(fs,dir,name,strlen(name),&fileid,&pos) != 0) {
+      log_warn("[fs_rmtree] file does not exist.\n");
+      return -1;
+   }
+
+   // detach the subtree from the usage of the directories above it
+   fs_inode_t* inode = &fs->inode_tab[fileid];
+   fsi_dir_remove(fs, dir, pos);
+   if (inode->type == FS_DIR) {
+      fsi_du_add(fs, dir,
+         -__atomic_load_n(&inode->reserved[DU_BYTES], __ATOMIC_RELAXED),
+         -__atomic_load_n(&inode->reserved[DU_FILES], __ATOMIC_RELAXED));
+      inode->reserved[DU_PARENT] = 0;
+   }
+
+   // free the whole subtree; its directories are dropped, not rewritten
+   fsi_tree_release(fs, dir, fileid);
+
+   // save the file system metadata once for the whole subtree
+   fsi_store_fsdata(fs);
+   return 0;
+}
+
+
+int fs_link(fs_t* fs, inodeid_t dir, const char* filename, inodeid_t finode)
+{
+   PROBE_FS(fs_link, dir, 0, finode);
+   STATS_AMP(STATS_AMP_LINK, 0);
+   if (fs == NULL || dir >= ITAB_SIZE || filename == NULL || finode == 0) {
+      log_warn("[fs_link] malformed arguments.\n");
+      return -1;
+   }
+   FS_WRLOCK(fs);
+
+   if (strlen(filename) == 0 || strlen(filename)+1 > FS_MAX_FNAME_SZ){
+      log_warn("[fs_link] file name size error.\n");
+      return -1;
+   }
 
+   if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+      log_warn("[fs_link] inode is not being used.\n");
+      return -1;
+   }
   
+   fs_inode_t* ifile = &fs->inode_tab[finode];
+
    // add the entry to the directory
-   fs_dentry_t page[DIR_PAGE_ENTRIES];
-   block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-   strcpy(entry->name, filename);
-   entry->inodeid = finode;
-   block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   idir->size += sizeof(fs_dentry_t);
+   if (fsi_dir_add(fs,dir,filename,finode,ifile->type) < 0) {
+      log_warn("[fs_link] no free blocks to augment directory.\n");
+      return -1;
+   }
 
    /*add 1 to the reserved array when creating the hard link to the file */
    ifile->reserved[0] += 1;
+   fsi_touch(fs, finode);
+   if (ifile->type == FS_FILE) {
+      fsi_file_linked(fs, dir, finode, 1);
+   }
 
    // save the file system metadata
    fsi_store_fsdata(fs);
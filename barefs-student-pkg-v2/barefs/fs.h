@@ -8,6 +8,9 @@
  * 
  * Manages the internal organization of files and directories in a 'virtual
  * memory disk' and provides the following interface functions to programmers.
+ * The functions may be called from several threads: those changing the
+ * directories run alone, the others run together, one at a time per file
+ * for those on the contents of a file.
  * 
  */
 
@@ -40,8 +43,6 @@ typedef struct {
    short links;
 } fs_file_attrs_t;
 
-struct fuse_file_info *fi;
-
 // identify the name and the type of a file
 typedef struct {
    char name[FS_MAX_FNAME_SZ];
@@ -49,6 +50,51 @@ typedef struct {
 } fs_file_name_t;
 
 
+// identify the name, the inode and the attributes of a file
+typedef struct {
+   char name[FS_MAX_FNAME_SZ];
+   inodeid_t inodeid;
+   fs_file_attrs_t attrs;
+   unsigned long gen;   // fs_generation of the inode for these attributes
+} fs_file_entry_t;
+
+
+// position of a directory listing, from where it can be resumed
+typedef struct {
+   unsigned iblock;   // index of the directory page
+   unsigned slot;     // entry within the page
+} fs_dir_cursor_t;
+
+
+/*
+ * fs_dir_filler_t: receives an entry listed by fs_readdir_stream
+ * - ctx: the context given to fs_readdir_stream
+ * - entry: the entry with its attributes
+ * - next: the position following the entry
+ *   returns: 0 to go on listing, non-zero to stop before this entry
+ */
+typedef int (*fs_dir_filler_t)(void* ctx, const fs_file_entry_t* entry,
+   const fs_dir_cursor_t* next);
+
+
+// a contiguous range of file data as kept in the block storage
+typedef struct {
+   int fd;          // file descriptor of the storage
+   off_t pos;       // position of the range in 'fd'
+   unsigned size;   // size of the range in bytes
+} fs_extent_t;
+
+
+// space usage of the file system
+typedef struct {
+   unsigned block_size;
+   unsigned num_blocks;    // total blocks, metadata included
+   unsigned free_blocks;
+   unsigned num_inodes;
+   unsigned free_inodes;
+} fs_stats_t;
+
+
 // file system structure (the implementation is hidden)
 typedef struct fs_ fs_t;
 
@@ -69,14 +115,107 @@ fs_t* fs_new(unsigned num_blocks);
 int fs_format(fs_t* fs);
 
 
+/*
+ * fs_scrub: zeroes free blocks left with old contents when freed, so
+ * that reusing them needs no zeroing; meant to be called periodically,
+ * it skips the allocation groups where blocks were allocated or freed
+ * since the last call, and does nothing while other calls are running
+ * - fs: reference to file system
+ * - maxblocks: the maximum number of blocks to zero
+ *   returns: the number of blocks zeroed, -1 if the arguments are malformed
+ */
+int fs_scrub(fs_t* fs, int maxblocks);
+
+
+/*
+ * fs_resolve: resolves a pathname in a single pass, without copying it
+ * - fs: reference to file system
+ * - path: the absolute pathname of the object (file/directory)
+ * - parent: the inode id of the directory holding the object [out]
+ * - leaf: the name of the object, pointing into 'path' [out]
+ * - fileid: the inode id of the object, 0 if it does not exist [out]
+ *   returns: 0 if the parent directory exists, -1 if the pathname is
+ *   malformed or one of its directories does not exist
+ */
+int fs_resolve(fs_t* fs, const char* path, inodeid_t* parent,
+   const char** leaf, inodeid_t* fileid);
+
+
 /*
  * fs_lookup: gets the inode id of an object (file/directory)
  * - fs: reference to file system
  * - file: the name of the object
  * - fileid: the inode id of the object [out]
- *   returns: 0 if successful,  -1 otherwise
+ *   returns: 1 if found, 0 if not found, -1 if the arguments are malformed
+ */
+int fs_lookup(fs_t* fs, const char* file, inodeid_t* fileid);
+
+
+/*
+ * fs_du: gets the usage of a directory subtree, kept up to date by every
+ * change (no traversal involved); files linked several times count once
+ * - fs: reference to file system
+ * - file: node id of the directory (or of a file, for its own usage)
+ * - bytes: the total size of the files of the subtree [out]
+ * - files: the number of files of the subtree [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_du(fs_t* fs, inodeid_t file, unsigned* bytes, unsigned* files);
+
+
+/*
+ * fs_statfs: gets the space usage of the file system, from counters kept
+ * up to date by every allocation (no scan involved)
+ * - fs: reference to file system
+ * - stats: the space usage [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_statfs(fs_t* fs, fs_stats_t* stats);
+
+
+/*
+ * fs_file_extents: gets the number of extents of a file, i.e. of runs of
+ * blocks contiguous in the storage (holes split runs)
+ * - fs: reference to file system
+ * - file: node id of the file
+ *   returns: the number of extents, -1 if the arguments are malformed
  */
-int fs_lookup(fs_t* fs,  char* file, inodeid_t* fileid);
+int fs_file_extents(fs_t* fs, inodeid_t file);
+
+
+/*
+ * fs_free_runs: gets the histogram of the runs of free data blocks by
+ * length: bucket i counts the runs of 2^i to 2^(i+1)-1 blocks, the last
+ * bucket counting all the longer ones
+ * - fs: reference to file system
+ * - hist: the histogram [out]
+ * - nbuckets: the number of buckets of 'hist'
+ *   returns: the number of free runs, -1 if the arguments are malformed
+ */
+int fs_free_runs(fs_t* fs, unsigned* hist, int nbuckets);
+
+
+/*
+ * fs_blocks: gets the blocks storing the file system, e.g. to look at
+ * their I/O accounting (block_io)
+ * - fs: reference to file system
+ * - meta: the number of blocks, from block 0, holding metadata [out]
+ *   returns: the blocks instance
+ */
+blocks_t* fs_blocks(fs_t* fs, unsigned* meta);
+
+
+/*
+ * fs_generation: gets a number changed by every change of the attributes
+ * of an inode (size, links, directory entries) and when the inode is
+ * reused, so that what was read before can be known to be still current;
+ * the generation of inode 0 changes when a directory is moved or removed
+ * (a pathname may then lead to another directory)
+ * - fs: reference to file system
+ * - inode: node id of the file/directory, or 0
+ *   returns: the generation of the inode
+ */
+unsigned long fs_generation(fs_t* fs, inodeid_t inode);
 
 
 /*
@@ -107,7 +246,8 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
  * fs_write: write data to file
  * - fs: reference to file system
  * - file: node id of the file
- * - offset: starting position for writing
+ * - offset: starting position for writing (past the end of file, the gap
+ *   is left as a hole)
  * - count: number of bytes to write
  * - buffer: the data to write
  *   returns: 0 if successful, -1 otherwise (the write operation is atomic)
@@ -116,6 +256,113 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer);
 
 
+/*
+ * fs_read_map: gets where the contents of a file are kept in the storage,
+ * so that they can be transferred without being copied to a buffer; the
+ * mapped bytes are counted as read from their blocks. If successful, the
+ * file stays locked (the ranges valid) until fs_read_done
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: starting position for reading
+ * - count: number of bytes to read
+ * - ext: where to put the storage ranges holding the data [out]
+ * - maxext: maximum number of ranges to write in 'ext'
+ * - numext: number of ranges written [out]
+ * - nread: number of bytes effectively mapped [out]
+ *   returns: 0 if successful, -1 otherwise (also if the storage
+ *   cannot provide file descriptor ranges)
+ */
+int fs_read_map(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   fs_extent_t* ext, int maxext, int* numext, int* nread);
+
+
+/*
+ * fs_read_done: ends a read mapped by fs_read_map, once the data is copied
+ * out of the storage ranges (which may then be freed or reused)
+ * - fs: reference to file system
+ * - file: node id of the file, as given to fs_read_map
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_read_done(fs_t* fs, inodeid_t file);
+
+
+/*
+ * fs_write_map: reserves room for writing to a file and gets where the
+ * data must be placed in the storage; the file size is only updated by
+ * fs_write_done, once the data is copied. If successful, the file stays
+ * locked (the ranges valid) until fs_write_done, which must be called
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: starting position for writing
+ * - count: number of bytes to write
+ * - ext: where to put the storage ranges to fill with the data [out]
+ * - maxext: maximum number of ranges to write in 'ext'
+ * - numext: number of ranges written [out]
+ *   returns: 0 if successful, -1 otherwise (also if the storage
+ *   cannot provide file descriptor ranges)
+ */
+int fs_write_map(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   fs_extent_t* ext, int maxext, int* numext);
+
+
+/*
+ * fs_write_done: ends a write mapped by fs_write_map, growing the file to
+ * cover the bytes copied, which are counted as written to their blocks;
+ * after a short copy, the part of the range past the end of the file is
+ * zeroed again. The metadata is stored and the file unlocked
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: starting position of the write, as given to fs_write_map
+ * - count: number of bytes of the write, as given to fs_write_map
+ * - written: number of bytes copied to the storage ranges, from 'offset'
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_write_done(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   unsigned written);
+
+
+// fs_fallocate modes: keep the file size / release the range
+#define FS_FALLOC_KEEP_SIZE 1
+#define FS_FALLOC_PUNCH_HOLE 2
+
+// fs_fallocate/fs_truncate errors, besides -1 (malformed arguments, not a file)
+#define FS_ERR_NOSPC -2    // no free blocks left
+#define FS_ERR_FBIG -3     // the range ends past the largest file
+
+/*
+ * fs_fallocate: preallocates blocks for a range of a file, contiguous
+ * if possible, or (with FS_FALLOC_PUNCH_HOLE) turns the range into a
+ * hole, releasing its blocks; holes read as zeros and take no blocks
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - mode: FS_FALLOC_KEEP_SIZE and/or FS_FALLOC_PUNCH_HOLE, or 0 (the size
+ *   grows to cover the range unless FS_FALLOC_KEEP_SIZE is given)
+ * - offset: starting position of the range
+ * - len: size of the range
+ *   returns: 0 if successful, FS_ERR_NOSPC or FS_ERR_FBIG if the blocks
+ *   cannot be had, -1 otherwise
+ */
+int fs_fallocate(fs_t* fs, inodeid_t file, int mode, unsigned offset,
+   unsigned len);
+
+
+// fs_copy flag: share the blocks with the source instead of copying them
+#define FS_COPY_REFLINK 1
+
+/*
+ * fs_copy: makes a file a copy of another one, within the file system;
+ * with FS_COPY_REFLINK the blocks are shared by both files (and copied
+ * only when written), otherwise (or when a block cannot be shared any
+ * more) they are copied block by block
+ * - fs: reference to file system
+ * - src: node id of the file to copy
+ * - dst: node id of the file that becomes the copy
+ * - flags: FS_COPY_REFLINK or 0
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_copy(fs_t* fs, inodeid_t src, inodeid_t dst, int flags);
+
+
 /*
  * fs_create: create a file in a specified directory
  * - fs: reference to file system
@@ -124,7 +371,21 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
  * - fileid: the inode id of the file [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
+int fs_create(fs_t* fs, inodeid_t dir, const char* file, inodeid_t* fileid);
+
+
+/*
+ * fs_create_many: create several files in a specified directory in one
+ * pass, committing the file system metadata once
+ * - fs: reference to file system
+ * - dir: the directory where to create the files
+ * - files: the names of the files
+ * - count: the number of names
+ * - fileids: the inode ids of the files, 0 for the ones not created [out]
+ *   returns: the number of files created, -1 if the arguments are malformed
+ */
+int fs_create_many(fs_t* fs, inodeid_t dir, const char** files, int count,
+   inodeid_t* fileids);
 
 
 /*
@@ -135,7 +396,7 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
  * - newdirid: the inode id of the subdirectory [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid);
+int fs_mkdir(fs_t* fs, inodeid_t dir, const char* newdir, inodeid_t* newdirid);
 
 
 /*
@@ -152,12 +413,47 @@ int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
 
 
 /*
- * fs_truncate: truncate the content of a file by setting its size to 0. ( Created by ACV, IST - Taguspark, October 2011)
+ * fs_readdirplus: read the contents of a directory with the attributes
+ * of each entry, in a single pass over the directory
  * - fs: reference to file system
- * - fileid: the inode id of the file 
+ * - dir: the directory
+ * - entries: where to write the entries of the directory [out]
+ * - maxentries: maximum number of entries to write in 'entries'
+ * - numentries: number of entries written [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_readdirplus(fs_t* fs, inodeid_t dir, fs_file_entry_t* entries,
+   int maxentries, int* numentries);
+
+
+/*
+ * fs_readdir_stream: list a directory from a given position, handing
+ * each entry (with its attributes) to a filler function; the directory
+ * is read one page at a time, whatever its size
+ * - fs: reference to file system
+ * - dir: the directory
+ * - cursor: where to start, updated past the entries accepted [in/out]
+ *   ({0, 0} is the beginning of the directory)
+ * - filler: the function that receives the entries
+ * - ctx: the context passed to 'filler'
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_truncate(fs_t* fs, inodeid_t file);
+int fs_readdir_stream(fs_t* fs, inodeid_t dir, fs_dir_cursor_t* cursor,
+   fs_dir_filler_t filler, void* ctx);
+
+
+/*
+ * fs_truncate: set the size of a file. Shrinking releases the blocks past
+ * the new end of file; extending leaves a hole, that reads as zeros and
+ * gets blocks only when written.
+ * - fs: reference to file system
+ * - fileid: the inode id of the file 
+ * - size: the new size of the file
+ *   returns: 0 if successful, FS_ERR_FBIG if the size is past the largest
+ *   file, FS_ERR_NOSPC if the last block, shared with a copy, cannot be
+ *   copied (the file is then left unchanged), -1 otherwise
+ */
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size);
 
 
 /*
@@ -168,7 +464,24 @@ int fs_truncate(fs_t* fs, inodeid_t file);
  * - fileid: the inode id of the file [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_remove(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
+int fs_remove(fs_t* fs, inodeid_t dir, const char* file, inodeid_t* fileid);
+
+
+/*
+ * fs_rename: renames an object (file/directory), possibly moving it to
+ * another directory; an existing object with the new name is replaced
+ * if it has the same type (and, if a directory, is empty). A directory
+ * cannot be moved into itself or any directory below it. Only the
+ * directory entries are changed, never the contents of the object.
+ * - fs: reference to file system
+ * - olddir: the directory holding the object
+ * - oldname: the current name of the object
+ * - newdir: the directory where the object is moved to
+ * - newname: the new name of the object
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_rename(fs_t* fs, inodeid_t olddir, const char* oldname,
+   inodeid_t newdir, const char* newname);
 
 
 /*
@@ -178,7 +491,17 @@ int fs_remove(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid);
  * - subdirname: the name of the subdirectory to be removed
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_rmdir(fs_t* fs, inodeid_t dir, char* subdirname);
+int fs_rmdir(fs_t* fs, inodeid_t dir, const char* subdirname);
+
+/*
+ * fs_rmtree: remove a file or a whole subdirectory tree in a specified
+ * directory, committing the file system metadata once
+ * - fs: reference to file system
+ * - dir: the inode number of the directory holding the tree
+ * - name: the name of the file or subdirectory to be removed
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_rmtree(fs_t* fs, inodeid_t dir, const char* name);
 
 /*
  * fs_link: create an hard link file in a specified directory
@@ -188,7 +511,7 @@ int fs_rmdir(fs_t* fs, inodeid_t dir, char* subdirname);
  * - finode: the inode number of the file to be hard-linked
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_link(fs_t* fs,inodeid_t dir,char* filename, inodeid_t finode);
+int fs_link(fs_t* fs, inodeid_t dir, const char* filename, inodeid_t finode);
 
 
 
@@ -0,0 +1,269 @@
+/*
+ * File system layer micro-benchmark
+ *
+ * fsbench.c
+ *
+ * Measures the fs_* operations directly on the library (no FUSE, no
+ * kernel), as a baseline for the hot paths:
+ *   - create/remove: files created into, and removed from, a directory
+ *     holding up to ROUND_FILES of them;
+ *   - lookup: fs_lookup of a file at several directory depths;
+ *   - write/read: overwrites and reads of several sizes at offset 0;
+ *   - readdir: listing of a directory of ROUND_FILES entries.
+ * Each operation is timed on its own; the report gives the throughput
+ * and the median and 99th percentile latencies. It then gives the write
+ * amplification of the operations that write (stats.h): per operation,
+ * the bytes asked to be written and the bytes block_write wrote to data
+ * and to metadata blocks, and the ratio of the written to the asked ones.
+ *
+ * Usage: fsbench [iterations]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+#include "stats.h"
+
+#define ROUND_FILES 32
+#define MAX_DEPTH 8
+#define MAX_FILE_NAME_SIZE 14
+
+static const int depths[] = {1, 4, 8};
+static const unsigned sizes[] = {64, 512, 4096};
+
+#define NUM_DEPTHS (sizeof(depths) / sizeof(depths[0]))
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+/*
+ * Latency samples of an operation
+ */
+
+typedef struct {
+  char name[24];
+  long count;
+  double total;
+  double* lat;
+} bench_op_t;
+
+static void op_init(bench_op_t* op, const char* name, long iters)
+{
+  snprintf(op->name, sizeof(op->name), "%s", name);
+  op->count = 0;
+  op->total = 0;
+  op->lat = malloc(iters * sizeof(double));
+}
+
+static void op_add(bench_op_t* op, double t0, double t1)
+{
+  op->lat[op->count++] = t1 - t0;
+  op->total += t1 - t0;
+}
+
+static void op_report(FILE* out, bench_op_t* op)
+{
+  qsort(op->lat, op->count, sizeof(double), cmp_double);
+  fprintf(out, "%-14s %10ld %12.0f %10.0f %10.0f\n", op->name, op->count,
+    op->count / (op->total / 1e9), op->lat[op->count / 2],
+    op->lat[op->count * 99 / 100]);
+  free(op->lat);
+}
+
+
+/*
+ * Block writes of an operation (write amplification)
+ */
+
+typedef struct {
+  char name[24];
+  int op;
+  stats_amp_t before;
+  stats_amp_t amp;
+} bench_amp_t;
+
+static void amp_begin(bench_amp_t* a, const char* name, int op)
+{
+  stats_amp_t all[STATS_NUM_AMP];
+
+  snprintf(a->name, sizeof(a->name), "%s", name);
+  a->op = op;
+  stats_amp(all);
+  a->before = all[op];
+}
+
+static void amp_end(bench_amp_t* a)
+{
+  stats_amp_t all[STATS_NUM_AMP];
+
+  stats_amp(all);
+  a->amp.count = all[a->op].count - a->before.count;
+  a->amp.user_bytes = all[a->op].user_bytes - a->before.user_bytes;
+  a->amp.data_bytes = all[a->op].data_bytes - a->before.data_bytes;
+  a->amp.meta_bytes = all[a->op].meta_bytes - a->before.meta_bytes;
+}
+
+static void amp_report(FILE* out, bench_amp_t* a)
+{
+  double count = a->amp.count ? a->amp.count : 1;
+  double written = a->amp.data_bytes + a->amp.meta_bytes;
+
+  fprintf(out, "%-14s %10llu %12.0f %12.0f %12.0f", a->name,
+    (unsigned long long) a->amp.count, a->amp.user_bytes / count,
+    a->amp.data_bytes / count, a->amp.meta_bytes / count);
+  if (a->amp.user_bytes != 0) {
+    fprintf(out, " %10.2f\n", written / a->amp.user_bytes);
+  } else {
+    fprintf(out, " %10s\n", "-");
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  long iters = (argc > 1) ? atol(argv[1]) : 20000;
+  bench_op_t create, remove, readdir, lookup[NUM_DEPTHS];
+  bench_op_t writes[NUM_SIZES], reads[NUM_SIZES];
+  bench_amp_t create_amp, remove_amp, write_amp[NUM_SIZES];
+  char path[MAX_DEPTH+1][MAX_PATH_NAME_SIZE];
+  char names[ROUND_FILES][MAX_FILE_NAME_SIZE];
+  static char buf[4096];
+  fs_file_name_t entries[ROUND_FILES];
+  inodeid_t dir = 1, id, file, rdir;
+  int n;
+
+  if (iters < ROUND_FILES) {
+    iters = ROUND_FILES;
+  }
+  iters -= iters % ROUND_FILES;
+
+  FILE* out = stdout;
+
+  fs_t* fs = fs_new(8*512);
+  fs_format(fs);
+
+  // /l1/l2/.../lN/f for each depth N
+  char prefix[MAX_PATH_NAME_SIZE] = "";
+  for (int d = 1; d <= MAX_DEPTH; d++) {
+    char name[MAX_FILE_NAME_SIZE];
+    sprintf(name, "l%d", d);
+    if (fs_mkdir(fs, dir, name, &dir) != 0 || fs_create(fs, dir, "f", &id) != 0) {
+      fprintf(stderr, "fsbench: cannot create '%s'\n", name);
+      return 1;
+    }
+    strcat(prefix, "/");
+    strcat(prefix, name);
+    sprintf(path[d], "%s/f", prefix);
+  }
+
+  if (fs_create(fs, 1, "data", &file) != 0 || fs_mkdir(fs, 1, "rounds", &rdir) != 0) {
+    fprintf(stderr, "fsbench: cannot create the test files\n");
+    return 1;
+  }
+  memset(buf, 'x', sizeof(buf));
+  fs_write(fs, file, 0, sizeof(buf), buf);
+  for (int i = 0; i < ROUND_FILES; i++) {
+    sprintf(names[i], "r%d", i);
+  }
+
+  op_init(&create, "create", iters);
+  op_init(&remove, "remove", iters);
+  op_init(&readdir, "readdir", iters / ROUND_FILES);
+  for (int i = 0; i < NUM_DEPTHS; i++) {
+    char name[24];
+    sprintf(name, "lookup/d%d", depths[i]);
+    op_init(&lookup[i], name, iters);
+  }
+  for (int i = 0; i < NUM_SIZES; i++) {
+    char name[24];
+    sprintf(name, "write/%u", sizes[i]);
+    op_init(&writes[i], name, iters);
+    sprintf(name, "read/%u", sizes[i]);
+    op_init(&reads[i], name, iters);
+  }
+
+  // create a directory full of files, list it, empty it
+  amp_begin(&create_amp, "create", STATS_AMP_CREATE);
+  amp_begin(&remove_amp, "remove", STATS_AMP_REMOVE);
+  for (long r = 0; r < iters / ROUND_FILES; r++) {
+    for (int i = 0; i < ROUND_FILES; i++) {
+      double t0 = now_ns();
+      fs_create(fs, rdir, names[i], &id);
+      op_add(&create, t0, now_ns());
+    }
+    double t0 = now_ns();
+    fs_readdir(fs, rdir, entries, ROUND_FILES, &n);
+    op_add(&readdir, t0, now_ns());
+    for (int i = 0; i < ROUND_FILES; i++) {
+      double t0 = now_ns();
+      fs_remove(fs, rdir, names[i], &id);
+      op_add(&remove, t0, now_ns());
+    }
+  }
+  amp_end(&create_amp);
+  amp_end(&remove_amp);
+
+  for (int i = 0; i < NUM_DEPTHS; i++) {
+    for (long k = 0; k < iters; k++) {
+      double t0 = now_ns();
+      fs_lookup(fs, path[depths[i]], &id);
+      op_add(&lookup[i], t0, now_ns());
+    }
+  }
+
+  for (int i = 0; i < NUM_SIZES; i++) {
+    amp_begin(&write_amp[i], writes[i].name, STATS_AMP_WRITE);
+    for (long k = 0; k < iters; k++) {
+      double t0 = now_ns();
+      fs_write(fs, file, 0, sizes[i], buf);
+      op_add(&writes[i], t0, now_ns());
+    }
+    amp_end(&write_amp[i]);
+    for (long k = 0; k < iters; k++) {
+      double t0 = now_ns();
+      fs_read(fs, file, 0, sizes[i], buf, &n);
+      op_add(&reads[i], t0, now_ns());
+    }
+  }
+
+  fprintf(out, "%-14s %10s %12s %10s %10s\n", "op", "count", "ops/s", "p50 ns", "p99 ns");
+  op_report(out, &create);
+  op_report(out, &remove);
+  op_report(out, &readdir);
+  for (int i = 0; i < NUM_DEPTHS; i++) {
+    op_report(out, &lookup[i]);
+  }
+  for (int i = 0; i < NUM_SIZES; i++) {
+    op_report(out, &writes[i]);
+    op_report(out, &reads[i]);
+  }
+
+  fprintf(out, "\n%-14s %10s %12s %12s %12s %10s\n", "op", "count", "user B/op",
+    "data B/op", "meta B/op", "amplif.");
+  amp_report(out, &create_amp);
+  amp_report(out, &remove_amp);
+  for (int i = 0; i < NUM_SIZES; i++) {
+    amp_report(out, &write_amp[i]);
+  }
+  fclose(out);
+  return 0;
+}
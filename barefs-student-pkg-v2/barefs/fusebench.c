@@ -0,0 +1,415 @@
+/*
+ * End-to-end workload benchmark
+ *
+ * fusebench.c
+ *
+ * Runs a fixed set of workloads with plain system calls against a
+ * directory, meant to be a mounted barefs (see fusebench.sh), so that the
+ * figures include the kernel and FUSE:
+ *   - seqwrite/seqread: 512 byte writes/reads going through a file;
+ *   - randwrite/randread: 512 byte writes/reads at random blocks of it;
+ *   - create/stat/unlink: small files created, stat'ed and removed;
+ *   - deepstat: stat of a file MAX_DEPTH directories down;
+ *   - readdir: listing of a directory of DIR_FILES entries;
+ *   - mixed: threads reading, writing and stat'ing files of their own.
+ * The files are kept within the limits of barefs (10 blocks per file, 64
+ * inodes). Each workload prints one JSON line with its throughput and its
+ * median and 99th percentile latencies; random offsets come from a fixed
+ * seed, so runs are comparable across commits.
+ *
+ * Usage: fusebench [-i iterations] [-t threads] [-l label] <dir>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define IO_SIZE 512
+#define FILE_SIZE (10*IO_SIZE)
+#define SMALL_FILES 32
+#define DIR_FILES 48
+#define MAX_DEPTH 8
+#define MAX_THREADS 8
+#define DIR_SIZE (PATH_MAX/4)   // longest pathname of a directory used
+
+static const char* label = "";
+static long iters = 5000;
+
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+static void fail(const char* what, const char* path)
+{
+  fprintf(stderr, "fusebench: %s '%s': ", what, path);
+  perror(NULL);
+  exit(1);
+}
+
+
+/*
+ * Latency samples of a workload
+ */
+
+typedef struct {
+  long count;
+  double elapsed;   // wall time of the whole workload
+  double* lat;
+} bench_run_t;
+
+static void run_init(bench_run_t* run, long max)
+{
+  run->count = 0;
+  run->elapsed = 0;
+  run->lat = malloc(max * sizeof(double));
+}
+
+static void run_add(bench_run_t* run, double t0, double t1)
+{
+  run->lat[run->count++] = t1 - t0;
+}
+
+static void run_report(const char* workload, bench_run_t* run, unsigned bytes)
+{
+  qsort(run->lat, run->count, sizeof(double), cmp_double);
+  printf("{\"label\":\"%s\",\"workload\":\"%s\",\"ops\":%ld,\"ops_s\":%.0f,"
+    "\"mb_s\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+    label, workload, run->count, run->count / (run->elapsed / 1e9),
+    (double) run->count * bytes / (run->elapsed / 1e3),
+    run->lat[run->count / 2] / 1e3, run->lat[run->count * 99 / 100] / 1e3);
+  fflush(stdout);
+  free(run->lat);
+}
+
+
+/*
+ * Workloads
+ */
+
+// 512 byte reads or writes at sequential (or random) blocks of a file
+static void bench_io(const char* dir, const char* workload, int writing, int random)
+{
+  char path[PATH_MAX], buf[IO_SIZE];
+  unsigned seed = 1;
+  bench_run_t run;
+
+  snprintf(path, sizeof(path), "%s/io", dir);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fail("cannot open", path);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for (off_t pos = 0; pos < FILE_SIZE; pos += IO_SIZE) {
+    if (pwrite(fd, buf, IO_SIZE, pos) != IO_SIZE) {
+      fail("cannot write", path);
+    }
+  }
+
+  run_init(&run, iters);
+  double start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    off_t pos = (random ? rand_r(&seed) : i) % (FILE_SIZE / IO_SIZE) * IO_SIZE;
+    double t0 = now_ns();
+    ssize_t n = writing ? pwrite(fd, buf, IO_SIZE, pos) : pread(fd, buf, IO_SIZE, pos);
+    run_add(&run, t0, now_ns());
+    if (n != IO_SIZE) {
+      fail(writing ? "cannot write" : "cannot read", path);
+    }
+  }
+  run.elapsed = now_ns() - start;
+  close(fd);
+  unlink(path);
+  run_report(workload, &run, IO_SIZE);
+}
+
+
+// rounds of small files created, stat'ed and removed
+static void bench_smallfiles(const char* dir)
+{
+  char path[SMALL_FILES][PATH_MAX];
+  bench_run_t create, stats, remove;
+  struct stat st;
+  long rounds = (iters + SMALL_FILES - 1) / SMALL_FILES;
+
+  for (int i = 0; i < SMALL_FILES; i++) {
+    snprintf(path[i], sizeof(path[i]), "%s/s%d", dir, i);
+  }
+  run_init(&create, rounds * SMALL_FILES);
+  run_init(&stats, rounds * SMALL_FILES);
+  run_init(&remove, rounds * SMALL_FILES);
+
+  for (long r = 0; r < rounds; r++) {
+    for (int i = 0; i < SMALL_FILES; i++) {
+      double t0 = now_ns();
+      int fd = open(path[i], O_WRONLY | O_CREAT, 0644);
+      if (fd < 0 || close(fd) != 0) {
+        fail("cannot create", path[i]);
+      }
+      run_add(&create, t0, now_ns());
+    }
+    for (int i = 0; i < SMALL_FILES; i++) {
+      double t0 = now_ns();
+      if (stat(path[i], &st) != 0) {
+        fail("cannot stat", path[i]);
+      }
+      run_add(&stats, t0, now_ns());
+    }
+    for (int i = 0; i < SMALL_FILES; i++) {
+      double t0 = now_ns();
+      if (unlink(path[i]) != 0) {
+        fail("cannot unlink", path[i]);
+      }
+      run_add(&remove, t0, now_ns());
+    }
+  }
+
+  // the phases interleave: rate them by their own time
+  for (long i = 0; i < create.count; i++) {
+    create.elapsed += create.lat[i];
+    stats.elapsed += stats.lat[i];
+    remove.elapsed += remove.lat[i];
+  }
+  run_report("create", &create, 0);
+  run_report("stat", &stats, 0);
+  run_report("unlink", &remove, 0);
+}
+
+
+// stat of a file at the bottom of a chain of directories
+static void bench_deepstat(const char* dir)
+{
+  char path[DIR_SIZE*2], file[PATH_MAX];
+  size_t len[MAX_DEPTH+1];
+  bench_run_t run;
+  struct stat st;
+
+  snprintf(path, DIR_SIZE, "%s", dir);
+  len[0] = strlen(path);
+  for (int d = 1; d <= MAX_DEPTH; d++) {
+    len[d] = len[d-1] + sprintf(&path[len[d-1]], "/d%d", d);
+    if (mkdir(path, 0755) != 0) {
+      fail("cannot create", path);
+    }
+  }
+  snprintf(file, sizeof(file), "%s/f", path);
+  int fd = open(file, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    fail("cannot create", file);
+  }
+  close(fd);
+
+  run_init(&run, iters);
+  double start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    double t0 = now_ns();
+    if (stat(file, &st) != 0) {
+      fail("cannot stat", file);
+    }
+    run_add(&run, t0, now_ns());
+  }
+  run.elapsed = now_ns() - start;
+
+  unlink(file);
+  for (int d = MAX_DEPTH; d >= 1; d--) {
+    path[len[d]] = '\0';
+    rmdir(path);
+  }
+  run_report("deepstat", &run, 0);
+}
+
+
+// full listings of a directory
+static void bench_readdir(const char* dir)
+{
+  char path[DIR_SIZE*2], file[PATH_MAX];
+  long rounds = (iters + 9) / 10;
+  bench_run_t run;
+
+  snprintf(path, sizeof(path), "%s/list", dir);
+  if (mkdir(path, 0755) != 0) {
+    fail("cannot create", path);
+  }
+  for (int i = 0; i < DIR_FILES; i++) {
+    snprintf(file, sizeof(file), "%s/e%d", path, i);
+    int fd = open(file, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      fail("cannot create", file);
+    }
+    close(fd);
+  }
+
+  run_init(&run, rounds);
+  double start = now_ns();
+  for (long i = 0; i < rounds; i++) {
+    int n = 0;
+    double t0 = now_ns();
+    DIR* d = opendir(path);
+    if (d == NULL) {
+      fail("cannot list", path);
+    }
+    while (readdir(d) != NULL) {
+      n++;
+    }
+    closedir(d);
+    run_add(&run, t0, now_ns());
+    if (n < DIR_FILES) {
+      fprintf(stderr, "fusebench: '%s' lists %d entries\n", path, n);
+      exit(1);
+    }
+  }
+  run.elapsed = now_ns() - start;
+
+  for (int i = 0; i < DIR_FILES; i++) {
+    snprintf(file, sizeof(file), "%s/e%d", path, i);
+    unlink(file);
+  }
+  rmdir(path);
+  run_report("readdir", &run, 0);
+}
+
+
+// threads each reading (50%), writing (30%) and stat'ing (20%) a file
+typedef struct {
+  pthread_t thread;
+  int id;
+  char path[PATH_MAX];
+  bench_run_t run;
+} bench_mixer_t;
+
+static void* mixer(void* arg)
+{
+  bench_mixer_t* m = (bench_mixer_t*) arg;
+  unsigned seed = m->id + 1;
+  char buf[IO_SIZE];
+  struct stat st;
+
+  int fd = open(m->path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fail("cannot open", m->path);
+  }
+  memset(buf, 'm', sizeof(buf));
+  for (off_t pos = 0; pos < FILE_SIZE; pos += IO_SIZE) {
+    if (pwrite(fd, buf, IO_SIZE, pos) != IO_SIZE) {
+      fail("cannot write", m->path);
+    }
+  }
+
+  for (long i = 0; i < iters; i++) {
+    int op = rand_r(&seed) % 10;
+    off_t pos = rand_r(&seed) % (FILE_SIZE / IO_SIZE) * IO_SIZE;
+    int ok;
+    double t0 = now_ns();
+    if (op < 5) {
+      ok = pread(fd, buf, IO_SIZE, pos) == IO_SIZE;
+    } else if (op < 8) {
+      ok = pwrite(fd, buf, IO_SIZE, pos) == IO_SIZE;
+    } else {
+      ok = stat(m->path, &st) == 0;
+    }
+    run_add(&m->run, t0, now_ns());
+    if (!ok) {
+      fail("cannot access", m->path);
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+static void bench_mixed(const char* dir, int threads)
+{
+  bench_mixer_t m[MAX_THREADS];
+  bench_run_t run;
+
+  for (int t = 0; t < threads; t++) {
+    m[t].id = t;
+    snprintf(m[t].path, sizeof(m[t].path), "%s/m%d", dir, t);
+    run_init(&m[t].run, iters);
+  }
+  double start = now_ns();
+  for (int t = 0; t < threads; t++) {
+    if (pthread_create(&m[t].thread, NULL, mixer, &m[t]) != 0) {
+      fail("cannot start a thread for", m[t].path);
+    }
+  }
+  run_init(&run, iters * threads);
+  for (int t = 0; t < threads; t++) {
+    pthread_join(m[t].thread, NULL);
+    memcpy(&run.lat[run.count], m[t].run.lat, m[t].run.count * sizeof(double));
+    run.count += m[t].run.count;
+    free(m[t].run.lat);
+    unlink(m[t].path);
+  }
+  run.elapsed = now_ns() - start;
+
+  char workload[32];
+  snprintf(workload, sizeof(workload), "mixed/%dt", threads);
+  run_report(workload, &run, 0);
+}
+
+
+int main(int argc, char* argv[])
+{
+  int threads = 4, opt;
+  char dir[DIR_SIZE];
+
+  while ((opt = getopt(argc, argv, "i:t:l:")) != -1) {
+    switch (opt) {
+    case 'i':
+      iters = atol(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1 || iters < 1 || threads < 1 || threads > MAX_THREADS ||
+      strlen(argv[optind]) > DIR_SIZE - 16) {
+    fprintf(stderr, "usage: fusebench [-i iterations] [-t threads(1-%d)] [-l label] <dir>\n",
+      MAX_THREADS);
+    return 2;
+  }
+
+  // everything goes in a directory of its own
+  snprintf(dir, sizeof(dir), "%s/fusebench", argv[optind]);
+  if (mkdir(dir, 0755) != 0) {
+    fail("cannot create", dir);
+  }
+
+  bench_io(dir, "seqwrite", 1, 0);
+  bench_io(dir, "seqread", 0, 0);
+  bench_io(dir, "randwrite", 1, 1);
+  bench_io(dir, "randread", 0, 1);
+  bench_smallfiles(dir);
+  bench_deepstat(dir);
+  bench_readdir(dir);
+  bench_mixed(dir, threads);
+
+  rmdir(dir);
+  return 0;
+}
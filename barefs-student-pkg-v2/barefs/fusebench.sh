@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# End-to-end benchmark: mounts barefs on a temporary directory, runs
+# fusebench on it and unmounts it. The results are JSON lines on stdout,
+# labelled with the current commit, e.g.
+#     ./fusebench.sh -i 10000 > results-$(git rev-parse --short HEAD).json
+#
+# Usage: fusebench.sh [fusebench options]
+#   BAREFS_OPTS  options given to barefs (default: -s, single threaded)
+#   BAREFS_LOG   file keeping the messages of barefs (default: discarded)
+
+set -e
+cd "$(dirname "$0")"
+
+mnt=$(mktemp -d "${TMPDIR:-/tmp}/barefs.XXXXXX")
+cleanup() {
+  fusermount -u "$mnt" 2>/dev/null || true
+  wait
+  rmdir "$mnt"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+./barefs ${BAREFS_OPTS--s} -f "$mnt" > "${BAREFS_LOG:-/dev/null}" 2>&1 &
+
+tries=0
+until mountpoint -q "$mnt"; do
+  tries=$((tries + 1))
+  if [ $tries -gt 50 ] || ! kill -0 $! 2>/dev/null; then
+    echo "fusebench.sh: barefs did not mount on $mnt" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+label=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+./fusebench -l "$label" "$@" "$mnt"
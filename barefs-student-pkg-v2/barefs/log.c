@@ -0,0 +1,341 @@
+/*
+ * Logging
+ *
+ * log.c
+ *
+ * Each logging thread owns a ring of fixed size records, where it is the
+ * only producer; the drain thread is the only consumer of all the rings.
+ * The head and tail of a ring are published with release stores, so the
+ * rings take no locks: the lock of the ring list is only taken when a
+ * thread logs its first message and by the drain thread.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_RING_SIZE 256        // records per thread
+#define LOG_DRAIN_US 10000       // period of the drain thread
+#define LOG_FORMATS 1024         // formats remembered by the drain thread
+
+
+typedef struct {
+   log_rec_t hdr;
+   uint8_t args[LOG_ARGS_SIZE];
+} log_entry_t;
+
+typedef struct log_ring_ {
+   log_entry_t entries[LOG_RING_SIZE];
+   uint32_t head;           // next entry to write (by the thread)
+   uint32_t tail;           // next entry to drain (by the drain thread)
+   uint32_t dropped;        // records dropped on a full ring
+   uint32_t reported;       // drops logged by the drain thread
+   uint32_t thread;
+   int dead;                // the thread exited, free once drained
+   struct log_ring_* next;
+} log_ring_t;
+
+
+int log_level = LOG_OFF;
+
+static const char* level_names[] = { "off", "error", "warn", "info", "debug" };
+static const char drop_fmt[] = "[log] %u messages dropped.\n";
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static log_ring_t* log_rings;
+static uint32_t log_threads;
+static __thread log_ring_t* log_mine;
+
+static FILE* log_file;
+static pthread_t log_drainer;
+static int log_draining;
+static volatile int log_stop;
+static uint64_t log_formats[LOG_FORMATS];
+
+
+/*
+ * Internal functions registering the logging threads
+ */
+
+static void log_leave(void* arg)
+{
+   log_mine = NULL;
+   __atomic_store_n(&((log_ring_t*) arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_init(void)
+{
+   pthread_key_create(&log_key, log_leave);
+}
+
+static log_ring_t* log_join(void)
+{
+   log_ring_t* ring = (log_ring_t*) calloc(1, sizeof(log_ring_t));
+
+   if (ring == NULL) {
+      return NULL;
+   }
+   pthread_once(&log_once, log_init);
+   pthread_setspecific(log_key, ring);
+   pthread_mutex_lock(&log_lock);
+   ring->thread = ++log_threads;
+   ring->next = log_rings;
+   log_rings = ring;
+   pthread_mutex_unlock(&log_lock);
+   log_mine = ring;
+   return ring;
+}
+
+
+/*
+ * Internal function storing the arguments of a message, as its format
+ * tells; returns the bytes used (arguments that do not fit are dropped)
+ */
+
+static int log_encode(uint8_t* args, int* nargs, const char* fmt, va_list ap)
+{
+   int size = 0;
+
+   for (const char* p = fmt; *p != '\0'; p++) {
+      if (*p != '%') {
+         continue;
+      }
+      if (*++p == '%') {
+         continue;
+      }
+      while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL) {
+         p++;
+      }
+      int longs = 0;
+      while (*p != '\0' && strchr("hlzjt", *p) != NULL) {
+         longs += (*p == 'h') ? 0 : (*p == 'l') ? 1 : 2;
+         p++;
+      }
+
+      uint64_t v;
+      switch (*p) {
+      case 'd': case 'i':
+         v = (longs == 0) ? (int64_t) va_arg(ap, int) :
+             (longs == 1) ? (int64_t) va_arg(ap, long) : (int64_t) va_arg(ap, long long);
+         break;
+      case 'u': case 'x': case 'X': case 'o':
+         v = (longs == 0) ? va_arg(ap, unsigned) :
+             (longs == 1) ? va_arg(ap, unsigned long) : va_arg(ap, unsigned long long);
+         break;
+      case 'c':
+         v = va_arg(ap, int);
+         break;
+      case 'p':
+         v = (uintptr_t) va_arg(ap, void*);
+         break;
+      case 'f': case 'e': case 'g': case 'E': case 'G': {
+         double d = va_arg(ap, double);
+         memcpy(&v, &d, sizeof(v));
+         break;
+      }
+      case 's': {
+         const char* s = va_arg(ap, const char*);
+         size_t len = strlen(s != NULL ? s : "(null)");
+         if (size + 1 > LOG_ARGS_SIZE) {
+            return size;
+         }
+         if (len > LOG_ARGS_SIZE - size - 1) {
+            len = LOG_ARGS_SIZE - size - 1;
+         }
+         args[size++] = len;
+         memcpy(&args[size], s != NULL ? s : "(null)", len);
+         size += len;
+         (*nargs)++;
+         continue;
+      }
+      default:
+         return size;
+      }
+      if (size + sizeof(v) > LOG_ARGS_SIZE) {
+         return size;
+      }
+      memcpy(&args[size], &v, sizeof(v));
+      size += sizeof(v);
+      (*nargs)++;
+   }
+   return size;
+}
+
+
+static uint64_t log_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void log_write(int level, const char* fmt, ...)
+{
+   log_ring_t* ring = log_mine;
+   va_list ap;
+
+   if (ring == NULL && (ring = log_join()) == NULL) {
+      return;
+   }
+
+   uint32_t head = ring->head;
+   if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   log_entry_t* e = &ring->entries[head % LOG_RING_SIZE];
+   int nargs = 0;
+   va_start(ap, fmt);
+   e->hdr.size = log_encode(e->args, &nargs, fmt, ap);
+   va_end(ap);
+   e->hdr.time = log_clock();
+   e->hdr.fmt = (uintptr_t) fmt;
+   e->hdr.thread = ring->thread;
+   e->hdr.level = level;
+   e->hdr.nargs = nargs;
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Internal functions of the drain thread
+ */
+
+// writes the format of a record, the first time it shows up
+static void log_define(uint64_t fmt)
+{
+   unsigned h = (fmt >> 3) % LOG_FORMATS;
+
+   for (int n = 0; n < LOG_FORMATS; n++, h = (h + 1) % LOG_FORMATS) {
+      if (log_formats[h] == fmt) {
+         return;
+      }
+      if (log_formats[h] == 0) {
+         log_formats[h] = fmt;
+         break;
+      }
+   }
+
+   const char* str = (const char*) (uintptr_t) fmt;
+   log_rec_t def = { 0, fmt, 0, LOG_OFF, 0, strlen(str) };
+   fwrite(&def, sizeof(def), 1, log_file);
+   fwrite(str, 1, def.size, log_file);
+}
+
+// drains the rings to the log file (with the lock held)
+static void log_drain(void)
+{
+   for (log_ring_t** r = &log_rings; *r != NULL; ) {
+      log_ring_t* ring = *r;
+      int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+      uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      uint32_t tail = ring->tail;
+
+      for (; tail != head; tail++) {
+         log_entry_t* e = &ring->entries[tail % LOG_RING_SIZE];
+         log_define(e->hdr.fmt);
+         fwrite(e, sizeof(e->hdr) + e->hdr.size, 1, log_file);
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+      uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      if (dropped != ring->reported) {
+         log_entry_t drop = { { log_clock(), (uintptr_t) drop_fmt, ring->thread,
+            LOG_WARN, 1, sizeof(uint64_t) } };
+         uint64_t count = dropped - ring->reported;
+         memcpy(drop.args, &count, sizeof(count));
+         log_define(drop.hdr.fmt);
+         fwrite(&drop, sizeof(drop.hdr) + drop.hdr.size, 1, log_file);
+         ring->reported = dropped;
+      }
+
+      if (dead) {
+         *r = ring->next;
+         free(ring);
+      } else {
+         r = &ring->next;
+      }
+   }
+   fflush(log_file);
+}
+
+static void* log_drain_loop(void* arg)
+{
+   struct timespec period = { 0, LOG_DRAIN_US * 1000 };
+
+   while (!log_stop) {
+      nanosleep(&period, NULL);
+      pthread_mutex_lock(&log_lock);
+      log_drain();
+      pthread_mutex_unlock(&log_lock);
+   }
+   return NULL;
+}
+
+
+int log_level_parse(const char* name)
+{
+   for (int l = LOG_OFF; l <= LOG_DEBUG; l++) {
+      if (strcmp(name, level_names[l]) == 0 || (name[0] == '0' + l && name[1] == '\0')) {
+         return l;
+      }
+   }
+   return -1;
+}
+
+
+int log_open(const char* path, int level)
+{
+   log_header_t hdr = { LOG_MAGIC, LOG_VERSION, log_clock() };
+
+   log_file = fopen(path, "wb");
+   if (log_file == NULL) {
+      return -1;
+   }
+   fwrite(&hdr, sizeof(hdr), 1, log_file);
+   log_level = level;
+   return 0;
+}
+
+
+int log_start(void)
+{
+   if (log_file == NULL || log_draining) {
+      return -1;
+   }
+   log_stop = 0;
+   if (pthread_create(&log_drainer, NULL, log_drain_loop, NULL) != 0) {
+      return -1;
+   }
+   log_draining = 1;
+   return 0;
+}
+
+
+void log_close(void)
+{
+   log_level = LOG_OFF;
+   if (log_draining) {
+      log_stop = 1;
+      pthread_join(log_drainer, NULL);
+      log_draining = 0;
+   }
+   if (log_file != NULL) {
+      pthread_mutex_lock(&log_lock);
+      log_drain();
+      pthread_mutex_unlock(&log_lock);
+      fclose(log_file);
+      log_file = NULL;
+   }
+}
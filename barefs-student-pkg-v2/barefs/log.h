@@ -0,0 +1,120 @@
+/*
+ * Logging
+ *
+ * log.h
+ *
+ * Leveled logging of the file system layers. A message is not formatted
+ * when logged: its format and arguments are stored as a binary record in
+ * a ring of the logging thread, and a background thread drains the rings
+ * to the log file, that logdump decodes. When a ring is full the records
+ * are dropped (and the drops logged), so logging never blocks.
+ *
+ * Messages above LOG_MAX_LEVEL (compile time, e.g. -DLOG_MAX_LEVEL=1) are
+ * compiled out; the others cost a predictable branch while their level
+ * is above log_level (run time, LOG_OFF unless log_open is called).
+ * Only %d %i %u %x %X %o %c %s %p %f %e %g conversions, with flags, width,
+ * precision and length modifiers, can be used in formats.
+ *
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_MAGIC 0x474c4642   // "BFLG"
+#define LOG_VERSION 1
+
+// room for the arguments of a message in a record
+#define LOG_ARGS_SIZE 104
+
+
+/*
+ * Log file: a log_header_t followed by records, a log_rec_t header with
+ * 'size' bytes after it: the format (with level LOG_OFF) defining the
+ * format id 'fmt' for the records that follow, or the arguments of a
+ * message: 8 bytes per number, a length byte and the chars per string
+ */
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t start;          // ns of the monotonic clock at log_open
+} log_header_t;
+
+typedef struct {
+   uint64_t time;           // ns of the monotonic clock
+   uint64_t fmt;            // format id
+   uint32_t thread;         // logging thread, in order of first message
+   uint8_t level;
+   uint8_t nargs;
+   uint16_t size;
+} log_rec_t;
+
+
+extern int log_level;
+
+#define LOG_ENABLED(level) \
+   ((level) <= LOG_MAX_LEVEL && __builtin_expect((level) <= log_level, 0))
+
+#define LOG(level, ...) do { \
+      if (LOG_ENABLED(level)) { \
+         log_write(level, __VA_ARGS__); \
+      } \
+   } while (0)
+
+#define log_error(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_DEBUG, __VA_ARGS__)
+
+
+/*
+ * log_write: stores a message in the ring of the calling thread (use the
+ * LOG macros, that test the level first)
+ * - level: the level of the message
+ * - fmt: the printf format, that must be a string constant
+ */
+void log_write(int level, const char* fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+
+
+/*
+ * log_level_parse: gets a level from its name or number
+ * - name: "off", "error", "warn", "info", "debug" or 0-4
+ *   returns: the level, -1 if unknown
+ */
+int log_level_parse(const char* name);
+
+
+/*
+ * log_open: opens the log file (truncating it) and sets the level
+ * - path: the log file
+ * - level: the level of the messages to log
+ *   returns: 0 if successful, -1 otherwise
+ */
+int log_open(const char* path, int level);
+
+
+/*
+ * log_start: starts the thread that drains the rings to the log file
+ *   returns: 0 if successful, -1 otherwise
+ */
+int log_start(void);
+
+
+/*
+ * log_close: stops logging, drains the rings and closes the log file
+ */
+void log_close(void);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Log decoder
+ *
+ * logdump.c
+ *
+ * Prints the messages of a log written by barefs (BAREFS_LOG=<level>, see
+ * log.h), formatting them from their formats and stored arguments, one
+ * per line and in time order (the log holds them as the threads' rings
+ * were drained): the time since the log was opened (s), the logging
+ * thread, the level and the message. With -l only the messages of that
+ * level and below are printed.
+ *
+ * Usage: logdump [-l level] <log>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+
+static const char* level_names[] = { "off", "ERROR", "WARN", "INFO", "DEBUG" };
+
+
+/*
+ * The formats defined by the log
+ */
+
+typedef struct {
+  uint64_t id;
+  char* str;
+} dump_fmt_t;
+
+static dump_fmt_t* fmts;
+static int num_fmts;
+
+/*
+ * The messages, sorted before printing
+ */
+
+typedef struct {
+  log_rec_t rec;
+  const char* fmt;
+  uint8_t* args;
+} dump_msg_t;
+
+static dump_msg_t* msgs;
+static long num_msgs;
+
+static int cmp_msg(const void* a, const void* b)
+{
+  const dump_msg_t* x = (const dump_msg_t*) a;
+  const dump_msg_t* y = (const dump_msg_t*) b;
+  return (x->rec.time > y->rec.time) - (x->rec.time < y->rec.time);
+}
+
+
+static const char* fmt_find(uint64_t id)
+{
+  for (int i = num_fmts - 1; i >= 0; i--) {
+    if (fmts[i].id == id) {
+      return fmts[i].str;
+    }
+  }
+  return NULL;
+}
+
+
+// prints a message from its format and the stored arguments
+static void print_message(const char* fmt, const uint8_t* args, int size)
+{
+  int used = 0;
+
+  for (const char* p = fmt; *p != '\0'; p++) {
+    if (*p != '%') {
+      putchar(*p);
+      continue;
+    }
+    if (p[1] == '%') {
+      putchar('%');
+      p++;
+      continue;
+    }
+
+    // the conversion, without its length modifiers
+    char spec[32];
+    int n = 0;
+    spec[n++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && n < 24) {
+      spec[n++] = *p++;
+    }
+    while (*p != '\0' && strchr("hlzjt", *p) != NULL) {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    uint64_t v = 0;
+    if (*p == 's') {
+      char str[LOG_ARGS_SIZE];
+      int len = (used < size) ? args[used] : -1;
+      if (len < 0 || used + 1 + len > size) {
+        fputs("?", stdout);
+        used = size;
+        continue;
+      }
+      memcpy(str, &args[used + 1], len);
+      str[len] = '\0';
+      used += 1 + len;
+      strcpy(&spec[n], "s");
+      printf(spec, str);
+      continue;
+    }
+    if (used + sizeof(v) > size) {
+      fputs("?", stdout);
+      continue;
+    }
+    memcpy(&v, &args[used], sizeof(v));
+    used += sizeof(v);
+
+    switch (*p) {
+    case 'd': case 'i':
+      strcpy(&spec[n], "lld");
+      printf(spec, (long long) v);
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      sprintf(&spec[n], "ll%c", *p);
+      printf(spec, (unsigned long long) v);
+      break;
+    case 'c':
+      strcpy(&spec[n], "c");
+      printf(spec, (int) v);
+      break;
+    case 'p':
+      strcpy(&spec[n], "p");
+      printf(spec, (void*) (uintptr_t) v);
+      break;
+    case 'f': case 'e': case 'g': case 'E': case 'G': {
+      double d;
+      memcpy(&d, &v, sizeof(d));
+      sprintf(&spec[n], "%c", *p);
+      printf(spec, d);
+      break;
+    }
+    default:
+      fputs("?", stdout);
+    }
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  int maxlevel = LOG_DEBUG, opt;
+  log_header_t hdr;
+  log_rec_t rec;
+  static uint8_t buf[1 << 16];
+  long cap = 0;
+
+  while ((opt = getopt(argc, argv, "l:")) != -1) {
+    switch (opt) {
+    case 'l':
+      maxlevel = log_level_parse(optarg);
+      if (maxlevel < 0) {
+        fprintf(stderr, "logdump: unknown level '%s'\n", optarg);
+        return 2;
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: logdump [-l level] <log>\n");
+      return 2;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: logdump [-l level] <log>\n");
+    return 2;
+  }
+
+  FILE* in = fopen(argv[optind], "rb");
+  if (in == NULL || fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+      hdr.magic != LOG_MAGIC || hdr.version != LOG_VERSION) {
+    fprintf(stderr, "logdump: '%s' is not a barefs log\n", argv[optind]);
+    return 1;
+  }
+
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    if (fread(buf, 1, rec.size, in) != rec.size) {
+      fprintf(stderr, "logdump: truncated record\n");
+      break;
+    }
+
+    if (rec.level == LOG_OFF) {
+      fmts = realloc(fmts, (num_fmts + 1) * sizeof(dump_fmt_t));
+      fmts[num_fmts].id = rec.fmt;
+      fmts[num_fmts].str = strndup((char*) buf, rec.size);
+      num_fmts++;
+      continue;
+    }
+
+    if (rec.level > maxlevel) {
+      continue;
+    }
+    if (num_msgs == cap) {
+      cap = cap ? 2 * cap : 1024;
+      msgs = realloc(msgs, cap * sizeof(dump_msg_t));
+    }
+    dump_msg_t* m = &msgs[num_msgs++];
+    m->rec = rec;
+    m->fmt = fmt_find(rec.fmt);
+    m->args = malloc(rec.size);
+    memcpy(m->args, buf, rec.size);
+  }
+  fclose(in);
+
+  // the sort is not stable: messages of a thread at the same ns may swap
+  qsort(msgs, num_msgs, sizeof(dump_msg_t), cmp_msg);
+  for (long i = 0; i < num_msgs; i++) {
+    dump_msg_t* m = &msgs[i];
+    printf("%12.6f %3u %-5s ", (int64_t) (m->rec.time - hdr.start) / 1e9,
+      m->rec.thread, level_names[m->rec.level <= LOG_DEBUG ? m->rec.level : 0]);
+    if (m->fmt == NULL) {
+      printf("(unknown format)\n");
+      continue;
+    }
+    print_message(m->fmt, m->args, m->rec.size);
+    if (m->fmt[0] == '\0' || m->fmt[strlen(m->fmt) - 1] != '\n') {
+      putchar('\n');
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Path resolution micro-benchmark
+ *
+ * pathbench.c
+ *
+ * Measures the per-operation cost of getting the parent directory and
+ * the name of a pathname, as the barefs handlers need it, at several
+ * directory depths:
+ *   - legacy: the former barefs.c parsing (myparse + myparsepathnames,
+ *     copying the pathname to stack buffers and strtok'ing it) followed
+ *     by the two fs_lookup calls the handlers used to make;
+ *   - resolve: a single fs_resolve call over the pathname in place.
+ * The legacy figures use the current fs_lookup, which itself resolves
+ * in place, so they understate the cost of the former code.
+ *
+ * Usage: pathbench [iterations]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs.h"
+
+#define MAX_DEPTH 8
+#define MAX_FILE_NAME_SIZE 14
+
+
+/*
+ * Former barefs.c pathname parsing, kept for comparison
+ */
+
+static int legacy_parse(char* pathname)
+{
+  char line[MAX_PATH_NAME_SIZE];
+  char *token;
+  char *search = "/";
+  strcpy(line,pathname);
+
+  if(strlen(line) >= MAX_PATH_NAME_SIZE || strlen(line) < 1)
+      return -1;
+
+  if (strchr(line, ' ') != NULL || strstr( (const char *) line, "//") != NULL || line[0] != '/' )
+      return -1;
+
+  token = strtok(line, search);
+  while(token != NULL) {
+      if ( strlen(token) > MAX_FILE_NAME_SIZE -1)
+      return -1;
+      token = strtok(NULL, search);
+  }
+  return 0;
+}
+
+
+static int legacy_parsepathnames(char* pathname, char* outfilename, char* outdirname)
+{
+  char newfilename[MAX_FILE_NAME_SIZE];
+  char newdirname[MAX_PATH_NAME_SIZE];
+  char fulldirname[MAX_PATH_NAME_SIZE];
+  char *token;
+  char *search="/";
+  int i;
+
+  memset(&newfilename, 0, MAX_FILE_NAME_SIZE);
+  memset(&newdirname, 0, MAX_PATH_NAME_SIZE);
+  memset(&fulldirname, 0, MAX_PATH_NAME_SIZE);
+
+  strcpy(fulldirname, pathname);
+  token = strtok(fulldirname, search);
+
+  for(i=0; token != NULL; i++) {
+    memset(&newfilename, 0, MAX_FILE_NAME_SIZE);
+    strncpy(newfilename, token, MAX_FILE_NAME_SIZE-1);
+    token = strtok(NULL, search);
+  }
+
+  if(i > 1) {
+    strncpy(newdirname, pathname, strlen(pathname)-strlen(newfilename));
+  } else {
+    strncpy(newfilename, &pathname[1], MAX_FILE_NAME_SIZE-1);
+    strncpy(newdirname, pathname, strlen(pathname)-strlen(newfilename));
+  }
+
+  strncpy(outfilename, newfilename, MAX_FILE_NAME_SIZE);
+  outfilename[MAX_FILE_NAME_SIZE-1]='\0';
+  strncpy(outdirname, newdirname, MAX_PATH_NAME_SIZE);
+  outdirname[MAX_PATH_NAME_SIZE-1]='\0';
+  return i;
+}
+
+
+static int legacy_resolve(fs_t* fs, char* path, inodeid_t* dir, inodeid_t* fileid)
+{
+  char name[MAX_FILE_NAME_SIZE];
+  char dirname[MAX_PATH_NAME_SIZE];
+
+  if (legacy_parse(path) != 0)
+    return -1;
+  int i = legacy_parsepathnames(path, name, dirname);
+  if (fs_lookup(fs, dirname, dir) != 1)
+    return -1;
+  if (i == 1)
+    *dir = 1;
+  return fs_lookup(fs, path, fileid) == 1 ? 0 : -1;
+}
+
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int main(int argc, char* argv[])
+{
+  long iters = (argc > 1) ? atol(argv[1]) : 200000;
+  char path[MAX_DEPTH+1][MAX_PATH_NAME_SIZE];
+  inodeid_t dir = 1, id;
+  const char* leaf;
+  volatile long sink = 0;
+
+  fs_t* fs = fs_new(8*512);
+  fs_format(fs);
+
+  // /d1/d2/.../dN/file for each depth N
+  char prefix[MAX_PATH_NAME_SIZE] = "";
+  for (int d = 1; d <= MAX_DEPTH; d++) {
+    char name[MAX_FILE_NAME_SIZE];
+    sprintf(name, "file%d", d);
+    if (fs_create(fs, dir, name, &id) != 0) {
+      fprintf(stderr, "pathbench: cannot create '%s'\n", name);
+      return 1;
+    }
+    sprintf(path[d], "%s/%s", prefix, name);
+
+    sprintf(name, "dir%d", d);
+    if (fs_mkdir(fs, dir, name, &dir) != 0) {
+      fprintf(stderr, "pathbench: cannot create '%s'\n", name);
+      return 1;
+    }
+    strcat(prefix, "/");
+    strcat(prefix, name);
+  }
+
+  printf("%-6s %14s %14s %8s\n", "depth", "legacy ns/op", "resolve ns/op", "speedup");
+  for (int d = 1; d <= MAX_DEPTH; d++) {
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+      sink += legacy_resolve(fs, path[d], &dir, &id) + id;
+    }
+    double t1 = now_ns();
+    for (long i = 0; i < iters; i++) {
+      sink += fs_resolve(fs, path[d], &dir, &leaf, &id) + id;
+    }
+    double t2 = now_ns();
+
+    double legacy = (t1 - t0) / iters, resolve = (t2 - t1) / iters;
+    printf("%-6d %14.1f %14.1f %7.2fx\n", d, legacy, resolve, legacy / resolve);
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Static Tracepoints
+ *
+ * probes.h
+ *
+ * USDT probes of the file system and storage layers, for perf, bpftrace
+ * or systemtap to attach to a running barefs (see bpf/). They are built
+ * in with -DHAVE_SDT (the Makefile sets it when <sys/sdt.h> exists) and
+ * cost a nop each while nothing is attached; without it they vanish.
+ *
+ * Probes (provider "barefs"):
+ *   fs_<name>__entry(inode, offset, size)  entry of the fs_<name> function,
+ *                                          with the arguments it has
+ *   fs_<name>__return(inode)               return of fs_<name>
+ *   block__alloc(block, group)             data block allocated
+ *   block__alloc_run(block, count)         contiguous blocks allocated
+ *   block__free(block)                     data block freed
+ *   inode__alloc(inode, group)             inode allocated
+ *   inode__free(inode)                     inode freed
+ *   dir__search(dir, entries, found)       directory scanned for a name
+ *   meta__flush(blocks)                    metadata written to the blocks
+ *   block__read(block, size)               block read from the storage
+ *   block__write(block, size)              block written to the storage
+ *
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(barefs, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(barefs, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(barefs, name, a, b, c)
+
+// defines the function firing fs_<name>__return, once per fs_* function
+#define PROBE_FS_RETURN(fn) \
+   static inline void probe_return_##fn(unsigned* inode) \
+   { \
+      DTRACE_PROBE1(barefs, fn##__return, *inode); \
+   }
+
+// fires fs_<name>__entry, and fs_<name>__return when the function returns
+#define PROBE_FS(fn, inode, offset, size) \
+   unsigned probe_inode __attribute__((cleanup(probe_return_##fn))) = (inode); \
+   DTRACE_PROBE3(barefs, fn##__entry, probe_inode, (unsigned) (offset), \
+      (unsigned) (size))
+
+#else
+
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE_FS_RETURN(fn)
+#define PROBE_FS(fn, inode, offset, size)
+
+#endif
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * Latency Statistics
+ *
+ * stats.c
+ *
+ * Per-thread counters and latency histograms. A thread registers its
+ * counters on its first measure and owns them: it is their only writer,
+ * so updates are plain (relaxed) stores. Readers sum the counters of the
+ * live threads, those left by the threads that exited, and subtract the
+ * sums taken at the last reset.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+
+typedef struct {
+   uint64_t count;
+   uint64_t total;          // ns
+   uint64_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+typedef struct stats_thread_ {
+   stats_hist_t hist[STATS_NUM_PROBES];
+   stats_amp_t amp[STATS_NUM_AMP];
+   int amp_op;              // operation being run, accounting the writes
+   struct stats_thread_* next;
+} stats_thread_t;
+
+
+static const char* probe_names[STATS_NUM_PROBES] = {
+   "getattr", "readdir", "open", "release", "create", "mkdir", "unlink",
+   "rmdir", "rename", "link", "mknod", "read", "write", "flush", "truncate",
+   "fallocate", "utime", "chown", "chmod", "statfs", "getxattr", "setxattr",
+   "fs_lookup", "fs_resolve", "fsi_dir_search", "fsi_block_alloc",
+   "fsi_inode_alloc", "fsi_store_fsdata", "block_read", "block_write"
+};
+
+static const char* amp_names[STATS_NUM_AMP] = {
+   "other", "create", "mkdir", "remove", "rmdir", "rmtree", "rename", "link",
+   "write", "truncate", "fallocate", "copy"
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static stats_thread_t* stats_threads;              // live threads
+static stats_hist_t stats_retired[STATS_NUM_PROBES];  // threads that exited
+static stats_hist_t stats_base[STATS_NUM_PROBES];     // sums at the last reset
+static stats_amp_t stats_amp_retired[STATS_NUM_AMP];
+static stats_amp_t stats_amp_base[STATS_NUM_AMP];
+static unsigned stats_meta_blocks;
+static __thread stats_thread_t* stats_mine;
+
+
+/*
+ * Internal functions summing histograms
+ */
+
+static void stats_sum(stats_hist_t* dst, const stats_hist_t* src)
+{
+   dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+   dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+   for (int b = 0; b < STATS_BUCKETS; b++) {
+      dst->buckets[b] += __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+   }
+}
+
+static void stats_amp_sum(stats_amp_t* dst, const stats_amp_t* src)
+{
+   dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+   dst->user_bytes += __atomic_load_n(&src->user_bytes, __ATOMIC_RELAXED);
+   dst->data_bytes += __atomic_load_n(&src->data_bytes, __ATOMIC_RELAXED);
+   dst->meta_bytes += __atomic_load_n(&src->meta_bytes, __ATOMIC_RELAXED);
+}
+
+// sums of all the threads (with the lock held)
+static void stats_collect(stats_hist_t* sums, stats_amp_t* amps)
+{
+   memcpy(sums, stats_retired, sizeof(stats_retired));
+   memcpy(amps, stats_amp_retired, sizeof(stats_amp_retired));
+   for (stats_thread_t* t = stats_threads; t != NULL; t = t->next) {
+      for (int p = 0; p < STATS_NUM_PROBES; p++) {
+         stats_sum(&sums[p], &t->hist[p]);
+      }
+      for (int a = 0; a < STATS_NUM_AMP; a++) {
+         stats_amp_sum(&amps[a], &t->amp[a]);
+      }
+   }
+}
+
+
+/*
+ * Internal functions registering the threads
+ */
+
+// moves the counters of an exiting thread to the retired ones
+static void stats_leave(void* arg)
+{
+   stats_thread_t* mine = (stats_thread_t*) arg;
+
+   pthread_mutex_lock(&stats_lock);
+   for (stats_thread_t** t = &stats_threads; *t != NULL; t = &(*t)->next) {
+      if (*t == mine) {
+         *t = mine->next;
+         break;
+      }
+   }
+   for (int p = 0; p < STATS_NUM_PROBES; p++) {
+      stats_sum(&stats_retired[p], &mine->hist[p]);
+   }
+   for (int a = 0; a < STATS_NUM_AMP; a++) {
+      stats_amp_sum(&stats_amp_retired[a], &mine->amp[a]);
+   }
+   pthread_mutex_unlock(&stats_lock);
+   free(mine);
+}
+
+static void stats_init(void)
+{
+   pthread_key_create(&stats_key, stats_leave);
+}
+
+static stats_thread_t* stats_join(void)
+{
+   stats_thread_t* mine = (stats_thread_t*) calloc(1, sizeof(stats_thread_t));
+
+   if (mine == NULL) {
+      return NULL;
+   }
+   pthread_once(&stats_once, stats_init);
+   pthread_setspecific(stats_key, mine);
+   pthread_mutex_lock(&stats_lock);
+   mine->next = stats_threads;
+   stats_threads = mine;
+   pthread_mutex_unlock(&stats_lock);
+   stats_mine = mine;
+   return mine;
+}
+
+
+uint64_t stats_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void stats_add(int probe, uint64_t ns)
+{
+   stats_thread_t* mine = stats_mine;
+
+   if (mine == NULL && (mine = stats_join()) == NULL) {
+      return;
+   }
+
+   stats_hist_t* h = &mine->hist[probe];
+   int b = (ns > 0) ? 63 - __builtin_clzll(ns) : 0;
+   if (b >= STATS_BUCKETS) {
+      b = STATS_BUCKETS - 1;
+   }
+   __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&h->total, h->total + ns, __ATOMIC_RELAXED);
+   __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+}
+
+
+void stats_amp_layout(unsigned meta)
+{
+   stats_meta_blocks = meta;
+}
+
+
+int stats_amp_enter(int op, uint64_t ops, uint64_t bytes)
+{
+   stats_thread_t* mine = stats_mine;
+
+   if (mine == NULL && (mine = stats_join()) == NULL) {
+      return STATS_AMP_OTHER;
+   }
+
+   int prev = mine->amp_op;
+   if (prev == STATS_AMP_OTHER) {
+      stats_amp_t* a = &mine->amp[op];
+      __atomic_store_n(&a->count, a->count + ops, __ATOMIC_RELAXED);
+      __atomic_store_n(&a->user_bytes, a->user_bytes + bytes, __ATOMIC_RELAXED);
+      mine->amp_op = op;
+   }
+   return prev;
+}
+
+
+void stats_amp_leave(int* prev)
+{
+   if (stats_mine != NULL) {
+      stats_mine->amp_op = *prev;
+   }
+}
+
+
+void stats_amp_write(unsigned block_no, uint64_t bytes)
+{
+   stats_thread_t* mine = stats_mine;
+
+   if (mine == NULL && (mine = stats_join()) == NULL) {
+      return;
+   }
+
+   stats_amp_t* a = &mine->amp[mine->amp_op];
+   if (block_no < stats_meta_blocks) {
+      __atomic_store_n(&a->meta_bytes, a->meta_bytes + bytes, __ATOMIC_RELAXED);
+   } else {
+      __atomic_store_n(&a->data_bytes, a->data_bytes + bytes, __ATOMIC_RELAXED);
+   }
+}
+
+
+// sums of all the threads since the last reset
+static void stats_since_reset(stats_hist_t* sums, stats_amp_t* amps)
+{
+   pthread_mutex_lock(&stats_lock);
+   stats_collect(sums, amps);
+   for (int p = 0; p < STATS_NUM_PROBES; p++) {
+      sums[p].count -= stats_base[p].count;
+      sums[p].total -= stats_base[p].total;
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+         sums[p].buckets[b] -= stats_base[p].buckets[b];
+      }
+   }
+   for (int a = 0; a < STATS_NUM_AMP; a++) {
+      amps[a].count -= stats_amp_base[a].count;
+      amps[a].user_bytes -= stats_amp_base[a].user_bytes;
+      amps[a].data_bytes -= stats_amp_base[a].data_bytes;
+      amps[a].meta_bytes -= stats_amp_base[a].meta_bytes;
+   }
+   pthread_mutex_unlock(&stats_lock);
+}
+
+
+void stats_amp(stats_amp_t amp[STATS_NUM_AMP])
+{
+   stats_hist_t sums[STATS_NUM_PROBES];
+
+   stats_since_reset(sums, amp);
+}
+
+
+const char* stats_amp_name(int op)
+{
+   return (op >= 0 && op < STATS_NUM_AMP) ? amp_names[op] : "?";
+}
+
+
+// upper bound of the bucket holding the q-th fraction of the samples
+static uint64_t stats_percentile(const stats_hist_t* h, uint64_t count, double q)
+{
+   uint64_t seen = 0, rank = (uint64_t) (q * count);
+
+   for (int b = 0; b < STATS_BUCKETS; b++) {
+      seen += h->buckets[b];
+      if (seen > rank) {
+         return (uint64_t) 1 << (b + 1);
+      }
+   }
+   return (uint64_t) 1 << STATS_BUCKETS;
+}
+
+
+int stats_format(char* buf, int size)
+{
+   stats_hist_t sums[STATS_NUM_PROBES];
+   stats_amp_t amps[STATS_NUM_AMP];
+   int len = 0;
+
+   stats_since_reset(sums, amps);
+
+#define APPEND(...) len += snprintf(buf + (len < size ? len : size), \
+      len < size ? size - len : 0, __VA_ARGS__)
+
+   APPEND("# probe count mean_ns p50_ns p99_ns log2_ns:count...\n");
+   for (int p = 0; p < STATS_NUM_PROBES; p++) {
+      stats_hist_t* h = &sums[p];
+      if (h->count == 0) {
+         APPEND("%s 0 0 0 0\n", probe_names[p]);
+         continue;
+      }
+      APPEND("%s %llu %llu %llu %llu", probe_names[p],
+         (unsigned long long) h->count,
+         (unsigned long long) (h->total / h->count),
+         (unsigned long long) stats_percentile(h, h->count, 0.5),
+         (unsigned long long) stats_percentile(h, h->count, 0.99));
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+         if (h->buckets[b] != 0) {
+            APPEND(" %d:%llu", b, (unsigned long long) h->buckets[b]);
+         }
+      }
+      APPEND("\n");
+   }
+
+   APPEND("# amp.op count user_bytes data_bytes meta_bytes amplification\n");
+   for (int a = 0; a < STATS_NUM_AMP; a++) {
+      stats_amp_t* amp = &amps[a];
+      uint64_t written = amp->data_bytes + amp->meta_bytes;
+      if (amp->count == 0 && written == 0) {
+         continue;
+      }
+      APPEND("amp.%s %llu %llu %llu %llu", amp_names[a],
+         (unsigned long long) amp->count, (unsigned long long) amp->user_bytes,
+         (unsigned long long) amp->data_bytes, (unsigned long long) amp->meta_bytes);
+      // no amplification for the operations not asked to write bytes
+      if (amp->user_bytes != 0) {
+         APPEND(" %.2f\n", (double) written / amp->user_bytes);
+      } else {
+         APPEND(" -\n");
+      }
+   }
+#undef APPEND
+   return len;
+}
+
+
+void stats_reset(void)
+{
+   pthread_mutex_lock(&stats_lock);
+   stats_collect(stats_base, stats_amp_base);
+   pthread_mutex_unlock(&stats_lock);
+}
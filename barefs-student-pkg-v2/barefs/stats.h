@@ -0,0 +1,207 @@
+/*
+ * Latency Statistics
+ *
+ * stats.h
+ *
+ * Counters and latency histograms of the barefs handlers and of the
+ * stages of the file system and storage layers below them. Each thread
+ * updates its own counters, without locks or atomic read-modify-writes;
+ * reading sums the counters of all the threads.
+ *
+ * The write amplification of the file system operations is accounted
+ * too: an operation marked with STATS_AMP gets the bytes it was asked to
+ * write and, split into data and metadata, the bytes that block_write
+ * wrote for it (STATS_WRITTEN) while it ran on the thread. An operation
+ * ended in a later call (e.g. a mapped write, whose data is copied
+ * between fs_write_map and fs_write_done) resumes its accounting with
+ * STATS_AMP_MORE, and the data moved through block_fd is accounted by
+ * block_account.
+ *
+ * The probes placed in the layers (STATS_BEGIN/STATS_END, STATS_AMP,
+ * STATS_AMP_MORE and STATS_WRITTEN) are compiled out with -DNO_STATS.
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/*
+ * stats_probe_t: the measured operations and stages
+ */
+typedef enum {
+   // barefs handlers
+   STATS_GETATTR,
+   STATS_READDIR,
+   STATS_OPEN,
+   STATS_RELEASE,
+   STATS_CREATE,
+   STATS_MKDIR,
+   STATS_UNLINK,
+   STATS_RMDIR,
+   STATS_RENAME,
+   STATS_LINK,
+   STATS_MKNOD,
+   STATS_READ,
+   STATS_WRITE,
+   STATS_FLUSH,
+   STATS_TRUNCATE,
+   STATS_FALLOCATE,
+   STATS_UTIME,
+   STATS_CHOWN,
+   STATS_CHMOD,
+   STATS_STATFS,
+   STATS_GETXATTR,
+   STATS_SETXATTR,
+   // file system layer
+   STATS_FS_LOOKUP,
+   STATS_FS_RESOLVE,
+   STATS_DIR_SEARCH,
+   STATS_BLOCK_ALLOC,
+   STATS_INODE_ALLOC,
+   STATS_STORE_FSDATA,
+   // storage layer
+   STATS_BLOCK_READ,
+   STATS_BLOCK_WRITE,
+   STATS_NUM_PROBES
+} stats_probe_t;
+
+// latency buckets: bucket i counts the latencies of [2^i, 2^(i+1)) ns
+#define STATS_BUCKETS 32
+
+
+/*
+ * stats_amp_op_t: the operations whose block writes are accounted
+ */
+typedef enum {
+   STATS_AMP_OTHER,         // block writes out of the operations below
+   STATS_AMP_CREATE,
+   STATS_AMP_MKDIR,
+   STATS_AMP_REMOVE,
+   STATS_AMP_RMDIR,
+   STATS_AMP_RMTREE,
+   STATS_AMP_RENAME,
+   STATS_AMP_LINK,
+   STATS_AMP_WRITE,
+   STATS_AMP_TRUNCATE,
+   STATS_AMP_FALLOCATE,
+   STATS_AMP_COPY,
+   STATS_NUM_AMP
+} stats_amp_op_t;
+
+// the block writes of an operation type
+typedef struct {
+   uint64_t count;          // operations
+   uint64_t user_bytes;     // bytes the operations were asked to write
+   uint64_t data_bytes;     // bytes written to data blocks
+   uint64_t meta_bytes;     // bytes written to metadata blocks
+} stats_amp_t;
+
+
+/*
+ * stats_now: gets the current time of the monotonic clock
+ *   returns: the time in ns
+ */
+uint64_t stats_now(void);
+
+
+/*
+ * stats_add: accounts one run of a probe, to the calling thread
+ * - probe: the probe
+ * - ns: its latency
+ */
+void stats_add(int probe, uint64_t ns);
+
+
+/*
+ * stats_amp_layout: sets the blocks holding metadata, for the accounting
+ * of the block writes
+ * - meta: the number of blocks, from block 0, holding metadata
+ */
+void stats_amp_layout(unsigned meta);
+
+
+/*
+ * stats_amp_enter: accounts an operation to the calling thread, that gets
+ * the block writes until stats_amp_leave (use STATS_AMP); an operation
+ * run by another one is part of it, and is not accounted
+ * - op: the operation
+ * - ops: the operations counted, 0 to resume one already counted
+ * - bytes: the bytes it was asked to write
+ *   returns: the operation being run before, for stats_amp_leave
+ */
+int stats_amp_enter(int op, uint64_t ops, uint64_t bytes);
+
+
+/*
+ * stats_amp_leave: ends the accounting of an operation
+ * - prev: the operation returned by its stats_amp_enter
+ */
+void stats_amp_leave(int* prev);
+
+
+/*
+ * stats_amp_write: accounts a block write to the operation being run by
+ * the calling thread (use STATS_WRITTEN)
+ * - block_no: the block written
+ * - bytes: the bytes written
+ */
+void stats_amp_write(unsigned block_no, uint64_t bytes);
+
+
+/*
+ * stats_amp: gets the block writes of every operation type
+ * - amp: the block writes, indexed by stats_amp_op_t [out]
+ */
+void stats_amp(stats_amp_t amp[STATS_NUM_AMP]);
+
+
+/*
+ * stats_amp_name: gets the name of an operation type
+ */
+const char* stats_amp_name(int op);
+
+
+/*
+ * stats_format: writes the statistics as text, one line per probe:
+ *   <probe> <count> <mean ns> <p50 ns> <p99 ns> <bucket>:<count> ...
+ *   (the percentiles are the upper bounds of their buckets)
+ *   and then one line per operation type with block writes:
+ *   amp.<op> <count> <user bytes> <data bytes> <meta bytes> <amplification>
+ *   (the written bytes over the user bytes, "-" without user bytes)
+ * - buf: where to write the text [out]
+ * - size: the size of 'buf'
+ *   returns: the length of the text, that was truncated if not below 'size'
+ */
+int stats_format(char* buf, int size);
+
+
+/*
+ * stats_reset: starts counting from zero
+ */
+void stats_reset(void);
+
+
+#ifdef NO_STATS
+#define STATS_BEGIN(t)
+#define STATS_END(probe, t)
+#define STATS_AMP(op, bytes)
+#define STATS_AMP_MORE(op)
+#define STATS_WRITTEN(block_no, bytes)
+#else
+#define STATS_BEGIN(t) uint64_t t = stats_now()
+#define STATS_END(probe, t) stats_add(probe, stats_now() - (t))
+// accounts the rest of the enclosing block (a function) to 'op'
+#define STATS_AMP(op, bytes) \
+   int stats_amp_prev __attribute__((cleanup(stats_amp_leave))) = \
+      stats_amp_enter(op, 1, bytes)
+// accounts the rest of the enclosing block to 'op', as part of an
+// operation already counted
+#define STATS_AMP_MORE(op) \
+   int stats_amp_prev __attribute__((cleanup(stats_amp_leave))) = \
+      stats_amp_enter(op, 0, 0)
+#define STATS_WRITTEN(block_no, bytes) stats_amp_write(block_no, bytes)
+#endif
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ * Operation Traces
+ *
+ * trace.c
+ *
+ * Recording of the traces of the file system operations. As in log.c,
+ * each recording thread owns a ring, of variable size records, where it
+ * is the only producer, and the drain thread is the only consumer of all
+ * the rings, that writes them out; recording takes no lock and never
+ * writes. The records are numbered, with an atomic counter, as they are
+ * recorded, and drained in that order, so the trace keeps the order in
+ * which the calls ended (the order replayed by tracereplay).
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+#include "log.h"
+
+#define TRACE_BUF_SIZE (64*1024)
+#define TRACE_RING_SIZE (64*1024)   // bytes per thread, a power of 2
+#define TRACE_DRAIN_US 10000        // period of the drain thread
+
+
+/*
+ * A ring holds entries of a sequence number, a record and its names,
+ * that wrap around the end of the ring
+ */
+typedef struct trace_ring_ {
+   char data[TRACE_RING_SIZE];
+   uint32_t head;           // next byte to write (by the thread)
+   uint32_t tail;           // next byte to drain (by the drain thread)
+   uint32_t dropped;        // records dropped on a full ring
+   uint32_t reported;       // drops logged by the drain thread
+   int dead;                // the thread exited, free once drained
+   struct trace_ring_* next;
+} trace_ring_t;
+
+
+static const char* op_names[TRACE_NUM_OPS] = {
+   "?", "getattr", "readdir", "open", "release", "create", "mkdir",
+   "unlink", "rmdir", "rename", "link", "read", "write", "truncate",
+   "fallocate", "statfs", "du", "clone", "copy", "rmtree", "xattr"
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_ring_t* trace_rings;
+static __thread trace_ring_t* trace_mine;
+static uint64_t trace_seq;        // number of the next record
+static uint64_t trace_drained;    // number of the next record to drain
+
+static int trace_fd = -1;
+static uint64_t trace_epoch;
+static pthread_t trace_drainer;
+static int trace_draining;
+static volatile int trace_stop;
+static unsigned trace_used;
+static char trace_buf[TRACE_BUF_SIZE];
+
+
+/*
+ * Internal functions registering the recording threads
+ */
+
+static void trace_leave(void* arg)
+{
+   trace_mine = NULL;
+   __atomic_store_n(&((trace_ring_t*) arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void trace_init(void)
+{
+   pthread_key_create(&trace_key, trace_leave);
+}
+
+static trace_ring_t* trace_join(void)
+{
+   trace_ring_t* ring = (trace_ring_t*) calloc(1, sizeof(trace_ring_t));
+
+   if (ring == NULL) {
+      return NULL;
+   }
+   pthread_once(&trace_once, trace_init);
+   pthread_setspecific(trace_key, ring);
+   pthread_mutex_lock(&trace_lock);
+   ring->next = trace_rings;
+   trace_rings = ring;
+   pthread_mutex_unlock(&trace_lock);
+   trace_mine = ring;
+   return ring;
+}
+
+
+/*
+ * Internal functions copying to and from a ring, at a byte position
+ */
+
+static void ring_put(trace_ring_t* ring, uint32_t pos, const void* src, unsigned len)
+{
+   unsigned at = pos % TRACE_RING_SIZE;
+   unsigned first = (len < TRACE_RING_SIZE - at) ? len : TRACE_RING_SIZE - at;
+
+   memcpy(ring->data + at, src, first);
+   memcpy(ring->data, (const char*) src + first, len - first);
+}
+
+static void ring_get(trace_ring_t* ring, uint32_t pos, void* dst, unsigned len)
+{
+   unsigned at = pos % TRACE_RING_SIZE;
+   unsigned first = (len < TRACE_RING_SIZE - at) ? len : TRACE_RING_SIZE - at;
+
+   memcpy(dst, ring->data + at, first);
+   memcpy((char*) dst + first, ring->data, len - first);
+}
+
+
+/*
+ * Internal function writing out the buffer (by the drain thread, or with
+ * it stopped)
+ */
+
+static void trace_flush(void)
+{
+   unsigned done = 0;
+
+   while (done < trace_used && trace_fd >= 0) {
+      ssize_t n = write(trace_fd, trace_buf + done, trace_used - done);
+      if (n <= 0) {
+         log_error("[trace_flush] Error writing the trace, recording stopped.\n");
+         close(trace_fd);
+         trace_fd = -1;
+         break;
+      }
+      done += n;
+   }
+   trace_used = 0;
+}
+
+
+/*
+ * Internal functions of the drain thread
+ */
+
+// drains the rings, in the order of the records, up to the first record
+// not published yet (with the lock held)
+static void trace_drain(void)
+{
+   int progress = 1;
+
+   while (progress) {
+      progress = 0;
+      for (trace_ring_t* ring = trace_rings; ring != NULL; ring = ring->next) {
+         uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+         uint32_t tail = ring->tail;
+
+         while (tail != head) {
+            uint64_t seq;
+            trace_rec_t rec;
+            ring_get(ring, tail, &seq, sizeof(seq));
+            if (seq != trace_drained) {
+               break;
+            }
+            ring_get(ring, tail + sizeof(seq), &rec, sizeof(rec));
+            unsigned len = sizeof(rec) + rec.namelen + rec.name2len;
+            if (trace_used + len > TRACE_BUF_SIZE) {
+               trace_flush();
+            }
+            ring_get(ring, tail + sizeof(seq), trace_buf + trace_used, len);
+            trace_used += len;
+            tail += sizeof(seq) + len;
+            trace_drained++;
+            progress = 1;
+         }
+         __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      }
+   }
+
+   for (trace_ring_t** r = &trace_rings; *r != NULL; ) {
+      trace_ring_t* ring = *r;
+      int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+      uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      if (dropped != ring->reported) {
+         log_warn("[trace] %u records dropped, the trace is incomplete.\n",
+            dropped - ring->reported);
+         ring->reported = dropped;
+      }
+
+      if (dead && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+         *r = ring->next;
+         free(ring);
+      } else {
+         r = &ring->next;
+      }
+   }
+   trace_flush();
+}
+
+static void* trace_drain_loop(void* arg)
+{
+   struct timespec period = { 0, TRACE_DRAIN_US * 1000 };
+
+   while (!trace_stop) {
+      nanosleep(&period, NULL);
+      pthread_mutex_lock(&trace_lock);
+      trace_drain();
+      pthread_mutex_unlock(&trace_lock);
+   }
+   return NULL;
+}
+
+
+/*
+ * Internal function getting the time of the monotonic clock
+ */
+
+static uint64_t trace_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+const char* trace_op_name(int op)
+{
+   if (op <= 0 || op >= TRACE_NUM_OPS) {
+      return op_names[0];
+   }
+   return op_names[op];
+}
+
+
+int trace_open(const char* path, unsigned num_blocks)
+{
+   trace_header_t hdr = { TRACE_MAGIC, TRACE_VERSION, num_blocks, 0 };
+
+   pthread_mutex_lock(&trace_lock);
+   trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (trace_fd < 0) {
+      pthread_mutex_unlock(&trace_lock);
+      return -1;
+   }
+   memcpy(trace_buf, &hdr, sizeof(hdr));
+   trace_used = sizeof(hdr);
+   trace_epoch = trace_clock();
+   pthread_mutex_unlock(&trace_lock);
+   return 0;
+}
+
+
+int trace_start(void)
+{
+   if (trace_fd < 0 || trace_draining) {
+      return -1;
+   }
+   trace_stop = 0;
+   if (pthread_create(&trace_drainer, NULL, trace_drain_loop, NULL) != 0) {
+      return -1;
+   }
+   trace_draining = 1;
+   return 0;
+}
+
+
+int trace_enabled(void)
+{
+   return trace_fd >= 0;
+}
+
+
+uint64_t trace_now(void)
+{
+   return trace_clock() - trace_epoch;
+}
+
+
+void trace_record(trace_rec_t* rec, const char* name, const char* name2)
+{
+   trace_ring_t* ring = trace_mine;
+   unsigned len, len2;
+
+   if (ring == NULL && (ring = trace_join()) == NULL) {
+      return;
+   }
+
+   if (name == NULL) {
+      name = "";
+   }
+   if (name2 == NULL) {
+      name2 = "";
+   }
+   len = strlen(name);
+   len2 = strlen(name2);
+   rec->namelen = (len > 255) ? 255 : len;
+   rec->name2len = (len2 > 255) ? 255 : len2;
+
+   uint64_t seq;
+   uint32_t head = ring->head;
+   uint32_t size = sizeof(seq) + sizeof(*rec) + rec->namelen + rec->name2len;
+   if (TRACE_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < size) {
+      __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+   ring_put(ring, head, &seq, sizeof(seq));
+   head += sizeof(seq);
+   ring_put(ring, head, rec, sizeof(*rec));
+   head += sizeof(*rec);
+   ring_put(ring, head, name, rec->namelen);
+   head += rec->namelen;
+   ring_put(ring, head, name2, rec->name2len);
+   head += rec->name2len;
+   __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+
+void trace_close(void)
+{
+   if (trace_draining) {
+      trace_stop = 1;
+      pthread_join(trace_drainer, NULL);
+      trace_draining = 0;
+   }
+   pthread_mutex_lock(&trace_lock);
+   if (trace_fd >= 0) {
+      trace_drain();
+      if (trace_fd >= 0) {
+         close(trace_fd);
+      }
+      trace_fd = -1;
+   }
+   pthread_mutex_unlock(&trace_lock);
+}
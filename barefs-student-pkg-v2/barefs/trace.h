@@ -0,0 +1,130 @@
+/*
+ * Operation Traces
+ *
+ * trace.h
+ *
+ * Format of the traces of the file system operations recorded by barefs
+ * and replayed by tracereplay, and the interface to record them.
+ *
+ * A trace is a trace_header_t followed by records: a trace_rec_t and then
+ * its names (namelen and then name2len bytes, not terminated).
+ * All the fields are in host byte order.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x52544642   // "BFTR"
+#define TRACE_VERSION 1
+
+
+/*
+ * trace_op_t: the traced operations and the meaning of their fields
+ * (ino/ino2 are the inode ids of the traced run, names are leaf names)
+ */
+typedef enum {
+   TRACE_GETATTR = 1,  // ino: object
+   TRACE_READDIR,      // ino: directory
+   TRACE_OPEN,         // ino: file
+   TRACE_RELEASE,      // ino: file
+   TRACE_CREATE,       // ino: directory, ino2: new file, name
+   TRACE_MKDIR,        // ino: directory, ino2: new directory, name
+   TRACE_UNLINK,       // ino: directory, name
+   TRACE_RMDIR,        // ino: directory, name
+   TRACE_RENAME,       // ino: old directory, ino2: new directory, name, name2
+   TRACE_LINK,         // ino: directory, ino2: file, name
+   TRACE_READ,         // ino: file, offset, size
+   TRACE_WRITE,        // ino: file, offset, size
+   TRACE_TRUNCATE,     // ino: file, size
+   TRACE_FALLOCATE,    // ino: file, ino2: FS_FALLOC_* mode, offset, size
+   TRACE_STATFS,       // -
+   TRACE_DU,           // ino: object (getxattr user.barefs.du)
+   TRACE_CLONE,        // ino: destination, ino2: source (setxattr)
+   TRACE_COPY,         // ino: destination, ino2: source (setxattr)
+   TRACE_RMTREE,       // ino: directory, name (setxattr)
+   TRACE_XATTR,        // ino: object (other extended attributes)
+   TRACE_NUM_OPS
+} trace_op_t;
+
+
+typedef struct {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t num_blocks;     // size of the traced file system
+   uint32_t reserved;
+} trace_header_t;
+
+
+typedef struct {
+   uint64_t start;          // ns since the trace was opened
+   uint32_t duration;       // ns
+   int32_t result;          // value returned to FUSE
+   uint32_t offset;
+   uint32_t size;
+   uint16_t op;             // trace_op_t
+   uint16_t ino;
+   uint16_t ino2;
+   uint8_t namelen;
+   uint8_t name2len;
+} trace_rec_t;
+
+
+/*
+ * trace_op_name: gets the name of an operation
+ * - op: the operation
+ *   returns: the name, "?" if unknown
+ */
+const char* trace_op_name(int op);
+
+
+/*
+ * trace_open: starts recording to a file (truncating it)
+ * - path: the trace file
+ * - num_blocks: the size of the traced file system
+ *   returns: 0 if successful, -1 otherwise
+ */
+int trace_open(const char* path, unsigned num_blocks);
+
+
+/*
+ * trace_start: starts the thread that drains the recorded operations to
+ * the trace file (until then, they stay in the rings of their threads)
+ *   returns: 0 if successful, -1 otherwise
+ */
+int trace_start(void);
+
+
+/*
+ * trace_enabled: tells whether operations are being recorded
+ *   returns: 1 if recording, 0 otherwise
+ */
+int trace_enabled(void);
+
+
+/*
+ * trace_now: gets the current time of the trace clock
+ *   returns: the time in ns
+ */
+uint64_t trace_now(void);
+
+
+/*
+ * trace_record: records an operation, to the ring of the calling thread
+ * (thread safe, takes no lock; dropped, and the drop logged, if the ring
+ * is full)
+ * - rec: the record, the name lengths are filled in here
+ * - name, name2: the names of the record, NULL if none
+ */
+void trace_record(trace_rec_t* rec, const char* name, const char* name2);
+
+
+/*
+ * trace_close: stops the drain thread, writes out the recorded operations
+ * and stops recording
+ */
+void trace_close(void);
+
+#endif
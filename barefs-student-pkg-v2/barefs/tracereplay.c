@@ -0,0 +1,290 @@
+/*
+ * Trace replay
+ *
+ * tracereplay.c
+ *
+ * Replays a trace recorded by barefs (BAREFS_TRACE=<file>, see trace.h)
+ * on the fs_* library, on a freshly formatted volume of the traced size:
+ * the operations are issued in the order they were recorded, either as
+ * fast as possible or, with -t, no earlier than their original start
+ * (relative to the start of the trace). The inode ids of the trace are
+ * mapped to the ones given out by the replay as objects get created, and
+ * the operations on objects that the replay does not know are skipped.
+ * The report gives, per operation, the count, the skipped ones, the ones
+ * whose outcome (success or failure) differs from the trace, and the mean
+ * latencies of the trace and of the replay with the 99th percentile of
+ * the replay. With -p the trace is printed instead, one record per line.
+ *
+ * Usage: tracereplay [-t] [-p] [-b blocks] <trace>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+#include "trace.h"
+
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+
+/*
+ * Latencies per operation
+ */
+
+typedef struct {
+  long count;
+  long skipped;
+  long differ;
+  double traced;    // total latency in the trace
+  double total;     // total latency of the replay
+  double* lat;
+  long cap;
+} replay_op_t;
+
+static replay_op_t ops[TRACE_NUM_OPS];
+
+static void op_add(replay_op_t* op, const trace_rec_t* rec, double t, int ok)
+{
+  if (op->count == op->cap) {
+    op->cap = op->cap ? 2 * op->cap : 1024;
+    op->lat = realloc(op->lat, op->cap * sizeof(double));
+  }
+  op->lat[op->count++] = t;
+  op->total += t;
+  op->traced += rec->duration;
+  if (ok != (rec->result >= 0)) {
+    op->differ++;
+  }
+}
+
+
+/*
+ * The replay
+ */
+
+static inodeid_t ids[1 << 16];   // trace inode id -> replay inode id
+static char* data;
+static unsigned data_size;
+
+static int count_entry(void* ctx, const fs_file_entry_t* entry, const fs_dir_cursor_t* next)
+{
+  (*(int*) ctx)++;
+  return 0;
+}
+
+// the replay inode of a trace inode, 0 if the replay does not know it
+static inodeid_t map(unsigned ino)
+{
+  return ino ? ids[ino] : 0;
+}
+
+// 0 if successful, -1 if it failed, 1 if skipped
+static int replay(fs_t* fs, const trace_rec_t* rec, const char* name, const char* name2)
+{
+  inodeid_t ino = map(rec->ino), ino2 = map(rec->ino2), id;
+  fs_file_attrs_t attrs;
+  fs_stats_t st;
+  unsigned bytes, files;
+  int n = 0;
+
+  switch (rec->op) {
+  case TRACE_OPEN:
+  case TRACE_RELEASE:
+  case TRACE_XATTR:
+  case TRACE_STATFS:
+    break;
+  case TRACE_FALLOCATE:
+  case TRACE_CLONE:
+  case TRACE_COPY:
+  case TRACE_RENAME:
+  case TRACE_LINK:
+    if (ino == 0 || ino2 == 0) {
+      return 1;
+    }
+    break;
+  default:
+    if (ino == 0) {
+      return 1;
+    }
+  }
+
+  if ((rec->op == TRACE_READ || rec->op == TRACE_WRITE) && rec->size > data_size) {
+    data = realloc(data, rec->size);
+    memset(data, 'r', rec->size);
+    data_size = rec->size;
+  }
+
+  switch (rec->op) {
+  case TRACE_GETATTR:
+    return fs_get_attrs(fs, ino, &attrs);
+  case TRACE_READDIR: {
+    fs_dir_cursor_t cursor = {0, 0};
+    return fs_readdir_stream(fs, ino, &cursor, count_entry, &n);
+  }
+  case TRACE_CREATE:
+  case TRACE_MKDIR:
+    if ((rec->op == TRACE_CREATE ? fs_create(fs, ino, name, &id) :
+         fs_mkdir(fs, ino, name, &id)) != 0) {
+      return -1;
+    }
+    if (rec->ino2 != 0) {
+      ids[rec->ino2] = id;
+    }
+    return 0;
+  case TRACE_UNLINK:
+    return fs_remove(fs, ino, name, &id);
+  case TRACE_RMDIR:
+    return fs_rmdir(fs, ino, name);
+  case TRACE_RENAME:
+    return fs_rename(fs, ino, name, ino2, name2);
+  case TRACE_LINK:
+    return fs_link(fs, ino, name, ino2);
+  case TRACE_READ:
+    return fs_read(fs, ino, rec->offset, rec->size, data, &n);
+  case TRACE_WRITE:
+    return fs_write(fs, ino, rec->offset, rec->size, data);
+  case TRACE_TRUNCATE:
+    return fs_truncate(fs, ino, rec->size);
+  case TRACE_FALLOCATE:
+    return fs_fallocate(fs, ino, rec->ino2, rec->offset, rec->size);
+  case TRACE_STATFS:
+    return fs_statfs(fs, &st);
+  case TRACE_DU:
+    return fs_du(fs, ino, &bytes, &files);
+  case TRACE_CLONE:
+    return fs_copy(fs, ino2, ino, FS_COPY_REFLINK);
+  case TRACE_COPY:
+    return fs_copy(fs, ino2, ino, 0);
+  case TRACE_RMTREE:
+    return fs_rmtree(fs, ino, name);
+  default:
+    return 0;
+  }
+}
+
+
+int main(int argc, char* argv[])
+{
+  int timed = 0, print = 0, opt;
+  unsigned blocks = 0;
+  trace_header_t hdr;
+  trace_rec_t rec;
+  char name[256], name2[256];
+
+  while ((opt = getopt(argc, argv, "tpb:")) != -1) {
+    switch (opt) {
+    case 't':
+      timed = 1;
+      break;
+    case 'p':
+      print = 1;
+      break;
+    case 'b':
+      blocks = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: tracereplay [-t] [-p] [-b blocks] <trace>\n");
+      return 2;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: tracereplay [-t] [-p] [-b blocks] <trace>\n");
+    return 2;
+  }
+
+  FILE* in = fopen(argv[optind], "rb");
+  if (in == NULL || fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+      hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+    fprintf(stderr, "tracereplay: '%s' is not a barefs trace\n", argv[optind]);
+    return 1;
+  }
+  if (blocks == 0) {
+    blocks = hdr.num_blocks;
+  }
+
+  FILE* out = stdout;
+
+  fs_t* fs = fs_new(blocks);
+  fs_format(fs);
+  ids[1] = 1;
+
+  long total = 0;
+  double start = now_ns();
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    if (fread(name, 1, rec.namelen, in) != rec.namelen ||
+        fread(name2, 1, rec.name2len, in) != rec.name2len) {
+      fprintf(stderr, "tracereplay: truncated record\n");
+      break;
+    }
+    name[rec.namelen] = '\0';
+    name2[rec.name2len] = '\0';
+    if (rec.op >= TRACE_NUM_OPS) {
+      continue;
+    }
+
+    if (print) {
+      fprintf(out, "%12.3f %10.3f %-10s %5u %5u %10u %10u %6d %s %s\n",
+        rec.start / 1e3, rec.duration / 1e3, trace_op_name(rec.op), rec.ino,
+        rec.ino2, rec.offset, rec.size, rec.result, name, name2);
+      continue;
+    }
+
+    if (timed) {
+      double ahead = rec.start - (now_ns() - start);
+      if (ahead > 0) {
+        struct timespec ts = { (time_t) (ahead / 1e9), (long) ahead % 1000000000 };
+        nanosleep(&ts, NULL);
+      }
+    }
+    double t0 = now_ns();
+    int res = replay(fs, &rec, name, name2);
+    double t = now_ns() - t0;
+    if (res == 1) {
+      ops[rec.op].skipped++;
+      continue;
+    }
+    op_add(&ops[rec.op], &rec, t, res == 0);
+    total++;
+  }
+  double elapsed = now_ns() - start;
+  fclose(in);
+
+  if (!print) {
+    fprintf(out, "%-10s %10s %8s %8s %12s %12s %12s\n", "op", "count", "skipped",
+      "differ", "trace us", "replay us", "p99 us");
+    for (int i = 1; i < TRACE_NUM_OPS; i++) {
+      replay_op_t* op = &ops[i];
+      if (op->count == 0 && op->skipped == 0) {
+        continue;
+      }
+      qsort(op->lat, op->count, sizeof(double), cmp_double);
+      fprintf(out, "%-10s %10ld %8ld %8ld %12.2f %12.2f %12.2f\n", trace_op_name(i),
+        op->count, op->skipped, op->differ,
+        op->count ? op->traced / op->count / 1e3 : 0.0,
+        op->count ? op->total / op->count / 1e3 : 0.0,
+        op->count ? op->lat[op->count * 99 / 100] / 1e3 : 0.0);
+      free(op->lat);
+    }
+    fprintf(out, "%ld operations in %.3f s (%.0f ops/s)\n", total, elapsed / 1e9,
+      elapsed > 0 ? total / (elapsed / 1e9) : 0.0);
+  }
+  fclose(out);
+  return 0;
+}